@@ -2,10 +2,45 @@
 /******************************************************************************/
 #ifdef JEMALLOC_H_TYPES
 
+typedef struct swap_map_s swap_map_t;
+
+/*
+ * Maximum number of levels of the chunk map, which covers up to
+ * 2^(SWAP_MAP_LEVELS_MAX * LG_BITMAP_GROUP_NBITS) chunks.
+ */
+#define	SWAP_MAP_LEVELS_MAX	6
+
 #endif /* JEMALLOC_H_TYPES */
 /******************************************************************************/
 #ifdef JEMALLOC_H_STRUCTS
 
+/*
+ * Map of the chunk slots in [swap_base, swap_max), kept in the heap.  It is
+ * a hierarchical bitmap laid out as in bitmap.h: the bottom level has a bit
+ * set for each free chunk below swap_end, and a bit of an upper level is set
+ * if the group below it has a bit set, so that a free chunk is found without
+ * scanning the groups of chunks in use.  Adjacent free chunks form a free
+ * extent without being coalesced explicitly.
+ */
+struct swap_map_s {
+	/* Number of chunk slots. */
+	size_t		nbits;
+
+	/* Number of levels of the free chunk bitmap. */
+	unsigned	nlevels;
+
+	/* Offsets of the levels within groups, bottom to top. */
+	size_t		levels[SWAP_MAP_LEVELS_MAX+1];
+
+	/*
+	 * Offset within groups of a flat bitmap of the free chunks that are
+	 * known to read as zeros.
+	 */
+	size_t		zeroed;
+
+	bitmap_t	groups[1]; /* Dynamically sized. */
+};
+
 #endif /* JEMALLOC_H_STRUCTS */
 /******************************************************************************/
 #ifdef JEMALLOC_H_EXTERNS
@@ -20,15 +55,39 @@ extern size_t		swap_avail;
 #endif
 
 void	*chunk_alloc_swap(size_t size, bool *zero);
-bool	chunk_in_swap(void *chunk);
 bool	chunk_dealloc_swap(void *chunk, size_t size);
-bool	chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed);
+void	*chunk_swap_free_next(void *addr, size_t *size);
+bool	chunk_swap_extend(size_t size);
+void	chunk_swap_reset(void *old_end, bool punch);
+bool	chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed,
+    bool privmap, size_t maxsize);
+bool	chunk_swap_map_boot(void);
 bool	chunk_swap_boot(void);
 
 #endif /* JEMALLOC_H_EXTERNS */
 /******************************************************************************/
 #ifdef JEMALLOC_H_INLINES
 
+#ifndef JEMALLOC_ENABLE_INLINE
+bool	chunk_in_swap(void *chunk);
+#endif
+
+#if (defined(JEMALLOC_ENABLE_INLINE) || defined(JEMALLOC_CHUNK_SWAP_C_))
+/*
+ * The bounds of the swap region do not change once it is enabled, so no lock
+ * is needed to test them.
+ */
+JEMALLOC_INLINE bool
+chunk_in_swap(void *chunk)
+{
+
+	assert(swap_enabled);
+
+	return ((uintptr_t)chunk >= (uintptr_t)swap_base &&
+	    (uintptr_t)chunk < (uintptr_t)swap_max);
+}
+#endif
+
 #endif /* JEMALLOC_H_INLINES */
 /******************************************************************************/
 #endif /* JEMALLOC_SWAP */
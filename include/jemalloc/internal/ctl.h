@@ -3,6 +3,7 @@
 
 typedef struct ctl_node_s ctl_node_t;
 typedef struct ctl_arena_stats_s ctl_arena_stats_t;
+typedef struct ctl_node_stats_s ctl_node_stats_t;
 typedef struct ctl_stats_s ctl_stats_t;
 
 #endif /* JEMALLOC_H_TYPES */
@@ -46,6 +47,14 @@ struct ctl_arena_stats_s {
 #endif
 };
 
+/* Sums over the arenas of a NUMA node (see numa.h). */
+struct ctl_node_stats_s {
+	unsigned		narenas_init;	/* Initialized arenas. */
+	unsigned		nthreads;
+	size_t			pactive;
+	size_t			nchunks;	/* Heap chunks placed on it. */
+};
+
 struct ctl_stats_s {
 #ifdef JEMALLOC_STATS
 	size_t			allocated;
@@ -63,6 +72,7 @@ struct ctl_stats_s {
 	} huge;
 #endif
 	ctl_arena_stats_t	*arenas;	/* (narenas + 1) elements. */
+	ctl_node_stats_t	*nodes;		/* numa_nnodes elements. */
 #ifdef JEMALLOC_SWAP
 	size_t			swap_avail;
 #endif
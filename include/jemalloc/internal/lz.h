@@ -0,0 +1,34 @@
+/*
+ * Fast LZ77 block compressor used for compressed backup images.  A block is a
+ * sequence of (literals, match) pairs, each introduced by a token byte whose
+ * high nibble is the literal length and low nibble the match length minus
+ * LZ_MINMATCH; a nibble of 15 is extended by following bytes, each added to
+ * it, until a byte other than 255.  A match is given by a two byte little
+ * endian offset.  The last pair of a block has literals only.
+ */
+/******************************************************************************/
+#ifdef JEMALLOC_H_TYPES
+
+#define	LZ_MINMATCH	4
+#define	LZ_MAXOFF	65535
+
+/* Number of entries in the compressor's hash table. */
+#define	LZ_LG_HASH	12
+
+#endif /* JEMALLOC_H_TYPES */
+/******************************************************************************/
+#ifdef JEMALLOC_H_STRUCTS
+
+#endif /* JEMALLOC_H_STRUCTS */
+/******************************************************************************/
+#ifdef JEMALLOC_H_EXTERNS
+
+size_t	lz_compress(const void *src, size_t slen, void *dst, size_t dcap);
+bool	lz_decompress(const void *src, size_t slen, void *dst, size_t dlen);
+
+#endif /* JEMALLOC_H_EXTERNS */
+/******************************************************************************/
+#ifdef JEMALLOC_H_INLINES
+
+#endif /* JEMALLOC_H_INLINES */
+/******************************************************************************/
@@ -0,0 +1,78 @@
+/******************************************************************************/
+#ifdef JEMALLOC_H_TYPES
+
+/* Nodes that chunks can be placed on (a node is recorded in a byte). */
+#define	NUMA_NODES_MAX		255
+
+#endif /* JEMALLOC_H_TYPES */
+/******************************************************************************/
+#ifdef JEMALLOC_H_STRUCTS
+
+#endif /* JEMALLOC_H_STRUCTS */
+/******************************************************************************/
+#ifdef JEMALLOC_H_EXTERNS
+
+extern bool	opt_numa;
+
+/*
+ * Number of nodes that the arenas are spread over: arena i belongs to node
+ * (i % numa_nnodes). 1 unless opt_numa is set.
+ */
+extern unsigned	numa_nnodes;
+/* Node of each CPU, numa_ncpus elements. */
+extern unsigned	numa_ncpus;
+extern unsigned char	*numa_cpu_node;
+
+void	numa_bind(void *chunk, size_t size, unsigned node);
+void	numa_unbind(void *chunk, size_t size);
+void	numa_place(void);
+size_t	numa_nchunks(unsigned node);
+bool	numa_boot(void);
+
+#endif /* JEMALLOC_H_EXTERNS */
+/******************************************************************************/
+#ifdef JEMALLOC_H_INLINES
+
+#ifndef JEMALLOC_ENABLE_INLINE
+unsigned	numa_node(void);
+unsigned	numa_arena_node(unsigned ind);
+unsigned	numa_cpu_arena(unsigned cpu, unsigned n);
+#endif
+
+#if (defined(JEMALLOC_ENABLE_INLINE) || defined(JEMALLOC_NUMA_C_))
+/* Node of the CPU that the calling thread runs on. */
+JEMALLOC_INLINE unsigned
+numa_node(void)
+{
+	int cpu;
+
+	if (numa_nnodes == 1)
+		return (0);
+	cpu = sched_getcpu();
+	if (cpu < 0 || (unsigned)cpu >= numa_ncpus)
+		return (0);
+	return (numa_cpu_node[cpu]);
+}
+
+JEMALLOC_INLINE unsigned
+numa_arena_node(unsigned ind)
+{
+
+	return (ind % numa_nnodes);
+}
+
+/*
+ * Index of the arena for cpu among the first n arenas, on the node of the
+ * CPU. The CPUs of a node are spread over its (n / numa_nnodes) arenas.
+ */
+JEMALLOC_INLINE unsigned
+numa_cpu_arena(unsigned cpu, unsigned n)
+{
+	unsigned node = (cpu < numa_ncpus) ? numa_cpu_node[cpu] : 0;
+
+	return ((cpu % (n / numa_nnodes)) * numa_nnodes + node);
+}
+#endif
+
+#endif /* JEMALLOC_H_INLINES */
+/******************************************************************************/
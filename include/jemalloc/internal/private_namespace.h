@@ -23,6 +23,7 @@
 #define	arenas_bin_i_index JEMALLOC_N(arenas_bin_i_index)
 #define	arenas_extend JEMALLOC_N(arenas_extend)
 #define	arenas_lrun_i_index JEMALLOC_N(arenas_lrun_i_index)
+#define	arenas_resize JEMALLOC_N(arenas_resize)
 #define	atomic_add_uint32 JEMALLOC_N(atomic_add_uint32)
 #define	atomic_add_uint64 JEMALLOC_N(atomic_add_uint64)
 #define	atomic_sub_uint32 JEMALLOC_N(atomic_sub_uint32)
@@ -43,6 +44,7 @@
 #define	bt_init JEMALLOC_N(bt_init)
 #define	buferror JEMALLOC_N(buferror)
 #define	choose_arena JEMALLOC_N(choose_arena)
+#define	choose_arena_cpu JEMALLOC_N(choose_arena_cpu)
 #define	choose_arena_hard JEMALLOC_N(choose_arena_hard)
 #define	chunk_alloc JEMALLOC_N(chunk_alloc)
 #define	chunk_alloc_dss JEMALLOC_N(chunk_alloc_dss)
@@ -60,6 +62,10 @@
 #define	chunk_mmap_boot JEMALLOC_N(chunk_mmap_boot)
 #define	chunk_swap_boot JEMALLOC_N(chunk_swap_boot)
 #define	chunk_swap_enable JEMALLOC_N(chunk_swap_enable)
+#define	chunk_swap_extend JEMALLOC_N(chunk_swap_extend)
+#define	chunk_swap_free_next JEMALLOC_N(chunk_swap_free_next)
+#define	chunk_swap_map_boot JEMALLOC_N(chunk_swap_map_boot)
+#define	chunk_swap_reset JEMALLOC_N(chunk_swap_reset)
 #define	ckh_bucket_search JEMALLOC_N(ckh_bucket_search)
 #define	ckh_count JEMALLOC_N(ckh_count)
 #define	ckh_delete JEMALLOC_N(ckh_delete)
@@ -79,6 +85,8 @@
 #define	ckh_try_insert JEMALLOC_N(ckh_try_insert)
 #define	create_zone JEMALLOC_N(create_zone)
 #define	ctl_boot JEMALLOC_N(ctl_boot)
+#define	crc32c JEMALLOC_N(crc32c)
+#define	crc32c_boot JEMALLOC_N(crc32c_boot)
 #define	ctl_bymib JEMALLOC_N(ctl_bymib)
 #define	ctl_byname JEMALLOC_N(ctl_byname)
 #define	ctl_nametomib JEMALLOC_N(ctl_nametomib)
@@ -135,6 +143,8 @@
 #define	jemalloc_darwin_init JEMALLOC_N(jemalloc_darwin_init)
 #define	jemalloc_postfork JEMALLOC_N(jemalloc_postfork)
 #define	jemalloc_prefork JEMALLOC_N(jemalloc_prefork)
+#define	lz_compress JEMALLOC_N(lz_compress)
+#define	lz_decompress JEMALLOC_N(lz_decompress)
 #define	malloc_cprintf JEMALLOC_N(malloc_cprintf)
 #define	malloc_mutex_destroy JEMALLOC_N(malloc_mutex_destroy)
 #define	malloc_mutex_init JEMALLOC_N(malloc_mutex_init)
@@ -144,6 +154,18 @@
 #define	malloc_printf JEMALLOC_N(malloc_printf)
 #define	malloc_write JEMALLOC_N(malloc_write)
 #define	mb_write JEMALLOC_N(mb_write)
+#define	numa_arena_node JEMALLOC_N(numa_arena_node)
+#define	numa_bind JEMALLOC_N(numa_bind)
+#define	numa_boot JEMALLOC_N(numa_boot)
+#define	numa_cpu_arena JEMALLOC_N(numa_cpu_arena)
+#define	numa_nchunks JEMALLOC_N(numa_nchunks)
+#define	numa_node JEMALLOC_N(numa_node)
+#define	numa_place JEMALLOC_N(numa_place)
+#define	numa_unbind JEMALLOC_N(numa_unbind)
+#define	perm_flush_get JEMALLOC_N(perm_flush_get)
+#define	perm_flush_lag JEMALLOC_N(perm_flush_lag)
+#define	perm_flush_set JEMALLOC_N(perm_flush_set)
+#define	perm_swap_released JEMALLOC_N(perm_swap_released)
 #define	pow2_ceil JEMALLOC_N(pow2_ceil)
 #define	prof_backtrace JEMALLOC_N(prof_backtrace)
 #define	prof_boot0 JEMALLOC_N(prof_boot0)
@@ -168,6 +190,16 @@
 #define	rtree_set JEMALLOC_N(rtree_set)
 #define	s2u JEMALLOC_N(s2u)
 #define	sa2u JEMALLOC_N(sa2u)
+#define	safepoint_asym JEMALLOC_N(safepoint_asym)
+#define	safepoint_begin JEMALLOC_N(safepoint_begin)
+#define	safepoint_boot JEMALLOC_N(safepoint_boot)
+#define	safepoint_end JEMALLOC_N(safepoint_end)
+#define	safepoint_enter JEMALLOC_N(safepoint_enter)
+#define	safepoint_leave JEMALLOC_N(safepoint_leave)
+#define	safepoint_park JEMALLOC_N(safepoint_park)
+#define	safepoint_pending JEMALLOC_N(safepoint_pending)
+#define	safepoint_register JEMALLOC_N(safepoint_register)
+#define	safepoint_stats JEMALLOC_N(safepoint_stats)
 #define	stats_arenas_i_bins_j_index JEMALLOC_N(stats_arenas_i_bins_j_index)
 #define	stats_arenas_i_index JEMALLOC_N(stats_arenas_i_index)
 #define	stats_arenas_i_lruns_j_index JEMALLOC_N(stats_arenas_i_lruns_j_index)
@@ -188,7 +220,9 @@
 #define	tcache_dalloc_small JEMALLOC_N(tcache_dalloc_small)
 #define	tcache_destroy JEMALLOC_N(tcache_destroy)
 #define	tcache_event JEMALLOC_N(tcache_event)
+#define	tcache_flush_all JEMALLOC_N(tcache_flush_all)
 #define	tcache_get JEMALLOC_N(tcache_get)
+#define	tcache_invalidate_all JEMALLOC_N(tcache_invalidate_all)
 #define	tcache_stats_merge JEMALLOC_N(tcache_stats_merge)
 #define	thread_allocated_get JEMALLOC_N(thread_allocated_get)
 #define	thread_allocated_get_hard JEMALLOC_N(thread_allocated_get_hard)
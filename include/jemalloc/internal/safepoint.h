@@ -0,0 +1,96 @@
+/******************************************************************************/
+#ifdef JEMALLOC_H_TYPES
+
+typedef struct safepoint_s safepoint_t;
+
+/*
+ * Orders the stores of an allocator call before the store that leaves it.
+ * x86 does not reorder stores with other stores, nor loads with loads.
+ */
+#if (defined(__i386__) || defined(__amd64__) || defined(__x86_64__))
+#  define	SAFEPOINT_RELEASE()	__asm__ __volatile__("" ::: "memory")
+#else
+#  define	SAFEPOINT_RELEASE()	__sync_synchronize()
+#endif
+
+#endif /* JEMALLOC_H_TYPES */
+/******************************************************************************/
+#ifdef JEMALLOC_H_STRUCTS
+
+/* Per thread record of allocator calls in progress. */
+struct safepoint_s {
+	/* Nesting depth of allocator calls, 0 outside of the allocator. */
+	volatile unsigned	depth;
+
+	/* In safepoint_list. */
+	bool			registered;
+	ql_elm(safepoint_t)	link;
+};
+
+#endif /* JEMALLOC_H_STRUCTS */
+/******************************************************************************/
+#ifdef JEMALLOC_H_EXTERNS
+
+#ifndef NO_TLS
+extern __thread safepoint_t	safepoint_tls
+    JEMALLOC_ATTR(tls_model("initial-exec"));
+#endif
+/* Set while a checkpoint has, or is waiting for, the allocator to itself. */
+extern volatile bool	safepoint_pending;
+/* membarrier() orders the entries of all threads for the checkpointer. */
+extern bool		safepoint_asym;
+
+void	safepoint_register(safepoint_t *sp);
+void	safepoint_park(safepoint_t *sp);
+void	safepoint_begin(void);
+void	safepoint_end(void);
+void	safepoint_stats(uint64_t *count, uint64_t *wait_last,
+    uint64_t *wait_max, uint64_t *pause_last, uint64_t *pause_max);
+bool	safepoint_boot(void);
+
+#endif /* JEMALLOC_H_EXTERNS */
+/******************************************************************************/
+#ifdef JEMALLOC_H_INLINES
+
+#ifndef JEMALLOC_ENABLE_INLINE
+void	safepoint_enter(void);
+void	safepoint_leave(void);
+#endif
+
+#if (defined(JEMALLOC_ENABLE_INLINE) || defined(JEMALLOC_SAFEPOINT_C_))
+/* Enter the allocator, first waiting for a pending checkpoint to end. */
+JEMALLOC_INLINE void
+safepoint_enter(void)
+{
+#ifndef NO_TLS
+	safepoint_t *sp = &safepoint_tls;
+
+	if (sp->depth++ != 0)
+		return;
+	if (sp->registered == false)
+		safepoint_register(sp);
+	/* The depth must be visible before the flag is read. */
+	if (safepoint_asym)
+		__asm__ __volatile__("" ::: "memory");
+	else
+		__sync_synchronize();
+	if (safepoint_pending)
+		safepoint_park(sp);
+#endif
+}
+
+JEMALLOC_INLINE void
+safepoint_leave(void)
+{
+#ifndef NO_TLS
+	safepoint_t *sp = &safepoint_tls;
+
+	if (sp->depth == 1)
+		SAFEPOINT_RELEASE();
+	sp->depth--;
+#endif
+}
+#endif
+
+#endif /* JEMALLOC_H_INLINES */
+/******************************************************************************/
@@ -55,6 +55,7 @@ struct tcache_s {
 #  ifdef JEMALLOC_STATS
 	ql_elm(tcache_t) link;		/* Used for aggregating stats. */
 #  endif
+	ql_elm(tcache_t) all_link;	/* Used for flushing all tcaches. */
 #  ifdef JEMALLOC_PROF
 	uint64_t	prof_accumbytes;/* Cleared after arena_prof_accum() */
 #  endif
@@ -120,6 +121,8 @@ void	tcache_bin_flush_large(tcache_bin_t *tbin, size_t binind, unsigned rem
 #endif
     );
 tcache_t *tcache_create(arena_t *arena);
+void	tcache_flush_all(void);
+void	tcache_invalidate_all(void);
 void	*tcache_alloc_small_hard(tcache_t *tcache, tcache_bin_t *tbin,
     size_t binind);
 void	tcache_destroy(tcache_t *tcache);
@@ -305,7 +308,8 @@ tcache_alloc_large(tcache_t *tcache, size_t size, bool zero)
 		 * Only allocate one large object at a time, because it's quite
 		 * expensive to create one and not use it.
 		 */
-		ret = arena_malloc_large(tcache->arena, size, zero);
+		ret = arena_malloc_large(opt_percpu_arena ? choose_arena() :
+		    tcache->arena, size, zero);
 		if (ret == NULL)
 			return (NULL);
 	} else {
@@ -388,9 +392,7 @@ tcache_dalloc_small(tcache_t *tcache, void *ptr)
 JEMALLOC_INLINE void
 tcache_dalloc_large(tcache_t *tcache, void *ptr, size_t size)
 {
-	arena_t *arena;
-	arena_chunk_t *chunk;
-	size_t pageind, binind;
+	size_t binind;
 	tcache_bin_t *tbin;
 	tcache_bin_info_t *tbin_info;
 
@@ -398,9 +400,6 @@ tcache_dalloc_large(tcache_t *tcache, void *ptr, size_t size)
 	assert(arena_salloc(ptr) > small_maxclass);
 	assert(arena_salloc(ptr) <= tcache_maxclass);
 
-	chunk = (arena_chunk_t *)CHUNK_ADDR2BASE(ptr);
-	arena = chunk->arena;
-	pageind = ((uintptr_t)ptr - (uintptr_t)chunk) >> PAGE_SHIFT;
 	binind = nbins + (size >> PAGE_SHIFT) - 1;
 
 #ifdef JEMALLOC_FILL
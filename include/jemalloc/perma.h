@@ -81,6 +81,30 @@ int mclose(void);
 /* Flushes in-core data to memory-mapped file */
 int mflush(void);
 
+/* Flushes a range of the heap and its allocator metadata */
+int mflush_range(void *ptr, size_t len);
+
+/* Flushes an allocated object and its allocator metadata */
+int pflush(void *ptr);
+
+/* Begin a transaction */
+int ptx_begin(void);
+
+/* Log a range of the heap or globals before it is changed */
+int ptx_add_range(void *ptr, size_t len);
+
+/* Allocate an object that is freed if the transaction rolls back */
+void *ptx_malloc(size_t size);
+
+/* Free an object when the transaction commits */
+void ptx_free(void *ptr);
+
+/* Make the changes of the transaction durable */
+int ptx_commit(void);
+
+/* Roll back the changes of the transaction */
+int ptx_abort(void);
+
 /* Open backup file */
 int bopen(const char *fname, const char *mode);
 
@@ -90,7 +114,19 @@ int bclose(void);
 /* Backup globals and heap to backup file */
 int backup(void);
 
+/* Start a backup and return while it is written */
+int backup_async(void);
+
+/* Check on a background backup: 1 running, 0 done, -1 error */
+int backup_poll(void);
+
+/* Wait for a background backup to finish: 0 done, -1 error */
+int backup_wait(void);
+
 /* Restore globals and heap from backup file */
 int restore(void);
 
+/* Verify a lazily restored heap range (all if ptr is NULL) against the backup */
+int restore_verify(const void *ptr, size_t size);
+
 #endif /* _PERMA_H */
@@ -495,6 +495,8 @@ arena_chunk_alloc(arena_t *arena)
 		zero = false;
 		malloc_mutex_unlock(&arena->lock);
 		chunk = (arena_chunk_t *)chunk_alloc(chunksize, false, &zero);
+		if (chunk != NULL)
+			numa_bind(chunk, chunksize, numa_arena_node(arena->ind));
 		malloc_mutex_lock(&arena->lock);
 		if (chunk == NULL)
 			return (NULL);
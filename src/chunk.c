@@ -124,6 +124,7 @@ chunk_dealloc(void *chunk, size_t size, bool unmap)
 	stats_chunks.curchunks -= (size / chunksize);
 	malloc_mutex_unlock(&chunks_mtx);
 #endif
+	numa_unbind(chunk, size);
 
 	if (unmap) {
 #ifdef JEMALLOC_SWAP
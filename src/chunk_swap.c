@@ -15,230 +15,477 @@ int		*swap_fds;
 size_t		swap_avail;
 #endif
 
+/*
+ * A single file may be mapped past its end, and is then extended as swap_end
+ * moves forward and truncated as it moves back.  Freed extents of a single
+ * file are released by punching holes in it, unless swap_punch is off.
+ */
+static int	swap_fd = -1;
+static bool	swap_grow;
+static bool	swap_punch;
+static size_t	swap_file_size;
+
+/* Without files, the heap is anonymous memory. */
+static bool	swap_anon;
+
+/*
+ * lg(chunksize) when swap was enabled, which indexes swap_map.  opt_lg_chunk
+ * may be set later by malloc_conf_init() without changing chunksize.
+ */
+static unsigned	swap_lg_chunk;
 
 /******************************************************************************/
 /* Function prototypes for non-inline static functions. */
 
-static void	*chunk_recycle_swap(size_t size, bool *zero);
-static extent_node_t *chunk_dealloc_swap_record(void *chunk, size_t size);
+static size_t	swap_map_bits2groups(size_t nbits);
+static size_t	swap_map_layout(swap_map_t *map, size_t nbits);
+static void	swap_map_set(swap_map_t *map, size_t bit);
+static void	swap_map_unset(swap_map_t *map, size_t bit);
+static size_t	swap_map_next(swap_map_t *map, size_t bit);
+static size_t	swap_map_run_end(swap_map_t *map, size_t bit);
+static size_t	swap_map_run_start(swap_map_t *map, size_t bit);
+static void	swap_map_free(swap_map_t *map, size_t bit, size_t n,
+    bool zeroed);
+static bool	swap_map_zeroed(swap_map_t *map, size_t bit, size_t n);
+static void	swap_map_alloc(swap_map_t *map, size_t bit, size_t n);
+static void	*chunk_recycle_swap(size_t size, bool *zeroed);
+static bool	chunk_swap_release(void *chunk, size_t size);
+static bool	chunk_swap_truncate(size_t size);
 
 /******************************************************************************/
 
-static void *
-chunk_recycle_swap(size_t size, bool *zero)
+static size_t
+swap_map_bits2groups(size_t nbits)
 {
-	extent_node_t *node, key;
 
-	key.addr = NULL;
-	key.size = size;
-	malloc_mutex_lock(&swap_mtx);
-	node = extent_tree_szad_nsearch(&swap_chunks_szad, &key);
-	if (node != NULL) {
-		void *ret = node->addr;
-
-		/* Remove node from the tree. */
-		extent_tree_szad_remove(&swap_chunks_szad, node);
-		if (node->size == size) {
-			extent_tree_ad_remove(&swap_chunks_ad, node);
-			base_node_dealloc(node);
-		} else {
-			/*
-			 * Insert the remainder of node's address range as a
-			 * smaller chunk.  Its position within swap_chunks_ad
-			 * does not change.
-			 */
-			assert(node->size > size);
-			node->addr = (void *)((uintptr_t)node->addr + size);
-			node->size -= size;
-			extent_tree_szad_insert(&swap_chunks_szad, node);
-		}
-#ifdef JEMALLOC_STATS
-		swap_avail -= size;
-#endif
-		malloc_mutex_unlock(&swap_mtx);
+	return ((nbits >> LG_BITMAP_GROUP_NBITS) +
+	    !!(nbits & BITMAP_GROUP_NBITS_MASK));
+}
 
-		if (*zero)
-			memset(ret, 0, size);
-		return (ret);
+/*
+ * Set up the levels of a map of nbits chunk slots, as bitmap_info_init()
+ * does, and return the size of the map.
+ */
+static size_t
+swap_map_layout(swap_map_t *map, size_t nbits)
+{
+	unsigned i;
+	size_t group_count;
+
+	assert(nbits > 0);
+
+	map->levels[0] = 0;
+	group_count = swap_map_bits2groups(nbits);
+	for (i = 1; group_count > 1; i++) {
+		assert(i < SWAP_MAP_LEVELS_MAX);
+		map->levels[i] = map->levels[i-1] + group_count;
+		group_count = swap_map_bits2groups(group_count);
 	}
-	malloc_mutex_unlock(&swap_mtx);
+	map->levels[i] = map->levels[i-1] + group_count;
+	map->nlevels = i;
+	map->nbits = nbits;
+	map->zeroed = map->levels[i];
 
-	return (NULL);
+	return (offsetof(swap_map_t, groups) + ((map->zeroed +
+	    swap_map_bits2groups(nbits)) << LG_SIZEOF_BITMAP));
 }
 
-void *
-chunk_alloc_swap(size_t size, bool *zero)
+/* Mark a chunk free, and its groups up the tree as having a free chunk. */
+static void
+swap_map_set(swap_map_t *map, size_t bit)
 {
-	void *ret;
-
-	assert(swap_enabled);
+	unsigned i;
 
-	ret = chunk_recycle_swap(size, zero);
-	if (ret != NULL)
-		return (ret);
+	assert(bit < map->nbits);
 
-	malloc_mutex_lock(&swap_mtx);
-	if ((uintptr_t)swap_end + size <= (uintptr_t)swap_max) {
-		ret = swap_end;
-		swap_end = (void *)((uintptr_t)swap_end + size);
-#ifdef JEMALLOC_STATS
-		swap_avail -= size;
-#endif
-		malloc_mutex_unlock(&swap_mtx);
+	for (i = 0; i < map->nlevels; i++) {
+		bitmap_t *gp = &map->groups[map->levels[i] + (bit >>
+		    LG_BITMAP_GROUP_NBITS)];
+		bitmap_t g = *gp;
 
-		if (swap_prezeroed)
-			*zero = true;
-		else if (*zero)
-			memset(ret, 0, size);
-	} else {
-		malloc_mutex_unlock(&swap_mtx);
-		return (NULL);
+		*gp = g | (1LU << (bit & BITMAP_GROUP_NBITS_MASK));
+		/* The levels above already know of the group. */
+		if (g != 0)
+			break;
+		bit >>= LG_BITMAP_GROUP_NBITS;
 	}
+}
 
-	return (ret);
+/* Mark a chunk in use, and clear the bits of groups left with no free chunk. */
+static void
+swap_map_unset(swap_map_t *map, size_t bit)
+{
+	unsigned i;
+
+	assert(bit < map->nbits);
+
+	for (i = 0; i < map->nlevels; i++) {
+		bitmap_t *gp = &map->groups[map->levels[i] + (bit >>
+		    LG_BITMAP_GROUP_NBITS)];
+		bitmap_t g = *gp & ~(1LU << (bit & BITMAP_GROUP_NBITS_MASK));
+
+		*gp = g;
+		if (g != 0)
+			break;
+		bit >>= LG_BITMAP_GROUP_NBITS;
+	}
 }
 
-static extent_node_t *
-chunk_dealloc_swap_record(void *chunk, size_t size)
+/*
+ * First free chunk at or after bit, or map->nbits if there is none.  The
+ * search climbs the levels until a group has a bit set past the position, and
+ * then descends to the first free chunk below that bit.
+ */
+static size_t
+swap_map_next(swap_map_t *map, size_t bit)
 {
-	extent_node_t *xnode, *node, *prev, key;
-
-	xnode = NULL;
-	while (true) {
-		key.addr = (void *)((uintptr_t)chunk + size);
-		node = extent_tree_ad_nsearch(&swap_chunks_ad, &key);
-		/* Try to coalesce forward. */
-		if (node != NULL && node->addr == key.addr) {
-			/*
-			 * Coalesce chunk with the following address range.
-			 * This does not change the position within
-			 * swap_chunks_ad, so only remove/insert from/into
-			 * swap_chunks_szad.
-			 */
-			extent_tree_szad_remove(&swap_chunks_szad, node);
-			node->addr = chunk;
-			node->size += size;
-			extent_tree_szad_insert(&swap_chunks_szad, node);
+	unsigned i;
+
+	for (i = 0; i < map->nlevels; i++) {
+		size_t goff = bit >> LG_BITMAP_GROUP_NBITS;
+		bitmap_t g;
+
+		if (map->levels[i] + goff >= map->levels[i+1])
 			break;
-		} else if (xnode == NULL) {
-			/*
-			 * It is possible that base_node_alloc() will cause a
-			 * new base chunk to be allocated, so take care not to
-			 * deadlock on swap_mtx, and recover if another thread
-			 * deallocates an adjacent chunk while this one is busy
-			 * allocating xnode.
-			 */
-			malloc_mutex_unlock(&swap_mtx);
-			xnode = base_node_alloc();
-			malloc_mutex_lock(&swap_mtx);
-			if (xnode == NULL)
-				return (NULL);
+		g = map->groups[map->levels[i] + goff] & (~0LU << (bit &
+		    BITMAP_GROUP_NBITS_MASK));
+		if (g != 0) {
+			bit = (goff << LG_BITMAP_GROUP_NBITS) + (ffsl(g) - 1);
+			while (i > 0) {
+				i--;
+				g = map->groups[map->levels[i] + bit];
+				bit = (bit << LG_BITMAP_GROUP_NBITS) +
+				    (ffsl(g) - 1);
+			}
+			return (bit);
+		}
+		/* Continue with the bit of the next group one level up. */
+		bit = goff + 1;
+	}
+	return (map->nbits);
+}
+
+/* First chunk in use at or after bit, or map->nbits if there is none. */
+static size_t
+swap_map_run_end(swap_map_t *map, size_t bit)
+{
+	size_t goff = bit >> LG_BITMAP_GROUP_NBITS;
+	bitmap_t g;
+
+	if (bit >= map->nbits)
+		return (map->nbits);
+	g = ~map->groups[goff] & (~0LU << (bit & BITMAP_GROUP_NBITS_MASK));
+	while (g == 0) {
+		goff++;
+		if ((goff << LG_BITMAP_GROUP_NBITS) >= map->nbits)
+			return (map->nbits);
+		g = ~map->groups[goff];
+	}
+	bit = (goff << LG_BITMAP_GROUP_NBITS) + (ffsl(g) - 1);
+	return ((bit < map->nbits) ? bit : map->nbits);
+}
+
+/* First chunk of the run of free chunks that ends at bit. */
+static size_t
+swap_map_run_start(swap_map_t *map, size_t bit)
+{
+
+	while (bit > 0) {
+		size_t goff = (bit - 1) >> LG_BITMAP_GROUP_NBITS;
+		size_t nb = ((bit - 1) & BITMAP_GROUP_NBITS_MASK) + 1;
+		bitmap_t g = ~map->groups[goff];
+
+		/* Only the nb bits of the group below bit count. */
+		if (nb < BITMAP_GROUP_NBITS)
+			g &= (1LU << nb) - 1;
+		if (g != 0) {
+			while ((g & (1LU << (nb - 1))) == 0)
+				nb--;
+			return ((goff << LG_BITMAP_GROUP_NBITS) + nb);
+		}
+		bit = goff << LG_BITMAP_GROUP_NBITS;
+	}
+	return (0);
+}
+
+/* Mark n chunks free, and record whether they read as zeros. */
+static void
+swap_map_free(swap_map_t *map, size_t bit, size_t n, bool zeroed)
+{
+	bitmap_t *zg = &map->groups[map->zeroed];
+	size_t i;
+
+	for (i = bit; i < bit + n; i++) {
+		swap_map_set(map, i);
+		if (zeroed) {
+			zg[i >> LG_BITMAP_GROUP_NBITS] |= 1LU << (i &
+			    BITMAP_GROUP_NBITS_MASK);
 		} else {
-			/* Coalescing forward failed, so insert a new node. */
-			node = xnode;
-			xnode = NULL;
-			node->addr = chunk;
-			node->size = size;
-			extent_tree_ad_insert(&swap_chunks_ad, node);
-			extent_tree_szad_insert(&swap_chunks_szad, node);
-			break;
+			zg[i >> LG_BITMAP_GROUP_NBITS] &= ~(1LU << (i &
+			    BITMAP_GROUP_NBITS_MASK));
 		}
 	}
-	/* Discard xnode if it ended up unused do to a race. */
-	if (xnode != NULL)
-		base_node_dealloc(xnode);
-
-	/* Try to coalesce backward. */
-	prev = extent_tree_ad_prev(&swap_chunks_ad, node);
-	if (prev != NULL && (void *)((uintptr_t)prev->addr + prev->size) ==
-	    chunk) {
-		/*
-		 * Coalesce chunk with the previous address range.  This does
-		 * not change the position within swap_chunks_ad, so only
-		 * remove/insert node from/into swap_chunks_szad.
-		 */
-		extent_tree_szad_remove(&swap_chunks_szad, prev);
-		extent_tree_ad_remove(&swap_chunks_ad, prev);
+}
 
-		extent_tree_szad_remove(&swap_chunks_szad, node);
-		node->addr = prev->addr;
-		node->size += prev->size;
-		extent_tree_szad_insert(&swap_chunks_szad, node);
+/* Whether n free chunks all read as zeros. */
+static bool
+swap_map_zeroed(swap_map_t *map, size_t bit, size_t n)
+{
+	bitmap_t *zg = &map->groups[map->zeroed];
+	size_t i;
 
-		base_node_dealloc(prev);
+	for (i = bit; i < bit + n; i++) {
+		if ((zg[i >> LG_BITMAP_GROUP_NBITS] & (1LU << (i &
+		    BITMAP_GROUP_NBITS_MASK))) == 0)
+			return (false);
 	}
+	return (true);
+}
 
-	return (node);
+/* Mark n free chunks in use. */
+static void
+swap_map_alloc(swap_map_t *map, size_t bit, size_t n)
+{
+	size_t i;
+
+	for (i = bit; i < bit + n; i++)
+		swap_map_unset(map, i);
 }
 
-bool
-chunk_in_swap(void *chunk)
+/*
+ * Take the first run of free chunks that is large enough (first fit).  The
+ * caller must hold swap_mtx.
+ */
+static void *
+chunk_recycle_swap(size_t size, bool *zeroed)
 {
-	bool ret;
+	swap_map_t *map = swap_map;
+	size_t n = size >> swap_lg_chunk;
+	size_t bit, end;
+
+	if (map == NULL)
+		return (NULL);
+	for (bit = swap_map_next(map, 0); bit < map->nbits; bit =
+	    swap_map_next(map, end)) {
+		end = swap_map_run_end(map, bit);
+		if (end - bit >= n) {
+			*zeroed = swap_map_zeroed(map, bit, n);
+			swap_map_alloc(map, bit, n);
+			return ((void *)((uintptr_t)swap_base + (bit <<
+			    swap_lg_chunk)));
+		}
+	}
+	return (NULL);
+}
+
+void *
+chunk_alloc_swap(size_t size, bool *zero)
+{
+	void *ret;
+	bool zeroed;
 
 	assert(swap_enabled);
 
 	malloc_mutex_lock(&swap_mtx);
-	if ((uintptr_t)chunk >= (uintptr_t)swap_base
-	    && (uintptr_t)chunk < (uintptr_t)swap_max)
-		ret = true;
-	else
-		ret = false;
+	ret = chunk_recycle_swap(size, &zeroed);
+	if (ret == NULL) {
+		if ((uintptr_t)swap_end + size > (uintptr_t)swap_max ||
+		    chunk_swap_extend((uintptr_t)swap_end + size -
+		    (uintptr_t)swap_base)) {
+			malloc_mutex_unlock(&swap_mtx);
+			return (NULL);
+		}
+		ret = swap_end;
+		swap_end = (void *)((uintptr_t)swap_end + size);
+		zeroed = swap_prezeroed;
+	}
+#ifdef JEMALLOC_STATS
+	swap_avail -= size;
+#endif
 	malloc_mutex_unlock(&swap_mtx);
 
+	if (zeroed)
+		*zero = true;
+	else if (*zero)
+		memset(ret, 0, size);
+
 	return (ret);
 }
 
 bool
 chunk_dealloc_swap(void *chunk, size_t size)
 {
-	bool ret;
+	swap_map_t *map;
+	size_t bit, end;
+	bool zeroed;
 
 	assert(swap_enabled);
 
+	if (chunk_in_swap(chunk) == false)
+		return (true);
+
 	malloc_mutex_lock(&swap_mtx);
-	if ((uintptr_t)chunk >= (uintptr_t)swap_base
-	    && (uintptr_t)chunk < (uintptr_t)swap_max) {
-		extent_node_t *node;
-
-		/* Try to coalesce with other unused chunks. */
-		node = chunk_dealloc_swap_record(chunk, size);
-		if (node != NULL) {
-			chunk = node->addr;
-			size = node->size;
+	map = swap_map;
+	bit = ((uintptr_t)chunk - (uintptr_t)swap_base) >> swap_lg_chunk;
+	end = bit + (size >> swap_lg_chunk);
+	zeroed = chunk_swap_release(chunk, size);
+	/*
+	 * Without a map (only before chunk_swap_map_boot()), a chunk that is
+	 * not at the end of the in-use memory is lost.
+	 */
+	if (map != NULL)
+		swap_map_free(map, bit, end - bit, zeroed);
+
+	/*
+	 * Try to shrink the in-use memory if this chunk is at the end of it,
+	 * together with the free chunks before it.  The chunks must read back
+	 * as zeros when swap_end moves over them again, so they stay free if
+	 * they could neither be released nor truncated.
+	 */
+	if ((void *)((uintptr_t)chunk + size) == swap_end) {
+		if (map != NULL) {
+			bit = swap_map_run_start(map, end);
+			zeroed = swap_map_zeroed(map, bit, end - bit);
 		}
-
-		/*
-		 * Try to shrink the in-use memory if this chunk is at the end
-		 * of the in-use memory.
-		 */
-		if ((void *)((uintptr_t)chunk + size) == swap_end) {
-			swap_end = (void *)((uintptr_t)swap_end - size);
-
-			if (node != NULL) {
-				extent_tree_szad_remove(&swap_chunks_szad,
-				    node);
-				extent_tree_ad_remove(&swap_chunks_ad, node);
-				base_node_dealloc(node);
-			}
-		} else
-			madvise(chunk, size, MADV_DONTNEED);
+		if (chunk_swap_truncate(bit << swap_lg_chunk) == false ||
+		    zeroed) {
+			if (map != NULL)
+				swap_map_alloc(map, bit, end - bit);
+			swap_end = (void *)((uintptr_t)swap_base + (bit <<
+			    swap_lg_chunk));
+		}
+	}
 
 #ifdef JEMALLOC_STATS
-		swap_avail += size;
+	swap_avail += size;
 #endif
-		ret = false;
-		goto RETURN;
-	}
-
-	ret = true;
-RETURN:
 	malloc_mutex_unlock(&swap_mtx);
+	return (false);
+}
+
+/*
+ * First free extent at or after addr, whose size is returned in *size, or
+ * NULL if there is none below swap_end.  The caller must hold swap_mtx, or
+ * have stopped the other threads.
+ */
+void *
+chunk_swap_free_next(void *addr, size_t *size)
+{
+	swap_map_t *map = swap_map;
+	size_t bit;
+
+	if (map == NULL)
+		return (NULL);
+	bit = CHUNK_CEILING((uintptr_t)addr - (uintptr_t)swap_base) >>
+	    swap_lg_chunk;
+	bit = swap_map_next(map, bit);
+	if (bit >= map->nbits)
+		return (NULL);
+	*size = (swap_map_run_end(map, bit) - bit) << swap_lg_chunk;
+	return ((void *)((uintptr_t)swap_base + (bit << swap_lg_chunk)));
+}
+
+/*
+ * Extend a growable file to cover the first size bytes of the mapping.  The
+ * caller must hold swap_mtx.
+ */
+bool
+chunk_swap_extend(size_t size)
+{
+
+	if (swap_grow == false || size <= swap_file_size)
+		return (false);
+	if (ftruncate(swap_fd, size) != 0)
+		return (true);
+	swap_file_size = size;
+	return (false);
+}
+
+/*
+ * Truncate a growable file to size bytes, which then read back as zeros if
+ * the file grows again.  Returns true if it was not truncated.
+ */
+static bool
+chunk_swap_truncate(size_t size)
+{
+
+	if (swap_grow == false || size >= swap_file_size)
+		return (true);
+	if (ftruncate(swap_fd, size) != 0)
+		return (true);
+	perm_swap_released((void *)((uintptr_t)swap_base + size),
+	    swap_file_size - size);
+	swap_file_size = size;
+	return (false);
+}
+
+/*
+ * Give the pages of a free extent back to the system.  A hole is punched in
+ * the file where possible, and the extent then reads back as zeros, even in
+ * a private mapping once its copies are dropped; true is returned in that
+ * case, and for an anonymous heap, and perm_swap_released() is told so that
+ * incremental backups hold the extent.  Otherwise only the memory is
+ * released.
+ */
+static bool
+chunk_swap_release(void *chunk, size_t size)
+{
+	bool ret = false;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (swap_punch && fallocate(swap_fd, FALLOC_FL_PUNCH_HOLE |
+	    FALLOC_FL_KEEP_SIZE, (uintptr_t)chunk - (uintptr_t)swap_base,
+	    size) == 0)
+		ret = true;
+#endif
+	if (madvise(chunk, size, MADV_DONTNEED) == 0 && swap_anon)
+		ret = true;
+	if (ret)
+		perm_swap_released(chunk, size);
 	return (ret);
 }
 
+/*
+ * Release the free extents and the pages in [swap_end, old_end) after the
+ * heap has been replaced underneath the allocator (e.g. by a restore), since
+ * their contents are then unknown.  While punch is false, the mapping is not
+ * backed by the file, so no holes are punched, and the free extents are not
+ * known to be zeroed.  The caller must hold swap_mtx.
+ */
+void
+chunk_swap_reset(void *old_end, bool punch)
+{
+	swap_map_t *map = swap_map;
+
+	size_t bit, end;
+
+	assert(map != NULL);
+
+	swap_punch = (punch && swap_fd != -1);
+	for (bit = swap_map_next(map, 0); bit < map->nbits; bit =
+	    swap_map_next(map, end)) {
+		end = swap_map_run_end(map, bit);
+		swap_map_free(map, bit, end - bit,
+		    chunk_swap_release((void *)((uintptr_t)swap_base + (bit <<
+		    swap_lg_chunk)), (end - bit) << swap_lg_chunk));
+	}
+
+	if ((uintptr_t)old_end > (uintptr_t)swap_end &&
+	    chunk_swap_truncate((uintptr_t)swap_end - (uintptr_t)swap_base) &&
+	    chunk_swap_release(swap_end, (uintptr_t)old_end -
+	    (uintptr_t)swap_end) == false)
+		memset(swap_end, 0, (uintptr_t)old_end - (uintptr_t)swap_end);
+}
+
+/*
+ * Map the files at swap_base.  With a single file and a maxsize larger than
+ * the file, maxsize bytes are mapped, and the file is extended as chunks
+ * past its end are allocated.  With no files, the heap is maxsize bytes of
+ * anonymous memory.
+ */
 bool
-chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed)
+chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed, bool privmap,
+    size_t maxsize)
 {
 	bool ret;
 	unsigned i;
@@ -279,6 +526,17 @@ chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed)
 
 	/* Round down to a multiple of the chunk size. */
 	cumsize &= ~chunksize_mask;
+	swap_fd = (nfds == 1) ? fds[0] : -1;
+	swap_grow = false;
+	if (nfds == 1 && (maxsize & ~chunksize_mask) > cumsize) {
+		swap_grow = true;
+		swap_file_size = sizes[0];
+		cumsize = sizes[0] = maxsize & ~chunksize_mask;
+	}
+	swap_punch = (swap_fd != -1);
+	swap_anon = (nfds == 0);
+	if (swap_anon)
+		cumsize = maxsize & ~chunksize_mask;
 	if (cumsize == 0) {
 		ret = true;
 		goto RETURN;
@@ -301,14 +559,42 @@ chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed)
 			ret = true;
 			goto RETURN;
 		}
+		if (swap_anon) {
+			/*
+			 * Map anonymous memory at swap_base, but don't replace
+			 * anything already mapped there.
+			 */
+			void *addr = mmap(vaddr, cumsize, PROT_READ |
+			    PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
+			    -1, 0);
+
+			if (addr != vaddr) {
+				if (addr != MAP_FAILED)
+					munmap(addr, cumsize);
+				ret = true;
+				goto RETURN;
+			}
+		}
 	}
 
-	/* Overlay the files onto the anonymous mapping. */
+	/*
+	 * Overlay the files onto the anonymous mapping.  A private mapping is
+	 * copy-on-write, so changes reach the files only when written back
+	 * explicitly.  A growable mapping is not charged (or, on hugetlbfs,
+	 * given huge pages) up front for its limit.
+	 */
 	for (i = 0, voff = 0; i < nfds; i++) {
 		int fds_flags = fcntl(fds[i], F_GETFL);
 		int prot = PROT_READ | ((O_WRONLY|O_RDWR) & fds_flags ? PROT_WRITE : 0);
-		void *addr = mmap((void *)((uintptr_t)vaddr + voff), sizes[i],
-		    prot, MAP_FIXED | MAP_SHARED, fds[i], 0);
+		int flags = MAP_FIXED | (privmap ? MAP_PRIVATE : MAP_SHARED);
+		void *addr;
+
+#ifdef MAP_NORESERVE
+		if (swap_grow)
+			flags |= MAP_NORESERVE;
+#endif
+		addr = mmap((void *)((uintptr_t)vaddr + voff), sizes[i], prot,
+		    flags, fds[i], 0);
 		if (addr == MAP_FAILED) {
 			char buf[BUFERROR_BUF];
 
@@ -346,6 +632,7 @@ chunk_swap_enable(const int *fds, unsigned nfds, bool prezeroed)
 		voff += sizes[i];
 	}
 
+	swap_lg_chunk = ffsl(chunksize) - 1;
 	swap_base = vaddr;
 	swap_end = swap_base;
 	swap_max = (void *)((uintptr_t)vaddr + cumsize);
@@ -363,6 +650,34 @@ RETURN:
 	return (ret);
 }
 
+/*
+ * Create the chunk map of the swap region in the heap, once swap_base and
+ * swap_max are set and (for a persistent heap) plib is in the heap.
+ */
+bool
+chunk_swap_map_boot(void)
+{
+	swap_map_t info, *map;
+	size_t size;
+
+	if (swap_map != NULL)
+		return (false);
+
+	size = swap_map_layout(&info, ((uintptr_t)swap_max -
+	    (uintptr_t)swap_base) >> swap_lg_chunk);
+	map = (swap_map_t *)base_alloc(size);
+	if (map == NULL)
+		return (true);
+	memset(map, 0, size);
+	memcpy(map, &info, offsetof(swap_map_t, groups));
+
+	malloc_mutex_lock(&swap_mtx);
+	swap_map = map;
+	malloc_mutex_unlock(&swap_mtx);
+
+	return (false);
+}
+
 bool
 chunk_swap_boot(void)
 {
@@ -377,9 +692,7 @@ chunk_swap_boot(void)
 		swap_base = NULL;
 		swap_end = NULL;
 		swap_max = NULL;
-
-		extent_tree_szad_new(&swap_chunks_szad);
-		extent_tree_ad_new(&swap_chunks_ad);
+		swap_map = NULL;
 	}
 
 	return (false);
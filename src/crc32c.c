@@ -0,0 +1,178 @@
+#define	JEMALLOC_CRC32C_C_
+#include "jemalloc/internal/jemalloc_internal.h"
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI and ext4.  On x86-64 the SSE4.2
+ * crc32 instruction is used when the CPU has it, running three independent
+ * streams to hide the instruction's latency; the stream registers are then
+ * combined with tables that advance a CRC over CRC32C_STREAM zero bytes.
+ * Elsewhere a slicing-by-8 table implementation is used.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) &&				\
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#  define CRC32C_HW
+#endif
+
+/* Reflected Castagnoli polynomial. */
+#define	CRC32C_POLY	0x82f63b78U
+
+/******************************************************************************/
+/* Data. */
+
+static bool	crc32c_booted;
+static uint32_t	crc32c_table[8][256];
+#ifdef CRC32C_HW
+static bool	crc32c_hw;
+static uint32_t	crc32c_shift_table[4][256];
+#endif
+
+/******************************************************************************/
+/* Function prototypes for non-inline static functions. */
+
+static uint32_t	crc32c_sw(uint32_t crc, const unsigned char *p, size_t len);
+#ifdef CRC32C_HW
+static uint32_t	crc32c_shift(uint32_t crc);
+static uint32_t	crc32c_hw3(uint32_t crc, const unsigned char *p, size_t len);
+#endif
+
+/******************************************************************************/
+
+/* Advance the CRC register over len bytes, without pre or post inversion. */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^
+		    crc32c_table[6][(v >> 8) & 0xff] ^
+		    crc32c_table[5][(v >> 16) & 0xff] ^
+		    crc32c_table[4][(v >> 24) & 0xff] ^
+		    crc32c_table[3][(v >> 32) & 0xff] ^
+		    crc32c_table[2][(v >> 40) & 0xff] ^
+		    crc32c_table[1][(v >> 48) & 0xff] ^
+		    crc32c_table[0][v >> 56];
+	}
+	for (; len > 0; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return (crc);
+}
+
+#ifdef CRC32C_HW
+/* Advance the CRC register over CRC32C_STREAM zero bytes. */
+static uint32_t
+crc32c_shift(uint32_t crc)
+{
+
+	return (crc32c_shift_table[0][crc & 0xff] ^
+	    crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+	    crc32c_shift_table[2][(crc >> 16) & 0xff] ^
+	    crc32c_shift_table[3][crc >> 24]);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw3(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c0 = crc;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		c0 = __builtin_ia32_crc32qi((uint32_t)c0, *p++);
+	for (; len >= 3 * CRC32C_STREAM; len -= 3 * CRC32C_STREAM) {
+		const unsigned char *end = p + CRC32C_STREAM;
+		uint64_t c1 = 0, c2 = 0;
+
+		for (; p < end; p += 8) {
+			uint64_t v0, v1, v2;
+
+			memcpy(&v0, p, 8);
+			memcpy(&v1, p + CRC32C_STREAM, 8);
+			memcpy(&v2, p + 2 * CRC32C_STREAM, 8);
+			c0 = __builtin_ia32_crc32di(c0, v0);
+			c1 = __builtin_ia32_crc32di(c1, v1);
+			c2 = __builtin_ia32_crc32di(c2, v2);
+		}
+		c0 = crc32c_shift(crc32c_shift((uint32_t)c0) ^ (uint32_t)c1) ^
+		    (uint32_t)c2;
+		p += 2 * CRC32C_STREAM;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		c0 = __builtin_ia32_crc32di(c0, v);
+	}
+	for (; len > 0; len--)
+		c0 = __builtin_ia32_crc32qi((uint32_t)c0, *p++);
+	return ((uint32_t)c0);
+}
+#endif
+
+/* Set up the tables; must be called before crc32c() and is idempotent. */
+void
+crc32c_boot(void)
+{
+	unsigned i, j;
+
+	if (crc32c_booted)
+		return;
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			uint32_t crc = crc32c_table[j - 1][i];
+
+			crc32c_table[j][i] = crc32c_table[0][crc & 0xff] ^
+			    (crc >> 8);
+		}
+	}
+#ifdef CRC32C_HW
+	{
+		static const unsigned char zeros[CRC32C_STREAM];
+		uint32_t basis[32];
+
+		/* The shift is linear, so tabulate it from the unit vectors. */
+		for (i = 0; i < 32; i++)
+			basis[i] = crc32c_sw(1U << i, zeros, CRC32C_STREAM);
+		for (i = 0; i < 4; i++) {
+			for (j = 0; j < 256; j++) {
+				uint32_t v = 0;
+				unsigned b;
+
+				for (b = 0; b < 8; b++) {
+					if (j & (1U << b))
+						v ^= basis[8 * i + b];
+				}
+				crc32c_shift_table[i][j] = v;
+			}
+		}
+	}
+	__builtin_cpu_init();
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+	crc32c_booted = true;
+}
+
+/* Extend crc (0 to start) over len bytes at buf. */
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+
+	assert(crc32c_booted);
+#ifdef CRC32C_HW
+	if (crc32c_hw)
+		return (~crc32c_hw3(~crc, p, len));
+#endif
+	return (~crc32c_sw(~crc, p, len));
+}
@@ -17,6 +17,9 @@ malloc_mutex_t	ctl_mtx;
 static bool		ctl_initialized;
 static uint64_t		ctl_epoch;
 static ctl_stats_t	ctl_stats;
+/* narenas as of the last refresh, and the arenas that ctl_stats can hold. */
+static unsigned		ctl_narenas;
+static unsigned		ctl_narenas_max;
 
 /******************************************************************************/
 /* Function prototypes for non-inline static functions. */
@@ -40,6 +43,7 @@ static void	ctl_arena_stats_smerge(ctl_arena_stats_t *sstats,
     ctl_arena_stats_t *astats);
 #endif
 static void	ctl_arena_refresh(arena_t *arena, unsigned i);
+static bool	ctl_arenas_extend(void);
 static void	ctl_refresh(void);
 static bool	ctl_init(void);
 static int	ctl_lookup(const char *name, ctl_node_t const **nodesp,
@@ -77,6 +81,8 @@ CTL_PROTO(opt_lg_qspace_max)
 CTL_PROTO(opt_lg_cspace_max)
 CTL_PROTO(opt_lg_chunk)
 CTL_PROTO(opt_narenas)
+CTL_PROTO(opt_percpu_arena)
+CTL_PROTO(opt_numa)
 CTL_PROTO(opt_lg_dirty_mult)
 CTL_PROTO(opt_stats_print)
 #ifdef JEMALLOC_FILL
@@ -116,6 +122,7 @@ CTL_PROTO(arenas_lrun_i_size)
 INDEX_PROTO(arenas_lrun_i)
 CTL_PROTO(arenas_narenas)
 CTL_PROTO(arenas_initialized)
+CTL_PROTO(arenas_nnodes)
 CTL_PROTO(arenas_quantum)
 CTL_PROTO(arenas_cacheline)
 CTL_PROTO(arenas_subpage)
@@ -194,6 +201,11 @@ CTL_PROTO(stats_arenas_i_nmadvise)
 CTL_PROTO(stats_arenas_i_purged)
 #endif
 INDEX_PROTO(stats_arenas_i)
+CTL_PROTO(stats_nodes_i_narenas)
+CTL_PROTO(stats_nodes_i_nthreads)
+CTL_PROTO(stats_nodes_i_pactive)
+CTL_PROTO(stats_nodes_i_nchunks)
+INDEX_PROTO(stats_nodes_i)
 #ifdef JEMALLOC_STATS
 CTL_PROTO(stats_cactive)
 CTL_PROTO(stats_allocated)
@@ -207,6 +219,15 @@ CTL_PROTO(swap_avail)
 CTL_PROTO(swap_prezeroed)
 CTL_PROTO(swap_nfds)
 CTL_PROTO(swap_fds)
+CTL_PROTO(swap_flush_level)
+CTL_PROTO(swap_flush_interval)
+CTL_PROTO(swap_flush_dirty)
+CTL_PROTO(swap_flush_lag)
+CTL_PROTO(swap_safepoint_count)
+CTL_PROTO(swap_safepoint_wait_last)
+CTL_PROTO(swap_safepoint_wait_max)
+CTL_PROTO(swap_safepoint_pause_last)
+CTL_PROTO(swap_safepoint_pause_max)
 #endif
 
 /******************************************************************************/
@@ -266,6 +287,8 @@ static const ctl_node_t opt_node[] = {
 	{NAME("lg_cspace_max"),		CTL(opt_lg_cspace_max)},
 	{NAME("lg_chunk"),		CTL(opt_lg_chunk)},
 	{NAME("narenas"),		CTL(opt_narenas)},
+	{NAME("percpu_arena"),		CTL(opt_percpu_arena)},
+	{NAME("numa"),			CTL(opt_numa)},
 	{NAME("lg_dirty_mult"),		CTL(opt_lg_dirty_mult)},
 	{NAME("stats_print"),		CTL(opt_stats_print)}
 #ifdef JEMALLOC_FILL
@@ -332,6 +355,7 @@ static const ctl_node_t arenas_lrun_node[] = {
 static const ctl_node_t arenas_node[] = {
 	{NAME("narenas"),		CTL(arenas_narenas)},
 	{NAME("initialized"),		CTL(arenas_initialized)},
+	{NAME("nnodes"),		CTL(arenas_nnodes)},
 	{NAME("quantum"),		CTL(arenas_quantum)},
 	{NAME("cacheline"),		CTL(arenas_cacheline)},
 	{NAME("subpage"),		CTL(arenas_subpage)},
@@ -461,6 +485,20 @@ static const ctl_node_t stats_arenas_node[] = {
 	{INDEX(stats_arenas_i)}
 };
 
+static const ctl_node_t stats_nodes_i_node[] = {
+	{NAME("narenas"),		CTL(stats_nodes_i_narenas)},
+	{NAME("nthreads"),		CTL(stats_nodes_i_nthreads)},
+	{NAME("pactive"),		CTL(stats_nodes_i_pactive)},
+	{NAME("nchunks"),		CTL(stats_nodes_i_nchunks)}
+};
+static const ctl_node_t super_stats_nodes_i_node[] = {
+	{NAME(""),			CHILD(stats_nodes_i)}
+};
+
+static const ctl_node_t stats_nodes_node[] = {
+	{INDEX(stats_nodes_i)}
+};
+
 static const ctl_node_t stats_node[] = {
 #ifdef JEMALLOC_STATS
 	{NAME("cactive"),		CTL(stats_cactive)},
@@ -470,17 +508,35 @@ static const ctl_node_t stats_node[] = {
 	{NAME("chunks"),		CHILD(stats_chunks)},
 	{NAME("huge"),			CHILD(stats_huge)},
 #endif
-	{NAME("arenas"),		CHILD(stats_arenas)}
+	{NAME("arenas"),		CHILD(stats_arenas)},
+	{NAME("nodes"),			CHILD(stats_nodes)}
 };
 
 #ifdef JEMALLOC_SWAP
+static const ctl_node_t swap_flush_node[] = {
+	{NAME("level"),			CTL(swap_flush_level)},
+	{NAME("interval"),		CTL(swap_flush_interval)},
+	{NAME("dirty"),			CTL(swap_flush_dirty)},
+	{NAME("lag"),			CTL(swap_flush_lag)}
+};
+
+static const ctl_node_t swap_safepoint_node[] = {
+	{NAME("count"),			CTL(swap_safepoint_count)},
+	{NAME("wait_last"),		CTL(swap_safepoint_wait_last)},
+	{NAME("wait_max"),		CTL(swap_safepoint_wait_max)},
+	{NAME("pause_last"),		CTL(swap_safepoint_pause_last)},
+	{NAME("pause_max"),		CTL(swap_safepoint_pause_max)}
+};
+
 static const ctl_node_t swap_node[] = {
 #  ifdef JEMALLOC_STATS
 	{NAME("avail"),			CTL(swap_avail)},
 #  endif
 	{NAME("prezeroed"),		CTL(swap_prezeroed)},
 	{NAME("nfds"),			CTL(swap_nfds)},
-	{NAME("fds"),			CTL(swap_fds)}
+	{NAME("fds"),			CTL(swap_fds)},
+	{NAME("flush"),			CHILD(swap_flush)},
+	{NAME("safepoint"),		CHILD(swap_safepoint)}
 };
 #endif
 
@@ -640,6 +696,59 @@ ctl_arena_refresh(arena_t *arena, unsigned i)
 #endif
 }
 
+/*
+ * Make room in ctl_stats for narenas arenas, which arenas_resize() may have
+ * increased on reopen or restore.  The old array is not freed (temp_malloc()
+ * memory never is), so it is replaced by one at least twice its size.
+ */
+static bool
+ctl_arenas_extend(void)
+{
+	ctl_arena_stats_t *astats;
+	unsigned max;
+#ifdef JEMALLOC_STATS
+	unsigned i;
+#endif
+
+	if (ctl_stats.arenas != NULL && narenas <= ctl_narenas_max)
+		return (false);
+	max = narenas;
+	if (ctl_stats.arenas != NULL && max < ctl_narenas_max * 2)
+		max = ctl_narenas_max * 2;
+	/*
+	 * Allocate space for one extra arena stats element, which contains
+	 * summed stats across all arenas.
+	 */
+	astats = (ctl_arena_stats_t *)temp_malloc((max + 1) *
+	    sizeof(ctl_arena_stats_t));
+	if (astats == NULL)
+		return (true);
+	memset(astats, 0, (max + 1) * sizeof(ctl_arena_stats_t));
+	/*
+	 * Reuse the per bin stats buffers of the old elements; their contents
+	 * are recomputed by ctl_refresh().
+	 */
+	if (ctl_stats.arenas != NULL) {
+		memcpy(astats, ctl_stats.arenas, (ctl_narenas_max + 1) *
+		    sizeof(ctl_arena_stats_t));
+	}
+
+	/*
+	 * Initialize all stats structures, regardless of whether they ever get
+	 * used.  Lazy initialization would allow errors to cause inconsistent
+	 * state to be viewable by the application.
+	 */
+#ifdef JEMALLOC_STATS
+	for (i = 0; i <= max; i++) {
+		if (ctl_arena_init(&astats[i]))
+			return (true);
+	}
+#endif
+	ctl_stats.arenas = astats;
+	ctl_narenas_max = max;
+	return (false);
+}
+
 static void
 ctl_refresh(void)
 {
@@ -666,6 +775,11 @@ ctl_refresh(void)
 	 */
 	ctl_stats.arenas[narenas].nthreads = 0;
 	ctl_arena_clear(&ctl_stats.arenas[narenas]);
+	ctl_stats.arenas[narenas].initialized = true;
+	/* Elements past the sum are left over from a longer arenas array. */
+	for (i = narenas + 1; i <= ctl_narenas_max; i++)
+		ctl_stats.arenas[i].initialized = false;
+	ctl_narenas = narenas;
 
 	malloc_mutex_lock(&arenas_lock);
 	memcpy(tarenas, parenas, sizeof(arena_t *) * narenas);
@@ -684,6 +798,20 @@ ctl_refresh(void)
 			ctl_arena_refresh(tarenas[i], i);
 	}
 
+	for (i = 0; i < numa_nnodes; i++) {
+		memset(&ctl_stats.nodes[i], 0, sizeof(ctl_node_stats_t));
+		ctl_stats.nodes[i].nchunks = numa_nchunks(i);
+	}
+	for (i = 0; i < narenas; i++) {
+		ctl_node_stats_t *nstats = &ctl_stats.nodes[numa_arena_node(i)];
+
+		if (ctl_stats.arenas[i].initialized == false)
+			continue;
+		nstats->narenas_init++;
+		nstats->nthreads += ctl_stats.arenas[i].nthreads;
+		nstats->pactive += ctl_stats.arenas[i].pactive;
+	}
+
 #ifdef JEMALLOC_STATS
 	ctl_stats.allocated = ctl_stats.arenas[narenas].allocated_small
 	    + ctl_stats.arenas[narenas].astats.allocated_large
@@ -709,40 +837,27 @@ ctl_init(void)
 
 	malloc_mutex_lock(&ctl_mtx);
 	if (ctl_initialized == false) {
-#ifdef JEMALLOC_STATS
-		unsigned i;
-#endif
-		/*
-		 * Allocate space for one extra arena stats element, which
-		 * contains summed stats across all arenas.
-		 */
-		ctl_stats.arenas = (ctl_arena_stats_t *)temp_malloc(
-		    (narenas + 1) * sizeof(ctl_arena_stats_t));
-		if (ctl_stats.arenas == NULL) {
+		if (ctl_arenas_extend()) {
 			ret = true;
 			goto RETURN;
 		}
-		memset(ctl_stats.arenas, 0, (narenas + 1) *
-		    sizeof(ctl_arena_stats_t));
-
-		/*
-		 * Initialize all stats structures, regardless of whether they
-		 * ever get used.  Lazy initialization would allow errors to
-		 * cause inconsistent state to be viewable by the application.
-		 */
-#ifdef JEMALLOC_STATS
-		for (i = 0; i <= narenas; i++) {
-			if (ctl_arena_init(&ctl_stats.arenas[i])) {
-				ret = true;
-				goto RETURN;
-			}
+		ctl_stats.nodes = (ctl_node_stats_t *)temp_malloc(numa_nnodes *
+		    sizeof(ctl_node_stats_t));
+		if (ctl_stats.nodes == NULL) {
+			ret = true;
+			goto RETURN;
 		}
-#endif
-		ctl_stats.arenas[narenas].initialized = true;
 
 		ctl_epoch = 0;
 		ctl_refresh();
 		ctl_initialized = true;
+	} else if (narenas != ctl_narenas) {
+		/* The arenas array was resized by a restore. */
+		if (ctl_arenas_extend()) {
+			ret = true;
+			goto RETURN;
+		}
+		ctl_refresh();
 	}
 
 	ret = false;
@@ -858,7 +973,8 @@ ctl_byname(const char *name, void *oldp, size_t *oldlenp, void *newp,
 	ctl_node_t const *nodes[CTL_MAX_DEPTH];
 	size_t mib[CTL_MAX_DEPTH];
 
-	if (ctl_initialized == false && ctl_init()) {
+	if ((ctl_initialized == false || narenas != ctl_narenas) &&
+	    ctl_init()) {
 		ret = EAGAIN;
 		goto RETURN;
 	}
@@ -884,7 +1000,8 @@ ctl_nametomib(const char *name, size_t *mibp, size_t *miblenp)
 {
 	int ret;
 
-	if (ctl_initialized == false && ctl_init()) {
+	if ((ctl_initialized == false || narenas != ctl_narenas) &&
+	    ctl_init()) {
 		ret = EAGAIN;
 		goto RETURN;
 	}
@@ -902,7 +1019,8 @@ ctl_bymib(const size_t *mib, size_t miblen, void *oldp, size_t *oldlenp,
 	const ctl_node_t *node;
 	size_t i;
 
-	if (ctl_initialized == false && ctl_init()) {
+	if ((ctl_initialized == false || narenas != ctl_narenas) &&
+	    ctl_init()) {
 		ret = EAGAIN;
 		goto RETURN;
 	}
@@ -1272,6 +1390,8 @@ CTL_RO_NL_GEN(opt_lg_qspace_max, opt_lg_qspace_max, size_t)
 CTL_RO_NL_GEN(opt_lg_cspace_max, opt_lg_cspace_max, size_t)
 CTL_RO_NL_GEN(opt_lg_chunk, opt_lg_chunk, size_t)
 CTL_RO_NL_GEN(opt_narenas, opt_narenas, size_t)
+CTL_RO_NL_GEN(opt_percpu_arena, opt_percpu_arena, bool)
+CTL_RO_NL_GEN(opt_numa, opt_numa, bool)
 CTL_RO_NL_GEN(opt_lg_dirty_mult, opt_lg_dirty_mult, ssize_t)
 CTL_RO_NL_GEN(opt_stats_print, opt_stats_print, bool)
 #ifdef JEMALLOC_FILL
@@ -1329,6 +1449,7 @@ arenas_lrun_i_index(const size_t *mib, size_t miblen, size_t i)
 }
 
 CTL_RO_NL_GEN(arenas_narenas, narenas, unsigned)
+CTL_RO_NL_GEN(arenas_nnodes, numa_nnodes, unsigned)
 
 static int
 arenas_initialized_ctl(const size_t *mib, size_t miblen, void *oldp,
@@ -1573,7 +1694,7 @@ stats_arenas_i_index(const size_t *mib, size_t miblen, size_t i)
 	const ctl_node_t * ret;
 
 	malloc_mutex_lock(&ctl_mtx);
-	if (ctl_stats.arenas[i].initialized == false) {
+	if (i > ctl_narenas_max || ctl_stats.arenas[i].initialized == false) {
 		ret = NULL;
 		goto RETURN;
 	}
@@ -1584,6 +1705,21 @@ RETURN:
 	return (ret);
 }
 
+CTL_RO_GEN(stats_nodes_i_narenas, ctl_stats.nodes[mib[2]].narenas_init,
+    unsigned)
+CTL_RO_GEN(stats_nodes_i_nthreads, ctl_stats.nodes[mib[2]].nthreads, unsigned)
+CTL_RO_GEN(stats_nodes_i_pactive, ctl_stats.nodes[mib[2]].pactive, size_t)
+CTL_RO_GEN(stats_nodes_i_nchunks, ctl_stats.nodes[mib[2]].nchunks, size_t)
+
+const ctl_node_t *
+stats_nodes_i_index(const size_t *mib, size_t miblen, size_t i)
+{
+
+	if (i >= numa_nnodes)
+		return (NULL);
+	return (super_stats_nodes_i_node);
+}
+
 #ifdef JEMALLOC_STATS
 CTL_RO_GEN(stats_cactive, &stats_cactive, size_t *)
 CTL_RO_GEN(stats_allocated, ctl_stats.allocated, size_t)
@@ -1637,7 +1773,8 @@ swap_fds_ctl(const size_t *mib, size_t miblen, void *oldp, size_t *oldlenp,
 	} else if (newp != NULL) {
 		size_t nfds = newlen / sizeof(int);
 		int *fds = (int *)newp;
-		if (chunk_swap_enable(fds, nfds, swap_prezeroed)) {
+		if (chunk_swap_enable(fds, nfds, swap_prezeroed, false, 0) ||
+		    chunk_swap_map_boot()) {
 			ret = EFAULT;
 			goto RETURN;
 		}
@@ -1669,4 +1806,114 @@ RETURN:
 	malloc_mutex_unlock(&ctl_mtx);
 	return (ret);
 }
+
+/*
+ * ctl_mtx is not acquired by the swap.flush.* functions, since the flusher is
+ * set up with perm_mtx held, which is acquired before ctl_mtx by mopen().
+ */
+static int
+swap_flush_level_ctl(const size_t *mib, size_t miblen, void *oldp,
+    size_t *oldlenp, void *newp, size_t newlen)
+{
+	int ret;
+	const char *oldval;
+	unsigned interval;
+	size_t dirty;
+
+	oldval = perm_flush_get(&interval, &dirty);
+	if (newp != NULL) {
+		const char *level;
+
+		WRITE(level, const char *);
+		if (perm_flush_set(level, interval, dirty)) {
+			ret = EINVAL;
+			goto RETURN;
+		}
+	}
+	READ(oldval, const char *);
+
+	ret = 0;
+RETURN:
+	return (ret);
+}
+
+static int
+swap_flush_interval_ctl(const size_t *mib, size_t miblen, void *oldp,
+    size_t *oldlenp, void *newp, size_t newlen)
+{
+	int ret;
+	const char *level;
+	unsigned oldval, interval;
+	size_t dirty;
+
+	level = perm_flush_get(&oldval, &dirty);
+	if (newp != NULL) {
+		WRITE(interval, unsigned);
+		if (perm_flush_set(level, interval, dirty)) {
+			ret = EINVAL;
+			goto RETURN;
+		}
+	}
+	READ(oldval, unsigned);
+
+	ret = 0;
+RETURN:
+	return (ret);
+}
+
+static int
+swap_flush_dirty_ctl(const size_t *mib, size_t miblen, void *oldp,
+    size_t *oldlenp, void *newp, size_t newlen)
+{
+	int ret;
+	const char *level;
+	unsigned interval;
+	size_t oldval, dirty;
+
+	level = perm_flush_get(&interval, &oldval);
+	if (newp != NULL) {
+		WRITE(dirty, size_t);
+		if (perm_flush_set(level, interval, dirty)) {
+			ret = EINVAL;
+			goto RETURN;
+		}
+	}
+	READ(oldval, size_t);
+
+	ret = 0;
+RETURN:
+	return (ret);
+}
+
+static int
+swap_flush_lag_ctl(const size_t *mib, size_t miblen, void *oldp,
+    size_t *oldlenp, void *newp, size_t newlen)
+{
+	int ret;
+	uint64_t oldval;
+
+	READONLY();
+	oldval = perm_flush_lag();
+	READ(oldval, uint64_t);
+
+	ret = 0;
+RETURN:
+	return (ret);
+}
+
+/* Checkpoint count, or the time (ns) to stop the threads and they stopped. */
+static uint64_t
+swap_safepoint_get(unsigned i)
+{
+	uint64_t v[5];
+
+	safepoint_stats(&v[0], &v[1], &v[2], &v[3], &v[4]);
+	return (v[i]);
+}
+
+CTL_RO_NL_GEN(swap_safepoint_count, swap_safepoint_get(0), uint64_t)
+CTL_RO_NL_GEN(swap_safepoint_wait_last, swap_safepoint_get(1), uint64_t)
+CTL_RO_NL_GEN(swap_safepoint_wait_max, swap_safepoint_get(2), uint64_t)
+CTL_RO_NL_GEN(swap_safepoint_pause_last, swap_safepoint_get(3), uint64_t)
+CTL_RO_NL_GEN(swap_safepoint_pause_max, swap_safepoint_get(4), uint64_t)
 #endif
@@ -39,6 +39,7 @@ huge_malloc(size_t size, bool zero)
 		base_node_dealloc(node);
 		return (NULL);
 	}
+	numa_bind(ret, csize, numa_node());
 
 	/* Insert node into huge. */
 	node->addr = ret;
@@ -125,6 +126,8 @@ huge_palloc(size_t size, size_t alignment, bool zero)
 		}
 	}
 
+	numa_bind(ret, chunk_size, numa_node());
+
 	/* Insert node into huge. */
 	node->addr = ret;
 	node->size = chunk_size;
@@ -45,6 +45,7 @@ size_t		lg_pagesize;
 #endif
 
 unsigned	ncpus;
+unsigned	narenas_auto;
 
 /* Runtime configuration options. */
 const char	*JEMALLOC_P(malloc_conf) JEMALLOC_ATTR(visibility("default"));
@@ -69,6 +70,7 @@ bool	opt_xmalloc = false;
 bool	opt_zero = false;
 #endif
 size_t	opt_narenas = 0;
+bool	opt_percpu_arena = false;
 
 /******************************************************************************/
 /* Function prototypes for non-inline static functions. */
@@ -160,6 +162,68 @@ arenas_extend(unsigned ind)
 	return (parenas[0]);
 }
 
+/* Number of arenas for ncpus, as chosen for a new heap. */
+static unsigned
+arenas_default(void)
+{
+	size_t n = opt_narenas;
+
+	if (n == 0)
+		n = (ncpus > 1) ? ncpus << 2 : 1;
+	if (n > chunksize / sizeof(arena_t *))
+		n = chunksize / sizeof(arena_t *);
+	return ((unsigned)n);
+}
+
+/*
+ * Fit the arenas of a reopened or restored heap to this machine: new threads
+ * are assigned to arenas_default() arenas, and the arenas array grows if it
+ * is shorter. Arenas past narenas_auto keep serving the objects they own.
+ * The other threads must be stopped outside of the allocator (see
+ * safepoint_begin()), since choose_arena() reads the array without a lock.
+ */
+bool
+arenas_resize(void)
+{
+	unsigned n = arenas_default();
+
+	if (n > narenas) {
+		arena_t **tarenas;
+
+		tarenas = (arena_t **)base_alloc(sizeof(arena_t *) * n);
+		if (tarenas == NULL) {
+			narenas_auto = narenas;
+			return (true);
+		}
+		memset(tarenas, 0, sizeof(arena_t *) * n);
+		/* The old array is left in the internal heap. */
+		malloc_mutex_lock(&arenas_lock);
+		memcpy(tarenas, parenas, sizeof(arena_t *) * narenas);
+		parenas = tarenas;
+		narenas = n;
+		malloc_mutex_unlock(&arenas_lock);
+	}
+	narenas_auto = n;
+	return (false);
+}
+
+/*
+ * Return the arena at index ind, initializing it if necessary (slow-path code
+ * only, called only by choose_arena() with opt_percpu_arena).
+ */
+arena_t *
+choose_arena_cpu(unsigned ind)
+{
+	arena_t *ret;
+
+	malloc_mutex_lock(&arenas_lock);
+	if ((ret = parenas[ind]) == NULL)
+		ret = arenas_extend(ind);
+	malloc_mutex_unlock(&arenas_lock);
+
+	return (ret);
+}
+
 /*
  * Choose an arena based on a per-thread value (slow-path code only, called
  * only by choose_arena()).
@@ -168,15 +232,19 @@ arena_t *
 choose_arena_hard(void)
 {
 	arena_t *ret;
+	unsigned n = narenas_auto;
+	/* With opt_numa, only the arenas of the node the thread runs on. */
+	unsigned node = numa_node(), step = numa_nnodes;
 
-	if (narenas > 1) {
+	if (n > step) {
 		unsigned i, choose, first_null;
 
-		choose = 0;
-		first_null = narenas;
+		choose = node;
+		first_null = n;
 		malloc_mutex_lock(&arenas_lock);
-		assert(parenas[0] != NULL);
-		for (i = 1; i < narenas; i++) {
+		if (parenas[node] == NULL)
+			arenas_extend(node);
+		for (i = node + step; i < n; i += step) {
 			if (parenas[i] != NULL) {
 				/*
 				 * Choose the first arena that has the lowest
@@ -185,7 +253,7 @@ choose_arena_hard(void)
 				if (parenas[i]->nthreads <
 				    parenas[choose]->nthreads)
 					choose = i;
-			} else if (first_null == narenas) {
+			} else if (first_null == n) {
 				/*
 				 * Record the index of the first uninitialized
 				 * arena, in case all extant arenas are in use.
@@ -199,7 +267,7 @@ choose_arena_hard(void)
 			}
 		}
 
-		if (parenas[choose] == 0 || first_null == narenas) {
+		if (parenas[choose] == 0 || first_null == n) {
 			/*
 			 * Use an unloaded arena, or the least loaded arena if
 			 * all arenas are already initialized.
@@ -212,8 +280,9 @@ choose_arena_hard(void)
 		ret->nthreads++;
 		malloc_mutex_unlock(&arenas_lock);
 	} else {
-		ret = parenas[0];
 		malloc_mutex_lock(&arenas_lock);
+		if ((ret = parenas[node]) == NULL)
+			ret = arenas_extend(node);
 		ret->nthreads++;
 		malloc_mutex_unlock(&arenas_lock);
 	}
@@ -617,6 +686,8 @@ malloc_conf_init(void)
 			CONF_HANDLE_SIZE_T(lg_chunk, PAGE_SHIFT+1,
 			    (sizeof(size_t) << 3) - 1)
 			CONF_HANDLE_SIZE_T(narenas, 1, SIZE_T_MAX)
+			CONF_HANDLE_BOOL(percpu_arena)
+			CONF_HANDLE_BOOL(numa)
 			CONF_HANDLE_SSIZE_T(lg_dirty_mult, -1,
 			    (sizeof(size_t) << 3) - 1)
 			CONF_HANDLE_BOOL(stats_print)
@@ -783,6 +854,11 @@ malloc_init_hard(void)
 		return (true);
 	}
 
+	if (safepoint_boot()) {
+		malloc_mutex_unlock(&init_lock);
+		return (true);
+	}
+
 #if (defined(JEMALLOC_STATS) && defined(NO_TLS))
 	/* Initialize allocation counters before any allocations can occur. */
 	if (pthread_key_create(&thread_allocated_tsd, thread_allocated_cleanup)
@@ -835,6 +911,10 @@ malloc_init_hard(void)
 				parenas[i]->nthreads = 0;
 				if (malloc_mutex_init(&parenas[i]->lock))
 					return (true);
+#if (defined(JEMALLOC_STATS) && defined(JEMALLOC_TCACHE))
+				/* The tcaches of the last run are gone. */
+				ql_new(&parenas[i]->tcache_ql);
+#endif
 			}
 		}
 		ARENA_SET(parenas[0]);
@@ -894,7 +974,20 @@ malloc_init_hard(void)
 	memset(parenas, 0, sizeof(arena_t *) * narenas);
 	/* Copy the pointer to the one arena that was already initialized. */
 	parenas[0] = init_arenas[0];
+	narenas_auto = narenas;
 	/* END BLOCK (plib_initialized == false) */
+	} else if ((O_WRONLY|O_RDWR) & fcntl(*swap_fds, F_GETFL)) {
+		/* The heap may have been created on a machine with fewer CPUs. */
+		if (arenas_resize()) {
+			malloc_mutex_unlock(&init_lock);
+			return (true);
+		}
+	} else
+		narenas_auto = narenas;
+
+	if (numa_boot()) {
+		malloc_mutex_unlock(&init_lock);
+		return (true);
 	}
 
 #ifdef JEMALLOC_ZONE
@@ -0,0 +1,179 @@
+#define	JEMALLOC_LZ_C_
+#include "jemalloc/internal/jemalloc_internal.h"
+
+/******************************************************************************/
+/* Function prototypes for non-inline static functions. */
+
+static uint32_t	lz_read32(const unsigned char *p);
+static unsigned char	*lz_put_len(unsigned char *op, unsigned char *oend,
+    size_t len);
+static unsigned char	*lz_put_seq(unsigned char *op, unsigned char *oend,
+    const unsigned char *lit, size_t nlit, size_t off, size_t mlen);
+
+/******************************************************************************/
+
+static uint32_t
+lz_read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v);
+}
+
+/* Write the extension bytes of a length nibble of 15. */
+static unsigned char *
+lz_put_len(unsigned char *op, unsigned char *oend, size_t len)
+{
+
+	for (; len >= 255; len -= 255) {
+		if (op == oend)
+			return (NULL);
+		*op++ = 255;
+	}
+	if (op == oend)
+		return (NULL);
+	*op++ = (unsigned char)len;
+	return (op);
+}
+
+/* Write one sequence; mlen is 0 for the last one, which has no match. */
+static unsigned char *
+lz_put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+    size_t nlit, size_t off, size_t mlen)
+{
+	unsigned char *token;
+	size_t mcode = mlen ? mlen - LZ_MINMATCH : 0;
+
+	if (op == oend)
+		return (NULL);
+	token = op++;
+	*token = (unsigned char)(((nlit < 15 ? nlit : 15) << 4) |
+	    (mcode < 15 ? mcode : 15));
+	if (nlit >= 15 && (op = lz_put_len(op, oend, nlit - 15)) == NULL)
+		return (NULL);
+	if ((size_t)(oend - op) < nlit)
+		return (NULL);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return (op);
+
+	if (oend - op < 2)
+		return (NULL);
+	*op++ = (unsigned char)(off & 0xff);
+	*op++ = (unsigned char)(off >> 8);
+	if (mcode >= 15 && (op = lz_put_len(op, oend, mcode - 15)) == NULL)
+		return (NULL);
+	return (op);
+}
+
+/*
+ * Compress slen bytes from src into at most dcap bytes at dst.  Returns the
+ * compressed size, or 0 if it would not fit.
+ */
+size_t
+lz_compress(const void *src, size_t slen, void *dst, size_t dcap)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	const unsigned char *ip, *anchor, *iend, *ilimit;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + dcap;
+	uint32_t htab[1U << LZ_LG_HASH];
+
+	memset(htab, 0, sizeof(htab));
+	ip = anchor = in;
+	iend = in + slen;
+	ilimit = slen > LZ_MINMATCH ? iend - LZ_MINMATCH : in;
+	while (ip < ilimit) {
+		uint32_t v = lz_read32(ip);
+		uint32_t h = (v * 2654435761U) >> (32 - LZ_LG_HASH);
+		const unsigned char *ref = in + htab[h];
+		size_t mlen;
+
+		htab[h] = (uint32_t)(ip - in);
+		if (ref >= ip || (size_t)(ip - ref) > LZ_MAXOFF ||
+		    lz_read32(ref) != v) {
+			/* Skip faster through incompressible data. */
+			ip += 1 + ((size_t)(ip - anchor) >> 6);
+			continue;
+		}
+		for (mlen = LZ_MINMATCH; ip + mlen < iend && ref[mlen] ==
+		    ip[mlen]; mlen++)
+			;
+		op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+		if (op == NULL)
+			return (0);
+		ip += mlen;
+		anchor = ip;
+	}
+	op = lz_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	if (op == NULL)
+		return (0);
+	return (op - (unsigned char *)dst);
+}
+
+/*
+ * Decompress slen bytes from src into exactly dlen bytes at dst.  Returns true
+ * if the input is corrupt.
+ */
+bool
+lz_decompress(const void *src, size_t slen, void *dst, size_t dlen)
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *iend = ip + slen;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + dlen;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+		size_t mlen = token & 15;
+		size_t off;
+		unsigned b;
+
+		if (nlit == 15) {
+			do {
+				if (ip == iend)
+					return (true);
+				b = *ip++;
+				nlit += b;
+			} while (b == 255);
+		}
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+			return (true);
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return (true);
+		off = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (mlen == 15) {
+			do {
+				if (ip == iend)
+					return (true);
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MINMATCH;
+		if (off == 0 || off > (size_t)(op - (unsigned char *)dst) ||
+		    (size_t)(oend - op) < mlen)
+			return (true);
+		if (off >= mlen)
+			memcpy(op, op - off, mlen);
+		else {
+			/* The match overlaps its own output. */
+			size_t i;
+
+			for (i = 0; i < mlen; i++)
+				op[i] = (op - off)[i];
+		}
+		op += mlen;
+	}
+	return (op != oend);
+}
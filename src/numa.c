@@ -0,0 +1,253 @@
+#define	JEMALLOC_NUMA_C_
+#include "jemalloc/internal/jemalloc_internal.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+ * With opt_numa, the arenas are spread over the NUMA nodes, threads are
+ * assigned to arenas of the node they run on, and the chunks of an arena
+ * are bound to its node with mbind(). Huge chunks are bound to the node of
+ * the allocating thread. The node of each chunk in the persistent heap is
+ * recorded in plib->numa_map (node + 1, 0 for none), so that numa_place()
+ * can move the pages back to their nodes after a reopen or restore.
+ *
+ * mbind() sets the policy of anonymous and private mappings, and moves the
+ * pages already present. Pages of a shared map file are placed by the first
+ * thread to touch them, which is usually a thread of the arena's node.
+ */
+
+#define	NUMA_SYSFS		"/sys/devices/system/node"
+
+#define	NUMA_MPOL_PREFERRED	1
+#define	NUMA_MPOL_MF_MOVE	(1 << 1)
+
+/******************************************************************************/
+/* Data. */
+
+bool		opt_numa = false;
+unsigned	numa_nnodes = 1;
+unsigned	numa_ncpus;
+unsigned char	*numa_cpu_node;
+
+/******************************************************************************/
+/* Function prototypes for non-inline static functions. */
+
+static ssize_t	numa_read(const char *path, char *buf, size_t size);
+static bool	numa_cpulist(unsigned node, const char *list);
+static void	numa_mbind(void *addr, size_t size, unsigned node);
+static unsigned char	*numa_map_get(void *chunk, size_t *nchunks);
+
+/******************************************************************************/
+
+/* Read a sysfs file into buf as a string, without allocating. */
+static ssize_t
+numa_read(const char *path, char *buf, size_t size)
+{
+	int fd;
+	ssize_t n;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n >= 0)
+		buf[n] = '\0';
+	return (n);
+}
+
+/*
+ * Assign the CPUs of a list such as "0-3,8-11" to node. With a NULL
+ * numa_cpu_node, only count the CPUs in numa_ncpus.
+ */
+static bool
+numa_cpulist(unsigned node, const char *list)
+{
+	const char *p = list;
+
+	while (*p >= '0' && *p <= '9') {
+		unsigned long first, last;
+		char *end;
+
+		first = last = strtoul(p, &end, 10);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (last < first)
+			return (true);
+		if (numa_cpu_node == NULL) {
+			if (last >= numa_ncpus)
+				numa_ncpus = last + 1;
+		} else {
+			for (; first <= last && first < numa_ncpus; first++)
+				numa_cpu_node[first] = node;
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return (false);
+}
+
+/* Prefer node for [addr, addr+size), and move the pages already there. */
+static void
+numa_mbind(void *addr, size_t size, unsigned node)
+{
+#ifdef SYS_mbind
+	unsigned long mask[(NUMA_NODES_MAX + 1) / (sizeof(unsigned long) * 8)
+	    + 1];
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node %
+	    (sizeof(unsigned long) * 8));
+	/* Placement is a hint: the allocation stands if it fails. */
+	syscall(SYS_mbind, addr, size, NUMA_MPOL_PREFERRED, mask,
+	    sizeof(mask) * 8, NUMA_MPOL_MF_MOVE);
+#endif
+}
+
+/* Entry of chunk in the node map, or NULL outside of the heap. */
+static unsigned char *
+numa_map_get(void *chunk, size_t *nchunks)
+{
+	unsigned char *map = plib->numa_map;
+
+	if (map == NULL || (uintptr_t)chunk < (uintptr_t)swap_base ||
+	    (uintptr_t)chunk >= (uintptr_t)swap_max)
+		return (NULL);
+	if (nchunks != NULL) {
+		*nchunks = ((uintptr_t)swap_max - (uintptr_t)chunk) /
+		    chunksize;
+	}
+	return (&map[((uintptr_t)chunk - (uintptr_t)swap_base) /
+	    chunksize]);
+}
+
+/* Place new chunks on node, and record it. */
+void
+numa_bind(void *chunk, size_t size, unsigned node)
+{
+	unsigned char *ent;
+	size_t i, n, nchunks;
+
+	if (opt_numa == false)
+		return;
+	numa_mbind(chunk, size, node);
+	if ((ent = numa_map_get(chunk, &nchunks)) != NULL) {
+		n = CHUNK_CEILING(size) / chunksize;
+		for (i = 0; i < n && i < nchunks; i++)
+			ent[i] = node + 1;
+	}
+}
+
+/* Forget the node of deallocated chunks. */
+void
+numa_unbind(void *chunk, size_t size)
+{
+	unsigned char *ent;
+	size_t i, n, nchunks;
+
+	if (opt_numa == false)
+		return;
+	if ((ent = numa_map_get(chunk, &nchunks)) != NULL) {
+		n = CHUNK_CEILING(size) / chunksize;
+		for (i = 0; i < n && i < nchunks; i++)
+			ent[i] = 0;
+	}
+}
+
+/*
+ * Move the pages of the heap to the nodes recorded in the node map, after
+ * the heap was reopened or restored, possibly with its pages read in on
+ * other nodes. A heap recorded on more nodes than this machine has folds its
+ * nodes onto the ones present. Runs of chunks on one node take one call.
+ */
+void
+numa_place(void)
+{
+	unsigned char *map = plib->numa_map;
+	size_t i, first, nchunks;
+
+	if (opt_numa == false || map == NULL)
+		return;
+	nchunks = ((uintptr_t)swap_end - (uintptr_t)swap_base) / chunksize;
+	for (i = 0; i < nchunks; i = first) {
+		for (first = i + 1; first < nchunks && map[first] == map[i];
+		    first++)
+			;
+		if (map[i] != 0) {
+			numa_mbind((void *)((uintptr_t)swap_base + (i *
+			    chunksize)), (first - i) * chunksize,
+			    (map[i] - 1) % numa_nnodes);
+		}
+	}
+}
+
+/* Number of heap chunks placed on node. */
+size_t
+numa_nchunks(unsigned node)
+{
+	unsigned char *map = plib->numa_map;
+	size_t i, n, nchunks;
+
+	if (map == NULL)
+		return (0);
+	nchunks = ((uintptr_t)swap_end - (uintptr_t)swap_base) / chunksize;
+	for (i = n = 0; i < nchunks; i++) {
+		if (map[i] != 0 && (map[i] - 1) % numa_nnodes == node)
+			n++;
+	}
+	return (n);
+}
+
+/*
+ * Read the node of each CPU, and create the node map of a new or writable
+ * heap. Called after narenas_auto is set, since every node needs an arena.
+ */
+bool
+numa_boot(void)
+{
+	char path[64], buf[4096];
+	unsigned node, nnodes;
+
+	if (opt_numa == false)
+		return (false);
+
+	/* Count the CPUs, and then record their nodes. */
+	nnodes = 0;
+	for (node = 0; node < NUMA_NODES_MAX; node++) {
+		snprintf(path, sizeof(path), NUMA_SYSFS "/node%u/cpulist", node);
+		if (numa_read(path, buf, sizeof(buf)) <= 0)
+			continue;
+		if (numa_cpulist(node, buf))
+			goto NONUMA;
+		nnodes = node + 1;
+	}
+	if (nnodes == 0 || numa_ncpus == 0)
+		goto NONUMA;
+	if (nnodes > narenas_auto) {
+		malloc_write("<jemalloc>: Fewer arenas than NUMA nodes\n");
+		goto NONUMA;
+	}
+	numa_cpu_node = (unsigned char *)temp_malloc(numa_ncpus);
+	if (numa_cpu_node == NULL)
+		return (true);
+	memset(numa_cpu_node, 0, numa_ncpus);
+	for (node = 0; node < nnodes; node++) {
+		snprintf(path, sizeof(path), NUMA_SYSFS "/node%u/cpulist", node);
+		if (numa_read(path, buf, sizeof(buf)) > 0)
+			numa_cpulist(node, buf);
+	}
+	numa_nnodes = nnodes;
+
+	/* One byte per chunk of a persistent heap, zeroed by base_alloc(). */
+	if (plib->numa_map == NULL && swap_base != NULL && (plib_initialized ==
+	    false || (O_WRONLY|O_RDWR) & fcntl(*swap_fds, F_GETFL))) {
+		plib->numa_map = base_alloc(((uintptr_t)swap_max -
+		    (uintptr_t)swap_base) / chunksize);
+		if (plib->numa_map == NULL)
+			return (true);
+	}
+	return (false);
+NONUMA:
+	opt_numa = false;
+	numa_ncpus = 0;
+	return (false);
+}
@@ -33,13 +33,38 @@
  */
 
 #include "jemalloc/internal/jemalloc_internal.h"
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define PERM_URING
+#endif
+
+#define PERM_BLKS_MIN 64 /* initial size of the perm block registry */
+
+/* address space reserved for a growable heap opened with a size of 0 */
+#if (LG_SIZEOF_PTR == 3)
+#define GROW_MAX ((size_t)1 << 40)
+#else
+#define GROW_MAX ((size_t)1 << 30)
+#endif
 
-#define MAX_IO_BLKS 50
-#if IOV_MAX < MAX_IO_BLKS
-#error the number of I/O blocks exceeds the system limit
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
 #endif
+#define THP_SIZE_FILE "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
 
-#define PERM_KEY 0x20130411
+#define PERM_KEY 0x20130417 /* heap layout, changed with plib_t */
+#define PERM_IKEY 0x20130412 /* incremental backup record */
+#define PERM_CKEY 0x20130413 /* compressed backup image */
+#define PERM_SKEY 0x20130414 /* block checksum trailer */
+#define PERM_RKEY 0x20130415 /* backup ring commit record */
 
 static malloc_mutex_t perm_mtx =
 #ifdef JEMALLOC_OSSPIN
@@ -51,12 +76,174 @@ static malloc_mutex_t perm_mtx =
 
 static int mfd = -1; /* mmap file descriptor */
 static int bfd = -1; /* backup file descriptor */
+static int pmfd = -1; /* /proc/self/pagemap */
+static bool map_private; /* heap is a private (copy-on-write) file mapping */
+static size_t map_huge; /* page size of a map file on hugetlbfs, or 0 */
+static bool map_anon; /* heap is anonymous memory, without a map file */
+static bool map_thp; /* transparent huge pages were requested */
 
 static size_t perm_size; /* total size of persistent globals */
 static int nperm; /* number of perm I/O blocks */
-static struct iovec permv[MAX_IO_BLKS]; /* vector of perm I/O blocks */
+static int perm_max; /* entries allocated in permv */
+static struct iovec *permv; /* perm I/O blocks, sorted by address and coalesced */
+
+/*
+ * An incremental backup is a base image of the heap followed by a chain of
+ * increment records. Each record starts on a page boundary and holds a
+ * header page, an extent index (padded to a page), and the page data of the
+ * extents. The version_key of a record is written last, so a torn record
+ * ends the chain and the heap is rebuilt from the records before it.
+ */
+typedef struct {
+	int version_key; /* PERM_IKEY once the record is committed */
+	unsigned seq; /* position in the chain, starting at 1 */
+	size_t heap_sz; /* swap_end-swap_base when the record was written */
+	size_t nextents; /* number of entries in the extent index */
+	size_t data_sz; /* bytes of page data following the extent index */
+	uint32_t crc; /* CRC32C of the extent index and page data */
+	uint64_t gen; /* ring generation of the base image, 0 without a ring */
+} incr_hdr_t;
+
+typedef struct {
+	size_t off; /* offset from swap_base */
+	size_t len;
+} incr_ext_t;
+
+#define INCR_IDX_SZ(n) PAGE_CEILING((n) * sizeof(incr_ext_t))
+#define INCR_REC_SZ(h) (PAGE_SIZE + INCR_IDX_SZ((h)->nextents) + (h)->data_sz)
+
+static unsigned incr_max; /* max increments chained to a base (PERM_INCR) */
+static unsigned incr_seq; /* increments written since the base image */
+static off_t incr_off; /* backup file offset of the next increment */
+static size_t incr_heap_sz; /* heap size covered by the last checkpoint */
+static bool incr_base; /* backup file holds a base image of this heap */
+static bool incr_sdirty; /* kernel soft-dirty bits track changed pages */
+static size_t incr_npages; /* pages in swap_base..swap_max */
+static uint64_t *incr_hash; /* page hashes when soft-dirty is unavailable */
+static unsigned char *incr_rel; /* bitmap of chunks released since then */
+static size_t incr_nchunks; /* chunks in swap_base..swap_max */
+static incr_ext_t *incr_extv; /* extent index scratch */
+
+/*
+ * With PERM_SNAPSHOT=fork, backup() forks a child that writes the backup
+ * file from its copy-on-write view of the heap. The child reports back
+ * through a shared page, since the incremental state it updates is in its
+ * own copy of this module.
+ */
+typedef struct {
+	bool done;
+	int res;
+	unsigned incr_seq;
+	off_t incr_off;
+	size_t incr_heap_sz;
+	unsigned ring_cur;
+	uint64_t ring_gen;
+} snap_t;
+
+static bool snap_fork; /* backup() runs in a forked child */
+static pid_t snap_pid = -1; /* running snapshot child */
+static int snap_res; /* result of the last background backup */
+static snap_t *snap; /* shared with the snapshot child */
+
+/*
+ * With PERM_RING=N (N > 1), bopen() opens a ring of N generation files,
+ * named after the backup file with the suffixes .0 to .N-1, while the
+ * backup file itself holds a commit record for each of them. A base image
+ * is written over the oldest generation: its record is cleared first and
+ * written with the next generation number once the image is durable, so a
+ * crash while writing leaves the other generations intact. Increments
+ * extend the newest generation. The generation files are written in place,
+ * without truncation, since records and increments are matched by their
+ * generation number.
+ */
+#define RING_MAX 16
+#define RING_REC_SZ 512 /* a sector, written atomically */
+typedef struct {
+	int version_key; /* PERM_RKEY once the generation is committed */
+	unsigned slot;
+	uint64_t gen; /* generation number, increasing from 1 */
+	uint32_t crc; /* CRC32C of the fields above */
+} ring_rec_t;
+
+static unsigned ring_n; /* generations (PERM_RING), 0 for one backup file */
+static int ring_fd[RING_MAX]; /* generation files */
+static int ring_rfd = -1; /* commit records */
+static unsigned ring_cur; /* slot of the newest generation */
+static unsigned ring_next; /* slot of the base image being written */
+static uint64_t ring_gen; /* newest generation, 0 for none */
+
+/* Header page of a compressed backup image */
+#define CMP_VERSION 1
+typedef struct {
+	int version_key; /* PERM_CKEY */
+	unsigned version; /* CMP_VERSION */
+	size_t frame_sz;
+	size_t nframes;
+	off_t data_end; /* past the last frame, where increments start */
+	plib_t plib; /* heap header of the image */
+} cmp_hdr_t;
+#define CMP_IDX_SZ(n) PAGE_CEILING((n) * sizeof(io_range_t))
+
+static bool cmp_on; /* write compressed base images (PERM_COMPRESS) */
+
+/*
+ * A base image is followed by a trailer with the CRC32C of each in-use
+ * chunk-sized block of the heap, computed as the block is written. Blocks
+ * are verified by restore() (PERM_VERIFY=full), or later against the
+ * backup file by restore_verify() (PERM_VERIFY=lazy).
+ */
+typedef struct {
+	int version_key; /* PERM_SKEY */
+	uint32_t crc; /* of the block sums that follow */
+	size_t block_sz;
+	size_t nblocks;
+} sum_hdr_t;
+
+#define SUM_FREE 0 /* block not in the image */
+#define SUM_DATA 1
+#define SUM_CHECKED 2 /* verified by restore_verify(), in memory only */
+#define SUM_NONE 3 /* in the image, not summed (copied in the kernel) */
+typedef struct {
+	uint32_t crc;
+	uint32_t state;
+} sum_t;
+#define SUM_REC_SZ(n) PAGE_CEILING(sizeof(sum_hdr_t) + (n) * sizeof(sum_t))
+
+#define VERIFY_NONE 0
+#define VERIFY_FULL 1
+#define VERIFY_LAZY 2
+static int sum_verify = VERIFY_FULL; /* PERM_VERIFY */
+static sum_hdr_t *sum_rec; /* trailer of the image written or restored */
+static sum_t *sum_tab; /* the block sums following *sum_rec */
+static size_t sum_max; /* blocks in the largest heap */
+static bool sum_lazy; /* restore_verify() has blocks to check */
+
+static bool ovl_on; /* map raw images on restore (PERM_RESTORE) */
+static size_t ovl_sz; /* bytes of the heap mapped from the backup file */
+
+/*
+ * With a shared mapping, the map file holds the heap (its page cache is the
+ * mapping), so a raw base image can be moved from the map file to the
+ * backup file by the kernel: with PERM_COPY=clone, cloned (reflinked) on file
+ * systems that share blocks between files, and with PERM_COPY=kernel
+ * otherwise copied with copy_file_range(), which is no faster than a write
+ * from memory on a local file system. Blocks moved this way are not read, so
+ * they have no checksums, and the default is to write from memory. Each
+ * stripe falls back to writing from memory when neither works, and a method
+ * that is not supported is not tried again.
+ */
+static bool copy_on; /* clone base images (PERM_COPY) */
+static bool copy_noclone; /* cloning is not supported */
+static bool copy_norange; /* copy_file_range() is not supported */
 
-static int check_header(int fd, size_t *heap_sz);
+static pthread_mutex_t ptx_mtx = PTHREAD_MUTEX_INITIALIZER; /* transaction */
+static pthread_t ptx_owner;
+static unsigned ptx_depth; /* nesting of the transaction of ptx_owner */
+
+static int check_header(int fd, size_t *heap_sz, off_t *base_end,
+    size_t *nframes, unsigned *nincr, uint64_t gen);
+static int back_header(const char *fname, void **base, size_t *max);
+static int ptx_recover(const char *who);
 
 #define PRINT_VARS \
 printf("narenas:%u ncpus:%u plib:%p\n", narenas, ncpus, plib); \
@@ -81,17 +268,28 @@ static ssize_t readvb(void *buf, size_t size, const struct iovec *iov, int iovcn
 	return(osize - (ssize_t)size);
 }
 
+/*
+ * Only the pages of buf that differ from the blocks are written, so that
+ * saving unchanged globals neither dirties nor copies heap pages.
+ */
 static ssize_t writevb(void *buf, size_t size, const struct iovec *iov, int iovcnt)
 {
 	int i = 0;
 	ssize_t osize = size;
 
 	for (i = 0; i < iovcnt && size; i++) {
+		char *src = iov[i].iov_base;
 		size_t n = iov[i].iov_len;
 		if (n > size) n = size;
-		memcpy(buf, iov[i].iov_base, n);
-		buf += n;
 		size -= n;
+		while (n) {
+			size_t len = PAGE_SIZE - ((uintptr_t)buf & PAGE_MASK);
+			if (len > n) len = n;
+			if (memcmp(buf, src, len)) memcpy(buf, src, len);
+			buf += len;
+			src += len;
+			n -= len;
+		}
 	}
 	return(osize - (ssize_t)size);
 }
@@ -126,43 +324,407 @@ static ssize_t lwrite(int fd, const void *buf, size_t count)
 	return(count-remain);
 }
 
-static void oflags(const char *mode, int *flags)
+static ssize_t lpread(int fd, void *buf, size_t count, off_t offset)
 {
-	int access = 0;
-	int creation = 0;
+	ssize_t res;
+	size_t remain = count;
 
-	while (*mode) {
-		switch (*mode++) {
-		case 'r':
-			access = O_RDONLY;
-			creation = 0;
-			break;
-		case 'w':
-			access = O_WRONLY;
-			creation = O_CREAT | O_TRUNC;
-			break;
-		case '+':
-			access = O_RDWR;
-			break;
+	do {
+		res = pread(fd, buf, remain, offset);
+		if (res < 0) return(res);
+		buf += res;
+		offset += res;
+		remain -= res;
+	} while (remain && res);
+	return(count-remain);
+}
+
+static ssize_t lpwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t res;
+	size_t remain = count;
+
+	do {
+		res = pwrite(fd, buf, remain, offset);
+		if (res < 0) return(res);
+		buf += res;
+		offset += res;
+		remain -= res;
+	} while (remain && res);
+	return(count-remain);
+}
+
+/*
+ * Volatile scratch memory, kept out of the persistent heap. Shared scratch
+ * stays visible to the parent when written by a snapshot child.
+ */
+static void *scratch_alloc(size_t size, bool shared)
+{
+	void *ret;
+	int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANON;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+
+	ret = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	return(ret == MAP_FAILED ? NULL : ret);
+}
+
+static void scratch_free(void *ptr, size_t size)
+{
+	if (ptr != NULL) munmap(ptr, size);
+}
+
+/*
+ * Changed pages are found with the kernel's soft-dirty bits when they are
+ * available (Linux with CONFIG_MEM_SOFT_DIRTY), otherwise by comparing a
+ * hash of each page with the hash taken at the last checkpoint.
+ */
+#define PM_SOFT_DIRTY ((uint64_t)1 << 55)
+#define PM_FILE ((uint64_t)1 << 61)
+#define PM_SWAP ((uint64_t)1 << 62)
+#define PM_PRESENT ((uint64_t)1 << 63)
+#define PM_BATCH 512
+
+/* Read the pagemap entries of npages starting at addr */
+static int pagemap_read(void *addr, size_t npages, uint64_t *pm)
+{
+	if (pmfd == -1 && (pmfd = open("/proc/self/pagemap", O_RDONLY)) == -1)
+		return(-1);
+	if (lpread(pmfd, pm, npages * sizeof(uint64_t),
+	    ((uintptr_t)addr >> PAGE_SHIFT) * sizeof(uint64_t)) !=
+	    npages * sizeof(uint64_t))
+		return(-1);
+	return(0);
+}
+
+static int sdirty_clear(void)
+{
+	int fd;
+	ssize_t res;
+
+	fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd == -1) return(-1);
+	res = write(fd, "4", 1);
+	close(fd);
+	return(res == 1 ? 0 : -1);
+}
+
+static int sdirty_probe(void)
+{
+	volatile char *page;
+	uint64_t pm;
+	int res = -1;
+
+	if ((page = scratch_alloc(PAGE_SIZE, false)) == NULL) return(-1);
+	page[0] = 1;
+	if (sdirty_clear()) goto sp_return;
+	page[0] = 2;
+	if (pagemap_read((void *)page, 1, &pm)) goto sp_return;
+	if (pm & PM_SOFT_DIRTY) res = 0;
+sp_return:
+	scratch_free((void *)page, PAGE_SIZE);
+	return(res);
+}
+
+/* Set up change tracking for a newly opened backup file */
+static int incr_init(void)
+{
+	char *s;
+
+	incr_max = strtoul((s = getenv("PERM_INCR")) != NULL ? s : "0", NULL, 0);
+	incr_base = false;
+	if (incr_max == 0) return(0);
+
+	incr_npages = (swap_max-swap_base) >> PAGE_SHIFT;
+	incr_extv = scratch_alloc(INCR_IDX_SZ(incr_npages/2+1), false);
+	if (incr_extv == NULL) goto ii_error;
+	/*
+	 * a snapshot child can neither read nor clear the parent's bits, and
+	 * the kernel doesn't clear them for hugetlbfs pages
+	 */
+	incr_sdirty = !snap_fork && map_huge == 0 && sdirty_probe() == 0;
+	if (!incr_sdirty) {
+		incr_hash = scratch_alloc(incr_npages * sizeof(uint64_t), true);
+		if (incr_hash == NULL) goto ii_error;
+	} else {
+		unsigned char *rel;
+
+		incr_nchunks = (swap_max-swap_base) / chunksize;
+		rel = scratch_alloc((incr_nchunks + 7) / 8, false);
+		if (rel == NULL) goto ii_error;
+		/* set by perm_swap_released() under swap_mtx */
+		malloc_mutex_lock(&swap_mtx);
+		incr_rel = rel;
+		malloc_mutex_unlock(&swap_mtx);
+	}
+	return(0);
+ii_error:
+	fprintf(stderr, "bopen: error allocating incremental backup index\n");
+	scratch_free(incr_extv, INCR_IDX_SZ(incr_npages/2+1)); incr_extv = NULL;
+	incr_max = 0;
+	return(-1);
+}
+
+static void incr_fini(void)
+{
+	unsigned char *rel;
+
+	if (incr_max == 0) return;
+	malloc_mutex_lock(&swap_mtx);
+	rel = incr_rel;
+	incr_rel = NULL;
+	malloc_mutex_unlock(&swap_mtx);
+	scratch_free(rel, (incr_nchunks + 7) / 8);
+	scratch_free(incr_extv, INCR_IDX_SZ(incr_npages/2+1)); incr_extv = NULL;
+	scratch_free(incr_hash, incr_npages * sizeof(uint64_t)); incr_hash = NULL;
+	incr_max = 0;
+	incr_base = false;
+}
+
+/* Mark the heap as clean, it now matches the backup file */
+static int incr_reset(size_t heap_sz, unsigned seq, off_t off)
+{
+	if (incr_sdirty) {
+		if (sdirty_clear()) return(-1);
+		memset(incr_rel, 0, (incr_nchunks + 7) / 8);
+	} else {
+		size_t i;
+		for (i = 0; i < heap_sz >> PAGE_SHIFT; i++)
+			incr_hash[i] = hash(swap_base + (i << PAGE_SHIFT), PAGE_SIZE, 0);
+	}
+	incr_seq = seq;
+	incr_off = off;
+	incr_heap_sz = heap_sz;
+	incr_base = true;
+	return(0);
+}
+
+/*
+ * Chunks of the heap were released (e.g. a hole punched in the file), so they
+ * read back as zeros. The allocator may hand them out as zeroed, and pages
+ * that are then only read are present without being soft-dirty, so the next
+ * increment has to hold the chunks. Called under swap_mtx.
+ */
+void perm_swap_released(void *addr, size_t size)
+{
+	size_t c, end;
+
+	if (incr_rel == NULL) return;
+	c = ((char *)addr - (char *)swap_base) / chunksize;
+	end = CHUNK_CEILING((char *)addr + size - (char *)swap_base) / chunksize;
+	if (end > incr_nchunks) end = incr_nchunks;
+	for (; c < end; c++) incr_rel[c >> 3] |= 1 << (c & 7);
+}
+
+/*
+ * Fill incr_extv with the pages changed since the last checkpoint and mark
+ * them clean. Pages past the end of the last checkpoint are always changed,
+ * and so are pages the kernel no longer maps, since their soft-dirty state
+ * was dropped with the mapping, and pages of released chunks.
+ */
+static ssize_t incr_scan(size_t heap_sz, size_t *data_sz)
+{
+	size_t i, n, npages = heap_sz >> PAGE_SHIFT;
+	size_t clean = incr_heap_sz >> PAGE_SHIFT;
+	ssize_t next = 0;
+	uint64_t pm[PM_BATCH];
+
+	*data_sz = 0;
+	for (i = 0; i < npages; i += n) {
+		size_t j;
+
+		n = npages - i < PM_BATCH ? npages - i : PM_BATCH;
+		if (incr_sdirty &&
+		    pagemap_read(swap_base + (i << PAGE_SHIFT), n, pm))
+			return(-1);
+		for (j = 0; j < n; j++) {
+			size_t pg = i + j;
+			bool dirty = pg >= clean;
+
+			if (incr_sdirty) {
+				size_t c = (pg << PAGE_SHIFT) / chunksize;
+
+				dirty |= (pm[j] & PM_SOFT_DIRTY) ||
+				    !(pm[j] & (PM_PRESENT | PM_SWAP)) ||
+				    (incr_rel[c >> 3] & (1 << (c & 7)));
+			} else {
+				uint64_t h = hash(swap_base + (pg << PAGE_SHIFT), PAGE_SIZE, 0);
+				dirty |= h != incr_hash[pg];
+				incr_hash[pg] = h;
+			}
+			if (!dirty) continue;
+			if (next && incr_extv[next-1].off + incr_extv[next-1].len ==
+			    pg << PAGE_SHIFT) {
+				incr_extv[next-1].len += PAGE_SIZE;
+			} else {
+				incr_extv[next].off = pg << PAGE_SHIFT;
+				incr_extv[next].len = PAGE_SIZE;
+				next++;
+			}
+			*data_sz += PAGE_SIZE;
 		}
 	}
-	*flags = access | creation;
+	if (incr_sdirty) {
+		if (sdirty_clear()) return(-1);
+		memset(incr_rel, 0, (incr_nchunks + 7) / 8);
+	}
+	return(next);
 }
 
-/* Use environment variables for mopen arguments */
-JEMALLOC_ATTR(visibility("default"))
-int perm_open(void)
+/* Append an increment record holding the extents found by incr_scan() */
+static int incr_write(int fd, size_t heap_sz, size_t nextents, size_t data_sz)
 {
-	char *s, *eptr;
-	char *fname;
-	char *mode;
-	size_t size;
-	int res;
+	incr_hdr_t hdr;
+	off_t off = incr_off + PAGE_SIZE;
+	size_t i;
+	uint32_t crc;
 
-	if ((fname = getenv("PERM_FNAME")) == NULL)
+	/* drop any torn record left at the end of the chain */
+	if (!ring_n && ftruncate(fd, incr_off) == -1) return(-1);
+	if (lpwrite(fd, incr_extv, nextents * sizeof(incr_ext_t), off) !=
+	    nextents * sizeof(incr_ext_t))
+		return(-1);
+	crc = crc32c(0, incr_extv, nextents * sizeof(incr_ext_t));
+	off += INCR_IDX_SZ(nextents);
+	for (i = 0; i < nextents; i++) {
+		if (lpwrite(fd, swap_base + incr_extv[i].off, incr_extv[i].len, off)
+		    != incr_extv[i].len)
+			return(-1);
+		crc = crc32c(crc, swap_base + incr_extv[i].off, incr_extv[i].len);
+		off += incr_extv[i].len;
+	}
+	if (fsync(fd) == -1) return(-1);
+
+	/* commit the record once its data is durable */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version_key = PERM_IKEY;
+	hdr.seq = incr_seq + 1;
+	hdr.heap_sz = heap_sz;
+	hdr.nextents = nextents;
+	hdr.data_sz = data_sz;
+	hdr.crc = crc;
+	hdr.gen = ring_gen;
+	if (pwrite(fd, &hdr, sizeof(hdr), incr_off) != sizeof(hdr)) return(-1);
+	if (fsync(fd) == -1) return(-1);
+
+	incr_seq = hdr.seq;
+	incr_off += INCR_REC_SZ(&hdr);
+	incr_heap_sz = heap_sz;
+	return(0);
+}
+
+/*
+ * Apply the nincr increment records that follow the base image. Returns the
+ * heap size of the last record and the file offset past it.
+ */
+static int incr_read(int fd, off_t off, size_t base_sz, unsigned nincr,
+    size_t *heap_sz, off_t *end)
+{
+	unsigned seq;
+	incr_ext_t ext[PAGE_SIZE / sizeof(incr_ext_t)];
+
+	for (seq = 1; seq <= nincr; seq++) {
+		incr_hdr_t hdr;
+		off_t ioff, doff;
+		size_t i, n;
+		uint32_t crc = 0;
+
+		if (pread(fd, &hdr, sizeof(hdr), off) != sizeof(hdr)) return(-1);
+		if (chunk_swap_extend(hdr.heap_sz)) return(-1);
+		ioff = off + PAGE_SIZE;
+		doff = ioff + INCR_IDX_SZ(hdr.nextents);
+		for (i = 0; i < hdr.nextents; i++) {
+			n = i % (sizeof(ext) / sizeof(ext[0]));
+			if (n == 0) {
+				size_t cnt = hdr.nextents - i;
+				if (cnt > sizeof(ext) / sizeof(ext[0]))
+					cnt = sizeof(ext) / sizeof(ext[0]);
+				if (lpread(fd, ext, cnt * sizeof(incr_ext_t), ioff) !=
+				    cnt * sizeof(incr_ext_t))
+					return(-1);
+				crc = crc32c(crc, ext, cnt * sizeof(incr_ext_t));
+				ioff += cnt * sizeof(incr_ext_t);
+			}
+			if (ext[n].off > hdr.heap_sz ||
+			    ext[n].len > hdr.heap_sz - ext[n].off) {
+				fprintf(stderr,
+				    "restore: increment %u extent out of range\n", seq);
+				return(-1);
+			}
+			if (lpread(fd, swap_base + ext[n].off, ext[n].len, doff) !=
+			    ext[n].len)
+				return(-1);
+			crc = crc32c(crc, swap_base + ext[n].off, ext[n].len);
+			doff += ext[n].len;
+		}
+		if (sum_verify != VERIFY_NONE && crc != hdr.crc) {
+			fprintf(stderr, "restore: increment %u checksum mismatch\n",
+			    seq);
+			errno = EIO;
+			return(-1);
+		}
+		off += INCR_REC_SZ(&hdr);
+		base_sz = hdr.heap_sz;
+	}
+	*heap_sz = base_sz;
+	*end = off;
+	return(0);
+}
+
+/*
+ * Write npages heap pages from page first to the mmap file. A private
+ * mapping only reaches the file through write(), so the pages it has copied
+ * on write are found in the pagemap and written out (all pages when there is
+ * no pagemap).
+ */
+static int write_private(size_t first, size_t npages)
+{
+	size_t i, n, start = 0, run = 0;
+	uint64_t pm[PM_BATCH];
+
+	npages += first;
+	for (i = first; i < npages; i += n) {
+		size_t j;
+		bool all;
+
+		n = npages - i < PM_BATCH ? npages - i : PM_BATCH;
+		all = pagemap_read(swap_base + (i << PAGE_SHIFT), n, pm) != 0;
+		for (j = 0; j < n; j++) {
+			if (all || pm[j] & PM_SWAP ||
+			    (pm[j] & (PM_PRESENT | PM_FILE)) == PM_PRESENT) {
+				if (run++ == 0) start = i + j;
+				continue;
+			}
+			if (run && lpwrite(mfd, swap_base + (start << PAGE_SHIFT),
+			    run << PAGE_SHIFT, start << PAGE_SHIFT) != run << PAGE_SHIFT)
+				return(-1);
+			run = 0;
+		}
+	}
+	if (run && lpwrite(mfd, swap_base + (start << PAGE_SHIFT),
+	    run << PAGE_SHIFT, start << PAGE_SHIFT) != run << PAGE_SHIFT)
+		return(-1);
+	return(0);
+}
+
+/* Write the in-use heap to the mmap file */
+static int msync_heap(void)
+{
+	if (map_anon)
 		return(0);
-	mode = (s = getenv("PERM_MODE")) != NULL ? s : "w+";
-	size = strtoul((s = getenv("PERM_SIZE")) != NULL ? s : "1G", &eptr, 0);
+	if (!map_private)
+		return(msync(swap_base, swap_end-swap_base, MS_SYNC));
+	if (write_private(0, (swap_end-swap_base) >> PAGE_SHIFT))
+		return(-1);
+	return(fsync(mfd));
+}
+
+/* Parse a size with an optional K, M, G, or T suffix */
+static size_t size_parse(const char *s)
+{
+	char *eptr;
+	size_t size = strtoul(s, &eptr, 0);
 
 	switch (*eptr) {
 	case 'K': case 'k': size <<= 10; break;
@@ -170,15 +732,1717 @@ int perm_open(void)
 	case 'G': case 'g': size <<= 30; break;
 	case 'T': case 't': size <<= 40; break;
 	}
+	return(size);
+}
 
-	if ((res = mopen(fname, mode, size))) {
-		if (res == -2) return(0); /* already open OK */
-		return(res);
+/*
+ * With PERM_FLUSH=async or sync, a flusher thread writes the changes of a
+ * shared mapping back to the mmap file in the background, so that mflush()
+ * finds few dirty pages left to wait for. It runs every PERM_FLUSH_INTERVAL
+ * milliseconds, or sooner once the heap has PERM_FLUSH_DIRTY dirty bytes.
+ * With async it only starts writeback, with sync it waits for the file to
+ * be durable. It holds no allocator mutex but swap_mtx, briefly, and never
+ * perm_mtx, so perm_mtx may be held while it is stopped.
+ */
+#define FLUSH_NONE 0
+#define FLUSH_ASYNC 1
+#define FLUSH_SYNC 2
+#define FLUSH_TICK_MIN 10 /* ms between checks of the dirty bytes */
+#define FLUSH_TICK_MAX 100
+
+static const char *flush_names[] = {"none", "async", "sync"};
+static pthread_mutex_t flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cv;
+static pthread_t flush_tid;
+static bool flush_running;
+static bool flush_quit;
+static unsigned flush_level = FLUSH_NONE; /* PERM_FLUSH */
+static unsigned flush_interval = 1000; /* ms (PERM_FLUSH_INTERVAL) */
+static size_t flush_dirty; /* bytes, 0 for none (PERM_FLUSH_DIRTY) */
+static uint64_t flush_last; /* start of the last pass, ms */
+static uint64_t flush_mark; /* changes made before are written back, ms */
+static int flush_err; /* reported once */
+
+static uint64_t flush_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Dirty bytes of the heap mappings, from /proc/self/smaps */
+static size_t flush_dirty_bytes(void)
+{
+	/* not malloc(), which would change the heap being flushed */
+	static char buf[16384];
+	uintptr_t lo = (uintptr_t)swap_base, hi = (uintptr_t)swap_max;
+	size_t have = 0, dirty = 0;
+	bool in = false;
+	int fd = open("/proc/self/smaps", O_RDONLY);
+	ssize_t n;
+
+	if (fd == -1) return(0);
+	while ((n = read(fd, buf + have, sizeof(buf) - 1 - have)) > 0) {
+		char *line = buf, *eol;
+
+		have += n;
+		buf[have] = '\0';
+		while ((eol = strchr(line, '\n')) != NULL) {
+			*eol = '\0';
+			/* mapping lines start with an address, fields with a name */
+			if (isdigit(*line) || (*line >= 'a' && *line <= 'f')) {
+				uintptr_t start = strtoul(line, NULL, 16);
+				in = start >= lo && start < hi;
+			} else if (in && (strncmp(line, "Shared_Dirty:", 13) == 0 ||
+			    strncmp(line, "Private_Dirty:", 14) == 0))
+				dirty += strtoul(strchr(line, ':') + 1, NULL, 10) << 10;
+			line = eol + 1;
+		}
+		have = buf + have - line;
+		if (have == sizeof(buf) - 1) have = 0; /* a line too long to use */
+		memmove(buf, line, have);
+	}
+	close(fd);
+	return(dirty);
+}
+
+/* Write back the changes of the heap, starting or waiting for writeback */
+static int flush_pass(unsigned level)
+{
+	size_t size;
+
+	malloc_mutex_lock(&swap_mtx);
+	size = (char *)swap_end - (char *)swap_base;
+	malloc_mutex_unlock(&swap_mtx);
+	if (level == FLUSH_SYNC)
+		return(fdatasync(mfd));
+#ifdef SYNC_FILE_RANGE_WRITE
+	return(sync_file_range(mfd, 0, size, SYNC_FILE_RANGE_WRITE));
+#else
+	return(msync(swap_base, size, MS_ASYNC));
+#endif
+}
+
+/* Wait on flush_cv, with flush_mtx held, until time wake (ms) */
+static void flush_sleep(uint64_t wake)
+{
+	struct timespec ts;
+
+	ts.tv_sec = wake / 1000;
+	ts.tv_nsec = (wake % 1000) * 1000000;
+	pthread_cond_timedwait(&flush_cv, &flush_mtx, &ts);
+}
+
+static void *flush_main(void *arg)
+{
+	pthread_mutex_lock(&flush_mtx);
+	while (!flush_quit) {
+		uint64_t now = flush_now(), due = flush_last + flush_interval;
+		unsigned level = flush_level;
+		size_t dirty = flush_dirty;
+		int res;
+
+		if (now < due) {
+			uint64_t tick = flush_interval / 8;
+
+			if (tick < FLUSH_TICK_MIN) tick = FLUSH_TICK_MIN;
+			if (tick > FLUSH_TICK_MAX) tick = FLUSH_TICK_MAX;
+			flush_sleep(dirty && due - now > tick ? now + tick : due);
+			if (flush_quit) break;
+			if (flush_now() < flush_last + flush_interval) {
+				bool over;
+
+				if (flush_dirty == 0) continue;
+				pthread_mutex_unlock(&flush_mtx);
+				over = flush_dirty_bytes() >= dirty;
+				pthread_mutex_lock(&flush_mtx);
+				if (!over) continue;
+			}
+		}
+		now = flush_now();
+		pthread_mutex_unlock(&flush_mtx);
+		res = flush_pass(level);
+		pthread_mutex_lock(&flush_mtx);
+		flush_last = now;
+		if (res == 0) {
+			if (now > flush_mark) flush_mark = now;
+		} else if (flush_err == 0) {
+			flush_err = errno;
+			fprintf(stderr, "flusher: error writing back map file: %s\n",
+				strerror(flush_err));
+		}
+	}
+	pthread_mutex_unlock(&flush_mtx);
+	return(NULL);
+}
+
+static void flush_stop(void)
+{
+	if (!flush_running) return;
+	pthread_mutex_lock(&flush_mtx);
+	flush_quit = true;
+	pthread_cond_signal(&flush_cv);
+	pthread_mutex_unlock(&flush_mtx);
+	pthread_join(flush_tid, NULL);
+	pthread_cond_destroy(&flush_cv);
+	flush_running = false;
+}
+
+static int flush_start(const char *who)
+{
+	pthread_condattr_t attr;
+
+	if (flush_running) return(0);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flush_cv, &attr);
+	pthread_condattr_destroy(&attr);
+	flush_quit = false;
+	flush_err = 0;
+	flush_last = flush_now();
+	if (pthread_create(&flush_tid, NULL, flush_main, NULL)) {
+		fprintf(stderr, "%s: error creating flusher thread\n", who);
+		pthread_cond_destroy(&flush_cv);
+		return(-1);
+	}
+	flush_running = true;
+	return(0);
+}
+
+/* Only a shared mapping reaches the map file by writeback */
+static int flush_check(unsigned level, const char *who)
+{
+	if (level != FLUSH_NONE && (map_private || map_anon || map_huge)) {
+		fprintf(stderr,
+			"%s: a flusher needs a shared mapping of a regular map file\n",
+			who);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Set the flusher up, starting or stopping its thread. Called with perm_mtx
+ * held and the heap open.
+ */
+static int flush_config(unsigned level, unsigned interval, size_t dirty,
+    const char *who)
+{
+	if (flush_check(level, who)) return(-1);
+	pthread_mutex_lock(&flush_mtx);
+	flush_level = level;
+	flush_interval = interval ? interval : 1;
+	flush_dirty = dirty;
+	if (flush_running) pthread_cond_signal(&flush_cv);
+	pthread_mutex_unlock(&flush_mtx);
+	if (level == FLUSH_NONE) {
+		flush_stop();
+		return(0);
+	}
+	return(flush_start(who));
+}
+
+/* Parse a level name: the level, or -1 */
+static int flush_parse(const char *s)
+{
+	int i;
+
+	for (i = FLUSH_NONE; i <= FLUSH_SYNC; i++)
+		if (strcmp(s, flush_names[i]) == 0) return(i);
+	return(-1);
+}
+
+/* Read the flusher settings of mopen() from the environment */
+static int flush_env(int *level, unsigned *interval, size_t *dirty)
+{
+	char *s;
+
+	*level = flush_parse((s = getenv("PERM_FLUSH")) != NULL ? s : "none");
+	if (*level == -1) {
+		fprintf(stderr, "mopen: unknown PERM_FLUSH level: %s\n", s);
+		return(-1);
 	}
+	*interval = strtoul((s = getenv("PERM_FLUSH_INTERVAL")) != NULL ?
+		s : "1000", NULL, 0);
+	*dirty = size_parse((s = getenv("PERM_FLUSH_DIRTY")) != NULL ? s : "0");
+	return(0);
+}
+
+/* The flusher settings, for mallctl(): the level name */
+const char *perm_flush_get(unsigned *interval, size_t *dirty)
+{
+	const char *level;
+
+	pthread_mutex_lock(&flush_mtx);
+	level = flush_names[flush_level];
+	*interval = flush_interval;
+	*dirty = flush_dirty;
+	pthread_mutex_unlock(&flush_mtx);
+	return(level);
+}
+
+/* Change the flusher settings, for mallctl(): true on error */
+bool perm_flush_set(const char *level, unsigned interval, size_t dirty)
+{
+	int l = level != NULL ? flush_parse(level) : -1;
+	int res = -1;
+
+	if (l == -1 || interval == 0) return(true);
+	malloc_mutex_lock(&perm_mtx);
+	if (mfd != -1 || map_anon)
+		res = flush_config(l, interval, dirty, "mallctl");
+	malloc_mutex_unlock(&perm_mtx);
+	return(res != 0);
+}
+
+/*
+ * Milliseconds since the start of the last flusher pass or mflush() that
+ * completed: older changes of the heap have been written back (with async,
+ * handed to the kernel for writeback).
+ */
+uint64_t perm_flush_lag(void)
+{
+	uint64_t lag;
+
+	pthread_mutex_lock(&flush_mtx);
+	lag = flush_mark ? flush_now() - flush_mark : 0;
+	pthread_mutex_unlock(&flush_mtx);
+	return(lag);
+}
+
+/* Fill order with the slots of committed generations, newest first */
+static unsigned ring_scan(unsigned *order, uint64_t *gens)
+{
+	ring_rec_t rec;
+	unsigned i, j, n = 0;
+
+	for (i = 0; i < ring_n; i++) {
+		if (pread(ring_rfd, &rec, sizeof(rec), i * RING_REC_SZ) != sizeof(rec) ||
+		    rec.version_key != PERM_RKEY || rec.slot != i ||
+		    rec.crc != crc32c(0, &rec, offsetof(ring_rec_t, crc)))
+			continue;
+		for (j = n; j > 0 && gens[j-1] < rec.gen; j--) {
+			order[j] = order[j-1];
+			gens[j] = gens[j-1];
+		}
+		order[j] = i;
+		gens[j] = rec.gen;
+		n++;
+	}
+	return(n);
+}
+
+/* Clear the record of the oldest generation and write the next one there */
+static int ring_open(void)
+{
+	ring_rec_t rec;
+
+	ring_next = (ring_cur + 1) % ring_n;
+	memset(&rec, 0, sizeof(rec));
+	if (pwrite(ring_rfd, &rec, sizeof(rec), ring_next * RING_REC_SZ) !=
+	    sizeof(rec) || fdatasync(ring_rfd) == -1)
+		return(-1);
+	bfd = ring_fd[ring_next];
+	return(0);
+}
+
+/* Commit the durable base image started by ring_open() */
+static int ring_commit(void)
+{
+	ring_rec_t rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.version_key = PERM_RKEY;
+	rec.slot = ring_next;
+	rec.gen = ring_gen + 1;
+	rec.crc = crc32c(0, &rec, offsetof(ring_rec_t, crc));
+	if (pwrite(ring_rfd, &rec, sizeof(rec), ring_next * RING_REC_SZ) !=
+	    sizeof(rec) || fdatasync(ring_rfd) == -1)
+		return(-1);
+	ring_gen = rec.gen;
+	ring_cur = ring_next;
+	return(0);
+}
+
+static void ring_fini(void)
+{
+	unsigned i;
+
+	if (ring_n == 0) {
+		if (bfd != -1) close(bfd);
+		bfd = -1;
+		return;
+	}
+	for (i = 0; i < ring_n; i++) {
+		if (ring_fd[i] != -1) close(ring_fd[i]);
+		ring_fd[i] = -1;
+	}
+	if (ring_rfd != -1) close(ring_rfd);
+	ring_rfd = -1;
+	ring_n = 0;
+	bfd = -1;
+}
+
+/* Open the backup file, or the ring of generations (PERM_RING) it names */
+static int ring_init(const char *fname, int flags)
+{
+	char *s, path[PATH_MAX];
+	unsigned i, order[RING_MAX];
+	uint64_t gens[RING_MAX];
+
+	ring_n = strtoul((s = getenv("PERM_RING")) != NULL ? s : "0", NULL, 0);
+	if (ring_n <= 1) {
+		ring_n = 0;
+		bfd = open(fname, flags, (mode_t)0666);
+		if (bfd == -1) {
+			perror("bopen: error opening backup file");
+			return(-1);
+		}
+		return(0);
+	}
+	if (ring_n > RING_MAX) ring_n = RING_MAX;
+	crc32c_boot();
+	for (i = 0; i < ring_n; i++) ring_fd[i] = -1;
+	ring_rfd = open(fname, flags, (mode_t)0666);
+	if (ring_rfd == -1) {
+		perror("bopen: error opening backup ring");
+		goto ri_error;
+	}
+	for (i = 0; i < ring_n; i++) {
+		if (snprintf(path, sizeof(path), "%s.%u", fname, i) >= sizeof(path)) {
+			fprintf(stderr, "bopen: backup file name too long\n");
+			goto ri_error;
+		}
+		ring_fd[i] = open(path, flags, (mode_t)0666);
+		if (ring_fd[i] == -1) {
+			perror("bopen: error opening backup generation");
+			goto ri_error;
+		}
+	}
+
+	/* the first base image goes to slot 0 */
+	ring_cur = ring_n - 1;
+	ring_gen = 0;
+	if (ring_scan(order, gens)) {
+		ring_cur = order[0];
+		ring_gen = gens[0];
+	}
+	bfd = ring_fd[ring_cur];
+	return(0);
+ri_error:
+	ring_fini();
+	return(-1);
+}
+
+/*
+ * Heap images are copied by a pool of PERM_IO_THREADS threads (the calling
+ * thread being one of them). Ranges of the heap are queued in batches and
+ * split into stripes aligned to io_stripe, which the threads take in turn
+ * and pass to the batch operation: pread()/pwrite() at the matching file
+ * offsets, or compression of a frame. The threads are started by bopen(),
+ * when no allocator locks are held, since they cannot be created while
+ * backup() or restore() hold them.
+ */
+#define IO_MAX_THREADS 64
+#define IO_MAX_RANGES 256
+#define IO_BUF_SZ (2 * io_stripe)
+
+typedef struct {
+	off_t off;
+	size_t len;
+} io_range_t;
+
+typedef struct {
+	pthread_t tid;
+	void *buf; /* IO_BUF_SZ bytes for a frame and its compressed form */
+	unsigned nstripes; /* stripes copied since io_stats_reset() */
+	size_t bytes;
+	double secs;
+} io_lane_t;
+
+/* Copy the stripe [off, off+len) of the heap; returns len on success */
+typedef ssize_t io_op_t(io_lane_t *lane, off_t off, size_t len);
+
+static pthread_mutex_t io_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cv = PTHREAD_COND_INITIALIZER;
+static unsigned io_nthreads = 1; /* including the calling thread */
+static bool io_stats; /* report throughput (PERM_IO_STATS) */
+static size_t io_stripe;
+static io_lane_t io_lane[IO_MAX_THREADS];
+static unsigned io_gen; /* incremented for each batch */
+static unsigned io_busy; /* pool threads still working on the batch */
+static bool io_quit;
+/* the batch */
+static int io_fd;
+static io_op_t *io_op;
+static io_range_t io_rv[IO_MAX_RANGES];
+static unsigned io_nr, io_next; /* ranges queued, next range */
+static off_t io_pos; /* next offset in range io_next */
+static int io_err;
+/* compressed frames (cmp_write/cmp_read) */
+static io_range_t *cmp_idx; /* file range of each frame, len 0 when free */
+static off_t cmp_off; /* next free file offset */
+
+static double io_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+/*
+ * Record the sum of the block at off. The stripes of an image are whole
+ * blocks, since the in-use ranges of the heap are made of chunks. With
+ * PERM_VERIFY=none, the block is not read to sum it.
+ */
+static void sum_put(off_t off, const void *buf, size_t len)
+{
+	sum_t *sum = &sum_tab[off / io_stripe];
+
+	if (sum_verify == VERIFY_NONE) {
+		sum->state = SUM_NONE;
+		return;
+	}
+	sum->crc = crc32c(0, buf, len);
+	sum->state = SUM_DATA;
+}
+
+static void sum_reset(void)
+{
+	memset(sum_tab, 0, sum_max * sizeof(sum_t));
+}
+
+/* End lazy verification of the restored image */
+static void sum_drop(void)
+{
+	if (cmp_idx != NULL) {
+		scratch_free(cmp_idx, CMP_IDX_SZ(sum_rec->nblocks)); cmp_idx = NULL;
+	}
+	sum_lazy = false;
+}
+
+/* Write the trailer for an image of heap_sz bytes at off */
+static int sum_write(int fd, size_t heap_sz, off_t off)
+{
+	size_t n = heap_sz / io_stripe;
+
+	sum_rec->version_key = PERM_SKEY;
+	sum_rec->block_sz = io_stripe;
+	sum_rec->nblocks = n;
+	sum_rec->crc = crc32c(0, sum_tab, n * sizeof(sum_t));
+	if (lpwrite(fd, sum_rec, sizeof(sum_hdr_t) + n * sizeof(sum_t), off) !=
+	    sizeof(sum_hdr_t) + n * sizeof(sum_t))
+		return(-1);
+	return(0);
+}
+
+/* Verify a restored block against its sum */
+static ssize_t sum_check(io_lane_t *lane, off_t off, size_t len)
+{
+	if (crc32c(0, (char *)swap_base + off, len) != sum_tab[off / io_stripe].crc) {
+		fprintf(stderr, "restore: checksum mismatch in block at %zu\n",
+			(size_t)off);
+		errno = EIO;
+		return(-1);
+	}
+	return(len);
+}
+
+/* Verify the block at off as stored in the backup file */
+static ssize_t sum_file(io_lane_t *lane, off_t off, size_t len)
+{
+	sum_t *sum = &sum_tab[off / io_stripe];
+	char *buf = lane->buf;
+
+	if (cmp_idx != NULL) {
+		io_range_t *frame = &cmp_idx[off / io_stripe];
+
+		if (frame->len == len) {
+			if (lpread(io_fd, buf, len, frame->off) != len) return(-1);
+		} else if (frame->len > len ||
+		    lpread(io_fd, buf + len, frame->len, frame->off) != frame->len ||
+		    lz_decompress(buf + len, frame->len, buf, len)) {
+			fprintf(stderr, "restore_verify: compressed frame at %zu corrupt\n",
+				(size_t)off);
+			errno = EIO;
+			return(-1);
+		}
+	} else if (lpread(io_fd, buf, len, off) != len)
+		return(-1);
+	if (crc32c(0, buf, len) != sum->crc) {
+		fprintf(stderr, "restore_verify: checksum mismatch in block at %zu\n",
+			(size_t)off);
+		errno = EIO;
+		return(-1);
+	}
+	sum->state = SUM_CHECKED;
+	return(len);
+}
+
+static ssize_t io_pwrite(io_lane_t *lane, off_t off, size_t len)
+{
+	char *buf = (char *)swap_base + off;
+
+	sum_put(off, buf, len);
+	return(lpwrite(io_fd, buf, len, off));
+}
+
+/* Is the error one of a method, not of the files? */
+static bool copy_unsupported(int err)
+{
+	return(err == ENOSYS || err == EOPNOTSUPP || err == ENOTTY ||
+	    err == EXDEV || err == EINVAL || err == EBADF);
+}
+
+/*
+ * Copy the range [off, off+len) of file from to the same offsets of file to
+ * in the kernel: 0 done, 1 not supported, -1 error
+ */
+static int copy_kernel(int from, int to, off_t off, size_t len)
+{
+#ifdef FICLONERANGE
+	if (!copy_noclone) {
+		struct file_clone_range fcr;
+
+		fcr.src_fd = from;
+		fcr.src_offset = off;
+		fcr.src_length = len;
+		fcr.dest_offset = off;
+		if (ioctl(to, FICLONERANGE, &fcr) == 0) return(0);
+		if (!copy_unsupported(errno)) return(-1);
+		copy_noclone = true;
+	}
+#endif
+#ifdef __NR_copy_file_range
+	if (!copy_norange) {
+		loff_t in = off, out = off;
+		size_t done = 0;
+
+		while (done < len) {
+			ssize_t res = syscall(__NR_copy_file_range, from, &in, to,
+				&out, len - done, 0);
+			if (res <= 0) break;
+			done += res;
+		}
+		if (done == len) return(0);
+		if (done || !copy_unsupported(errno)) return(-1);
+		copy_norange = true;
+	}
+#endif
+	return(1);
+}
+
+/*
+ * Copy a block of the heap from the map file to the backup file. A block
+ * cloned or copied in the kernel is not summed, since that would read it
+ * through the mapping; restore() and restore_verify() skip it.
+ */
+static ssize_t io_copy(io_lane_t *lane, off_t off, size_t len)
+{
+	char *buf = (char *)swap_base + off;
+	int res;
+
+	if ((res = copy_kernel(mfd, io_fd, off, len)) <= 0) {
+		if (res == 0) sum_tab[off / io_stripe].state = SUM_NONE;
+		return(res ? -1 : len);
+	}
+	sum_put(off, buf, len);
+	return(lpwrite(io_fd, buf, len, off));
+}
+
+/* Copy a block of the heap from the backup file to the map file */
+static ssize_t io_fetch(io_lane_t *lane, off_t off, size_t len)
+{
+	int res;
+
+	if ((res = copy_kernel(io_fd, mfd, off, len)) <= 0)
+		return(res ? -1 : len);
+	return(lpread(io_fd, (char *)swap_base + off, len, off));
+}
+
+static ssize_t io_pread(io_lane_t *lane, off_t off, size_t len)
+{
+	return(lpread(io_fd, (char *)swap_base + off, len, off));
+}
+
+/* Copy stripes of the batch until none are left */
+static void io_run(io_lane_t *lane)
+{
+	while (true) {
+		off_t off;
+		size_t len;
+		ssize_t res;
+		double t0;
+
+		pthread_mutex_lock(&io_mtx);
+		if (io_err || io_next == io_nr) {
+			pthread_mutex_unlock(&io_mtx);
+			return;
+		}
+		off = io_pos;
+		len = io_stripe - (off & (io_stripe - 1));
+		if (len >= io_rv[io_next].off + io_rv[io_next].len - off) {
+			len = io_rv[io_next].off + io_rv[io_next].len - off;
+			if (++io_next < io_nr) io_pos = io_rv[io_next].off;
+		} else
+			io_pos += len;
+		pthread_mutex_unlock(&io_mtx);
+
+		t0 = io_time();
+		res = io_op(lane, off, len);
+		lane->secs += io_time() - t0;
+		if (res != len) {
+			pthread_mutex_lock(&io_mtx);
+			if (io_err == 0) io_err = res == -1 ? errno : EIO;
+			pthread_mutex_unlock(&io_mtx);
+			return;
+		}
+		lane->nstripes++;
+		lane->bytes += len;
+	}
+}
+
+static void *io_worker(void *arg)
+{
+	io_lane_t *lane = arg;
+	unsigned gen = 0;
+
+	pthread_mutex_lock(&io_mtx);
+	while (true) {
+		while (io_gen == gen && !io_quit)
+			pthread_cond_wait(&io_work_cv, &io_mtx);
+		if (io_quit) break;
+		gen = io_gen;
+		pthread_mutex_unlock(&io_mtx);
+		io_run(lane);
+		pthread_mutex_lock(&io_mtx);
+		if (--io_busy == 0) pthread_cond_signal(&io_done_cv);
+	}
+	pthread_mutex_unlock(&io_mtx);
+	return(NULL);
+}
+
+/* Copy the queued ranges between the heap and fd */
+static int io_flush(void)
+{
+	int err;
+
+	if (io_nr == 0) return(0);
+	pthread_mutex_lock(&io_mtx);
+	io_next = 0;
+	io_pos = io_rv[0].off;
+	io_busy = io_nthreads - 1;
+	io_gen++;
+	pthread_cond_broadcast(&io_work_cv);
+	pthread_mutex_unlock(&io_mtx);
+
+	io_run(&io_lane[0]);
+
+	pthread_mutex_lock(&io_mtx);
+	while (io_busy)
+		pthread_cond_wait(&io_done_cv, &io_mtx);
+	err = io_err;
+	io_err = 0;
+	io_nr = 0;
+	pthread_mutex_unlock(&io_mtx);
+	if (err) {
+		errno = err;
+		return(-1);
+	}
+	return(0);
+}
+
+/* Queue the range [off, off+len) of the heap to be copied to or from fd */
+static int io_queue(int fd, io_op_t *op, off_t off, size_t len)
+{
+	if (len == 0) return(0);
+	if (io_nr == IO_MAX_RANGES || (io_nr && (fd != io_fd || op != io_op)))
+		if (io_flush()) return(-1);
+	io_fd = fd;
+	io_op = op;
+	io_rv[io_nr].off = off;
+	io_rv[io_nr].len = len;
+	io_nr++;
+	return(0);
+}
+
+/* Verify the restored blocks of an image of nblocks blocks */
+static int heap_verify(int fd, size_t nblocks)
+{
+	size_t i;
+
+	for (i = 0; i < nblocks; i++) {
+		if (sum_tab[i].state == SUM_DATA &&
+		    io_queue(fd, sum_check, i * io_stripe, io_stripe))
+			return(-1);
+	}
+	return(io_flush());
+}
+
+static void io_stats_reset(void)
+{
+	unsigned i;
+
+	for (i = 0; i < io_nthreads; i++) {
+		io_lane[i].nstripes = 0;
+		io_lane[i].bytes = 0;
+		io_lane[i].secs = 0.0;
+	}
+}
+
+static void io_stats_print(const char *who)
+{
+	unsigned i;
+
+	if (!io_stats) return;
+	for (i = 0; i < io_nthreads; i++) {
+		io_lane_t *lane = &io_lane[i];
+		fprintf(stderr,
+			"%s: thread:%u stripes:%u bytes:%zu time:%.6f rate:%.1f MiB/s\n",
+			who, i, lane->nstripes, lane->bytes, lane->secs,
+			lane->secs > 0.0 ? lane->bytes / lane->secs / (1 << 20) : 0.0);
+	}
+}
+
+/* Start the I/O threads (PERM_IO_THREADS) for a newly opened backup file */
+static int io_init(void)
+{
+	char *s;
+	unsigned i, n;
+
+	s = getenv("PERM_COMPRESS");
+	cmp_on = s != NULL && strcmp(s, "none") != 0;
+	if (cmp_on && strcmp(s, "lz") != 0) {
+		fprintf(stderr, "bopen: unknown PERM_COMPRESS format: %s\n", s);
+		return(-1);
+	}
+	s = getenv("PERM_VERIFY");
+	if (s == NULL || strcmp(s, "full") == 0) sum_verify = VERIFY_FULL;
+	else if (strcmp(s, "lazy") == 0) sum_verify = VERIFY_LAZY;
+	else if (strcmp(s, "none") == 0) sum_verify = VERIFY_NONE;
+	else {
+		fprintf(stderr, "bopen: unknown PERM_VERIFY mode: %s\n", s);
+		return(-1);
+	}
+	crc32c_boot();
+	s = getenv("PERM_RESTORE");
+	ovl_on = s != NULL && strcmp(s, "copy") != 0;
+	if (ovl_on && strcmp(s, "map") != 0) {
+		fprintf(stderr, "bopen: unknown PERM_RESTORE mode: %s\n", s);
+		return(-1);
+	}
+	s = getenv("PERM_COPY");
+	copy_on = s != NULL && strcmp(s, "user") != 0;
+	if (s != NULL && strcmp(s, "user") != 0 && strcmp(s, "clone") != 0 &&
+	    strcmp(s, "kernel") != 0) {
+		fprintf(stderr, "bopen: unknown PERM_COPY mode: %s\n", s);
+		return(-1);
+	}
+	copy_noclone = false;
+	copy_norange = !copy_on || strcmp(s, "kernel") != 0;
+
+	n = strtoul((s = getenv("PERM_IO_THREADS")) != NULL ? s : "1", NULL, 0);
+	if (n == 0) n = 1;
+	if (n > IO_MAX_THREADS) n = IO_MAX_THREADS;
+	io_stats = getenv("PERM_IO_STATS") != NULL;
+	io_stripe = chunksize;
+	io_quit = false;
+	io_nthreads = 1;
+	sum_max = (swap_max-swap_base) / io_stripe;
+	if ((sum_rec = scratch_alloc(SUM_REC_SZ(sum_max), false)) == NULL) {
+		fprintf(stderr, "bopen: error allocating block checksums\n");
+		return(-1);
+	}
+	sum_tab = (sum_t *)(sum_rec + 1);
+	/* lane buffers are only touched for compressed or verified images */
+	if ((io_lane[0].buf = scratch_alloc(IO_BUF_SZ, false)) == NULL) {
+		fprintf(stderr, "bopen: error allocating I/O buffer\n");
+		scratch_free(sum_rec, SUM_REC_SZ(sum_max)); sum_rec = NULL;
+		return(-1);
+	}
+	for (i = 1; i < n; i++) {
+		if ((io_lane[i].buf = scratch_alloc(IO_BUF_SZ, false)) == NULL)
+			break;
+		if (pthread_create(&io_lane[i].tid, NULL, io_worker, &io_lane[i])) {
+			perror("bopen: error creating I/O thread");
+			scratch_free(io_lane[i].buf, IO_BUF_SZ); io_lane[i].buf = NULL;
+			break;
+		}
+		io_nthreads++;
+	}
+	return(0);
+}
+
+static void io_fini(void)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&io_mtx);
+	io_quit = true;
+	pthread_cond_broadcast(&io_work_cv);
+	pthread_mutex_unlock(&io_mtx);
+	for (i = 1; i < io_nthreads; i++)
+		pthread_join(io_lane[i].tid, NULL);
+	for (i = 0; i < io_nthreads; i++) {
+		scratch_free(io_lane[i].buf, IO_BUF_SZ); io_lane[i].buf = NULL;
+	}
+	io_nthreads = 1;
+	sum_drop();
+	scratch_free(sum_rec, SUM_REC_SZ(sum_max)); sum_rec = NULL;
+}
+
+/*
+ * The snapshot child of backup_async() queues the stripes of a heap image on
+ * an io_uring, set up with raw system calls, and the kernel writes them from
+ * the child's copy-on-write view of the heap. The child collects the
+ * completions and refills the ring until a final fsync, queued after the
+ * last write, completes. Where io_uring is not available the child writes
+ * the image as backup() does.
+ */
+static bool aio_queueing; /* heap_write_sparse() queues on the ring */
+static bool aio_pending; /* writes or fsync in flight */
+static io_range_t *aio_rv; /* ranges to write */
+static size_t aio_nr, aio_max;
+
+#ifdef PERM_URING
+#define AIO_DEPTH 64
+#define AIO_FSYNC AIO_DEPTH /* user_data of the fsync */
+
+typedef struct {
+	struct iovec iov;
+	off_t off;
+} aio_slot_t;
+
+static bool aio_synced; /* fsync queued */
+static int aio_fd;
+static size_t aio_heap_sz; /* the checksum trailer follows the image */
+static int aio_err;
+static size_t aio_next; /* next range */
+static off_t aio_pos; /* next offset in range aio_next */
+static aio_slot_t aio_slot[AIO_DEPTH];
+static unsigned aio_free[AIO_DEPTH], aio_nfree; /* free slots */
+
+static struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+} uring = {-1};
+
+static void uring_fini(void)
+{
+	if (uring.fd == -1) return;
+	if (uring.sqes != NULL) munmap(uring.sqes, uring.sqes_sz);
+	if (uring.cq_ring != NULL) munmap(uring.cq_ring, uring.cq_ring_sz);
+	if (uring.sq_ring != NULL) munmap(uring.sq_ring, uring.sq_ring_sz);
+	uring.sqes = NULL; uring.cq_ring = NULL; uring.sq_ring = NULL;
+	close(uring.fd); uring.fd = -1;
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	if (uring.fd != -1) return(0);
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &p);
+	if (uring.fd == -1) return(-1);
+
+	uring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	uring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, uring.sq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) goto ui_error;
+	uring.sq_ring = sq;
+	cq = mmap(NULL, uring.cq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED) goto ui_error;
+	uring.cq_ring = cq;
+	uring.sqes = mmap(NULL, uring.sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		uring.sqes = NULL;
+		goto ui_error;
+	}
+	uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return(0);
+ui_error:
+	uring_fini();
+	return(-1);
+}
+
+/* Queue a write of slot s, or the fsync when s is AIO_FSYNC */
+static void uring_prep(unsigned *tail, unsigned s)
+{
+	unsigned i = *tail & *uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = aio_fd;
+	sqe->user_data = s;
+	if (s == AIO_FSYNC) {
+		sqe->opcode = IORING_OP_FSYNC;
+	} else {
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (uintptr_t)&aio_slot[s].iov;
+		sqe->len = 1;
+		sqe->off = aio_slot[s].off;
+	}
+	uring.sq_array[i] = i;
+	(*tail)++;
+}
+
+static int uring_enter(unsigned nsubmit, unsigned nwait)
+{
+	int res;
+
+	do {
+		res = syscall(__NR_io_uring_enter, uring.fd, nsubmit, nwait,
+		    nwait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (res == -1 && errno == EINTR);
+	return(res);
+}
+#endif /* PERM_URING */
+
+/* Add the range [off, off+len) of the heap to the image being queued */
+static int aio_add(off_t off, size_t len)
+{
+	if (aio_nr == aio_max) {
+		size_t max = aio_max ? aio_max * 2 : PAGE_SIZE / sizeof(io_range_t);
+		io_range_t *rv = scratch_alloc(max * sizeof(io_range_t), false);
+
+		if (rv == NULL) return(-1);
+		if (aio_nr) memcpy(rv, aio_rv, aio_nr * sizeof(io_range_t));
+		scratch_free(aio_rv, aio_max * sizeof(io_range_t));
+		aio_rv = rv;
+		aio_max = max;
+	}
+	aio_rv[aio_nr].off = off;
+	aio_rv[aio_nr].len = len;
+	aio_nr++;
+	return(0);
+}
+
+#ifdef PERM_URING
+/* Fill the submission queue from the stripes left to write */
+static int aio_submit(void)
+{
+	unsigned tail = *uring.sq_tail, n = 0;
+
+	while (aio_err == 0) {
+		if (aio_next < aio_nr && aio_nfree) {
+			unsigned s = aio_free[--aio_nfree];
+			off_t end = aio_rv[aio_next].off + aio_rv[aio_next].len;
+			size_t len = io_stripe - (aio_pos & (io_stripe - 1));
+
+			if (len > end - aio_pos) len = end - aio_pos;
+			sum_put(aio_pos, (char *)swap_base + aio_pos, len);
+			aio_slot[s].iov.iov_base = (char *)swap_base + aio_pos;
+			aio_slot[s].iov.iov_len = len;
+			aio_slot[s].off = aio_pos;
+			aio_pos += len;
+			if (aio_pos == end && ++aio_next < aio_nr)
+				aio_pos = aio_rv[aio_next].off;
+			uring_prep(&tail, s);
+		} else if (aio_next == aio_nr && aio_nfree == AIO_DEPTH &&
+		    !aio_synced) {
+			/* all of the writes are complete */
+			if (sum_write(aio_fd, aio_heap_sz, aio_heap_sz) == -1)
+				return(-1);
+			aio_synced = true;
+			uring_prep(&tail, AIO_FSYNC);
+		} else
+			break;
+		n++;
+	}
+	if (n == 0) return(0);
+	__atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+	return(uring_enter(n, 0) == -1 ? -1 : 0);
+}
+#endif
+
+#ifdef PERM_URING
+/* Start writing the queued image to fd */
+static void aio_start(int fd)
+{
+	unsigned i;
+
+	aio_fd = fd;
+	aio_heap_sz = swap_end-swap_base;
+	aio_next = 0;
+	aio_pos = aio_rv[0].off;
+	aio_err = 0;
+	aio_synced = false;
+	for (i = 0; i < AIO_DEPTH; i++) aio_free[i] = AIO_DEPTH - 1 - i;
+	aio_nfree = AIO_DEPTH;
+	aio_pending = true;
+	snap_res = 1;
+	if (aio_submit() == -1) aio_err = errno;
+}
+#endif
+
+/* Collect completions of the image being written, waiting if block is true */
+static int aio_reap(bool block)
+{
+#ifdef PERM_URING
+	while (aio_pending) {
+		unsigned head = *uring.cq_head;
+		struct io_uring_cqe *cqe;
+		unsigned s;
+
+		if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+			if (aio_err && aio_nfree == AIO_DEPTH && !aio_synced) {
+				/* nothing left in flight after an error */
+				aio_pending = false;
+				break;
+			}
+			if (!block) return(1);
+			if (uring_enter(0, 1) == -1) {
+				if (aio_err == 0) aio_err = errno;
+				aio_pending = false;
+			}
+			continue;
+		}
+		cqe = &uring.cqes[head & *uring.cq_mask];
+		s = (unsigned)cqe->user_data;
+		if (s == AIO_FSYNC) {
+			if (cqe->res < 0 && aio_err == 0) aio_err = -cqe->res;
+			aio_pending = false;
+		} else if (cqe->res < 0 || cqe->res == 0) {
+			if (aio_err == 0) aio_err = cqe->res < 0 ? -cqe->res : EIO;
+			aio_free[aio_nfree++] = s;
+		} else if (cqe->res < aio_slot[s].iov.iov_len) {
+			/* write the rest of a short write again */
+			unsigned tail = *uring.sq_tail;
+			aio_slot[s].iov.iov_base =
+			    (char *)aio_slot[s].iov.iov_base + cqe->res;
+			aio_slot[s].iov.iov_len -= cqe->res;
+			aio_slot[s].off += cqe->res;
+			uring_prep(&tail, s);
+			__atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+			if (uring_enter(1, 0) == -1 && aio_err == 0) aio_err = errno;
+		} else
+			aio_free[aio_nfree++] = s;
+		__atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+		if (aio_pending && aio_submit() == -1 && aio_err == 0)
+			aio_err = errno;
+	}
+	if (aio_nr) {
+		aio_nr = 0;
+		if (aio_err) {
+			errno = aio_err;
+			perror("backup: error writing heap data");
+			incr_base = false; /* a partly written base image */
+			snap_res = -1;
+		} else if (ring_n && ring_commit()) {
+			perror("backup: error committing generation");
+			incr_base = false;
+			snap_res = -1;
+		} else
+			snap_res = 0;
+	}
+#endif
+	return(snap_res);
+}
+
+static void aio_fini(void)
+{
+	aio_reap(true);
+	scratch_free(aio_rv, aio_max * sizeof(io_range_t)); aio_rv = NULL;
+	aio_max = 0;
+#ifdef PERM_URING
+	uring_fini();
+#endif
+}
+
+/* Ask for transparent huge pages on [addr, addr+size) of the heap if enabled */
+static void heap_advise(void *addr, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	if (map_thp) madvise(addr, size, MADV_HUGEPAGE);
+#endif
+}
+
+/* Map the first size bytes of the heap from the mmap file again */
+static int heap_remap(size_t size)
+{
+	int prot = PROT_READ |
+		((O_WRONLY|O_RDWR) & fcntl(mfd, F_GETFL) ? PROT_WRITE : 0);
+
+	if (mmap(swap_base, size, prot,
+	    MAP_FIXED | (map_private ? MAP_PRIVATE : MAP_SHARED), mfd, 0) ==
+	    MAP_FAILED)
+		return(-1);
+	heap_advise(swap_base, size);
+	return(0);
+}
+
+/*
+ * The map file matches the heap only through a shared mapping, so only then
+ * can heap data be copied between it and the backup file in the kernel.
+ */
+static bool heap_shared(void)
+{
+	return(copy_on && !map_private && !map_anon && map_huge == 0 &&
+	    ovl_sz == 0);
+}
+
+/*
+ * Find the next in-use range [*start, *end) of the heap at or after *start.
+ * Returns false past the end of the heap.
+ */
+static bool heap_used_next(char **start, char **end)
+{
+	while (*start < (char *)swap_end) {
+		size_t fsize = 0;
+		char *fbeg = chunk_swap_free_next(*start, &fsize);
+
+		if (fbeg == NULL || fbeg > (char *)swap_end) fbeg = swap_end;
+		if (*start < fbeg) {
+			*end = fbeg;
+			return(true);
+		}
+		*start = fbeg + fsize;
+	}
+	return(false);
+}
+
+/*
+ * Write the in-use heap to fd at its heap offsets. Free extents are not
+ * written and are punched out of the file where the file system allows it,
+ * leaving a sparse file.
+ */
+static int heap_write_sparse(int fd)
+{
+	char *start = swap_base, *end, *prev = swap_base;
+	io_op_t *op = heap_shared() ? io_copy : io_pwrite;
+
+	while (heap_used_next(&start, &end)) {
+		size_t len = end - start;
+		off_t off = start - (char *)swap_base;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (prev < start && fallocate(fd,
+		    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		    prev - (char *)swap_base, start - prev) == -1 &&
+		    errno != EOPNOTSUPP)
+			return(-1);
+#endif
+		if (aio_queueing ? aio_add(off, len) :
+		    io_queue(fd, op, off, len))
+			return(-1);
+		start = prev = end;
+	}
+	return(aio_queueing ? 0 : io_flush());
+}
+
+/*
+ * Read a heap image of heap_sz bytes from fd, skipping the holes of a
+ * sparse file. A hole that the restored heap has in use (e.g. a file system
+ * that stores zero blocks as holes) is zeroed. With a shared mapping, the
+ * data is instead cloned or copied into the map file, and the heap mapped
+ * from it again, so that restored pages are not dirtied through the heap
+ * and written back again later.
+ */
+static int heap_read_sparse(int fd, size_t heap_sz)
+{
+	io_op_t *op = heap_shared() ? io_fetch : io_pread;
+#ifdef SEEK_DATA
+	char *start, *end;
+	off_t data = 0, hole;
+
+	while (data < heap_sz) {
+		data = lseek(fd, data, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) break;
+		if (data == -1 && errno == EINVAL) goto rd_dense;
+		if (data == -1) return(-1);
+		if (data >= heap_sz) break;
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1) return(-1);
+		if (hole > heap_sz) hole = heap_sz;
+		if (io_queue(fd, op, data, hole - data)) return(-1);
+		data = hole;
+	}
+	if (io_flush()) return(-1);
+	if (op == io_fetch && heap_remap(heap_sz)) return(-1);
+
+	/* the free extents are those of the image just read */
+	start = swap_base;
+	while (heap_used_next(&start, &end)) {
+		off_t off = start - (char *)swap_base;
+		off_t lim = end - (char *)swap_base;
+
+		while (off < lim) {
+			hole = lseek(fd, off, SEEK_HOLE);
+			if (hole == -1) return(-1);
+			if (hole >= lim) break;
+			data = lseek(fd, hole, SEEK_DATA);
+			if (data == -1 && errno != ENXIO) return(-1);
+			if (data == -1 || data > lim) data = lim;
+			memset((char *)swap_base + hole, 0, data - hole);
+			off = data;
+		}
+		start = end;
+	}
+	return(0);
+rd_dense:
+	io_nr = 0; /* drop ranges queued before SEEK_DATA failed */
+#endif
+	if (io_queue(fd, op, 0, heap_sz) || io_flush()) return(-1);
+	if (op == io_fetch && heap_remap(heap_sz)) return(-1);
+	return(0);
+}
+
+/*
+ * The heap is backed by huge pages when the map file is on hugetlbfs, or,
+ * with mopen() mode "h", by transparent huge pages where the file system
+ * provides them (e.g. tmpfs mounted with huge=advise). Find out which.
+ */
+static int huge_init(bool thp)
+{
+	struct statfs sfs;
+
+	map_huge = 0;
+	map_thp = false;
+	if (map_anon) {
+		sfs.f_type = 0;
+	} else if (fstatfs(mfd, &sfs) == -1) {
+		perror("mopen: error reading map file system");
+		return(-1);
+	}
+	if (sfs.f_type == HUGETLBFS_MAGIC) {
+		map_huge = sfs.f_bsize;
+		/* hugetlbfs files can only be changed through a shared mapping */
+		if (map_private) {
+			fprintf(stderr,
+				"mopen: a private mapping is not supported on hugetlbfs\n");
+			return(-1);
+		}
+	} else if (thp) {
+#ifdef MADV_HUGEPAGE
+		map_thp = true;
+#else
+		fprintf(stderr, "mopen: transparent huge pages not supported\n");
+		return(-1);
+#endif
+	}
+	return(0);
+}
+
+/*
+ * Chunks, and so the heap base address and its file offsets, must be
+ * aligned to the huge page size.
+ */
+static int huge_check(void)
+{
+	size_t hpsz = map_huge;
+
+	if (map_thp) {
+		/* not stdio, which would call malloc() before the heap exists */
+		char buf[32];
+		int fd = open(THP_SIZE_FILE, O_RDONLY);
+		ssize_t n = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+		if (fd != -1) close(fd);
+		buf[n > 0 ? n : 0] = '\0';
+		hpsz = strtoul(buf, NULL, 10);
+	}
+	if (hpsz > chunksize) {
+		fprintf(stderr,
+			"mopen: huge page size 0x%zX is larger than the chunk size 0x%zX\n",
+			hpsz, chunksize);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * With PERM_RESTORE=map, restore() maps a raw base image over the heap with
+ * a private mapping of the backup file instead of reading it in, so that a
+ * page is read from the backup file when first touched and copied when
+ * first written. The in-use heap is written to the mmap file, and the heap
+ * mapped from the mmap file again, by the next mflush(), backup(), or
+ * bclose(), since the backup file may then be changed.
+ */
+/* Map the heap from the mmap file again, dropping the overlay */
+static int ovl_drop(void)
+{
+	if (ovl_sz == 0) return(0);
+	if (heap_remap(ovl_sz)) return(-1);
+	ovl_sz = 0;
+	return(0);
+}
+
+/* Map a raw image of heap_sz bytes from fd over the heap */
+static int ovl_map(int fd, size_t heap_sz)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1) return(-1);
+	if (st.st_size < heap_sz) {
+		errno = EINVAL;
+		return(-1);
+	}
+	if (mmap(swap_base, heap_sz, PROT_READ | PROT_WRITE,
+	    MAP_FIXED | MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		return(-1);
+	heap_advise(swap_base, heap_sz);
+	ovl_sz = heap_sz;
+	return(0);
+}
+
+/* Write the in-use heap of the overlay to the mmap file and drop it */
+static int ovl_commit(void)
+{
+	char *start = swap_base, *end, *lim = (char *)swap_base + ovl_sz;
+
+	if (ovl_sz == 0) return(0);
+	while (start < lim && heap_used_next(&start, &end)) {
+		if (end > lim) end = lim;
+		if (lpwrite(mfd, start, end - start, start - (char *)swap_base) !=
+		    end - start)
+			return(-1);
+		start = end;
+	}
+	if (fsync(mfd) == -1) return(-1);
+	if (ovl_drop()) return(-1);
+	/* free extents in the map file may now be punched */
+	chunk_swap_reset(swap_end, true);
+	return(0);
+}
+
+/*
+ * Stop the other threads at a safepoint outside of the allocator, so no bin,
+ * run or thread cache is half updated. The jemalloc mutexes are then
+ * uncontended, and are still taken for the code that asserts them (e.g.
+ * chunk_swap_reset() runs under swap_mtx).
+ */
+static void heap_quiesce(void)
+{
+	safepoint_begin();
+#ifdef JEMALLOC_TCACHE
+	tcache_flush_all(); /* cached objects are free in the heap */
+#endif
+	jemalloc_prefork();
+}
+
+static void heap_resume(void)
+{
+	jemalloc_postfork();
+	safepoint_end();
+}
+
+/*
+ * Return the objects cached by all threads to the heap, as heap_quiesce()
+ * does, for a sync that does not stop the other threads for its duration.
+ */
+static void heap_flush_caches(void)
+{
+#ifdef JEMALLOC_TCACHE
+	safepoint_begin();
+	tcache_flush_all();
+	safepoint_end();
+#endif
+}
+
+/* Commit the overlay before the backup file changes */
+static int ovl_settle(const char *who)
+{
+	int res;
+
+	if (ovl_sz == 0) return(0);
+	heap_quiesce();
+	res = ovl_commit();
+	heap_resume();
+	if (res == -1)
+		fprintf(stderr, "%s: error writing mapped heap to map file: %s\n",
+			who, strerror(errno));
+	return(res);
+}
+
+/*
+ * With PERM_COMPRESS=lz, a base image is written as frames of io_stripe
+ * (chunk) bytes, each compressed on its own by the I/O threads and stored
+ * wherever the next free file offset is when it is done. The file starts
+ * with a header page, holding a copy of the heap header, and an index of
+ * the frames, written after the frames. Free frames have no data, and a
+ * frame that does not compress is stored as is.
+ */
+static ssize_t cmp_write(io_lane_t *lane, off_t off, size_t len)
+{
+	char *src = (char *)swap_base + off;
+	size_t clen;
+	off_t foff;
+
+	sum_put(off, src, len);
+	clen = lz_compress(src, len, lane->buf, len - 1);
+	if (clen != 0) src = lane->buf;
+	else clen = len;
+	pthread_mutex_lock(&io_mtx);
+	foff = cmp_off;
+	cmp_off += clen;
+	pthread_mutex_unlock(&io_mtx);
+	if (lpwrite(io_fd, src, clen, foff) != clen) return(-1);
+	cmp_idx[off / io_stripe].off = foff;
+	cmp_idx[off / io_stripe].len = clen;
+	return(len);
+}
+
+static ssize_t cmp_read(io_lane_t *lane, off_t off, size_t len)
+{
+	io_range_t *frame = &cmp_idx[off / io_stripe];
+	char *dst = (char *)swap_base + off;
+
+	if (frame->len == len)
+		return(lpread(io_fd, dst, len, frame->off));
+	if (frame->len > len ||
+	    lpread(io_fd, lane->buf, frame->len, frame->off) != frame->len ||
+	    lz_decompress(lane->buf, frame->len, dst, len)) {
+		fprintf(stderr, "restore: compressed frame at %zu corrupt\n",
+			(size_t)off);
+		errno = EIO;
+		return(-1);
+	}
+	return(len);
+}
+
+/* Write a compressed base image to fd; *end is set past its last frame */
+static int heap_write_packed(int fd, off_t *end)
+{
+	size_t nframes = (swap_end-swap_base) / io_stripe;
+	char *start = swap_base, *stop;
+	cmp_hdr_t hdr;
+	int res = -1;
+
+	cmp_idx = scratch_alloc(CMP_IDX_SZ(nframes), false);
+	if (cmp_idx == NULL) return(-1);
+	cmp_off = PAGE_SIZE + CMP_IDX_SZ(nframes);
+	while (heap_used_next(&start, &stop)) {
+		if (io_queue(fd, cmp_write, start - (char *)swap_base, stop - start))
+			goto wp_return;
+		start = stop;
+	}
+	if (io_flush()) goto wp_return;
+
+	/* the index and header last, so that they describe written frames */
+	if (lpwrite(fd, cmp_idx, nframes * sizeof(io_range_t), PAGE_SIZE) !=
+	    nframes * sizeof(io_range_t))
+		goto wp_return;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version_key = PERM_CKEY;
+	hdr.version = CMP_VERSION;
+	hdr.frame_sz = io_stripe;
+	hdr.nframes = nframes;
+	hdr.data_end = cmp_off;
+	hdr.plib = *plib;
+	if (lpwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) goto wp_return;
+	*end = cmp_off;
+	res = 0;
+wp_return:
+	scratch_free(cmp_idx, CMP_IDX_SZ(nframes)); cmp_idx = NULL;
+	return(res);
+}
+
+/* Read a compressed base image of nframes frames from fd */
+static int heap_read_packed(int fd, size_t nframes)
+{
+	size_t i;
+	int res = -1;
+
+	cmp_idx = scratch_alloc(CMP_IDX_SZ(nframes), false);
+	if (cmp_idx == NULL) return(-1);
+	if (lpread(fd, cmp_idx, nframes * sizeof(io_range_t), PAGE_SIZE) !=
+	    nframes * sizeof(io_range_t))
+		goto rp_return;
+	for (i = 0; i < nframes; i++) {
+		if (cmp_idx[i].len &&
+		    io_queue(fd, cmp_read, i * io_stripe, io_stripe))
+			goto rp_return;
+	}
+	res = io_flush();
+rp_return:
+	/* restore_verify() reads the frames again */
+	if (res == -1 || !sum_lazy) {
+		scratch_free(cmp_idx, CMP_IDX_SZ(nframes)); cmp_idx = NULL;
+	}
+	return(res);
+}
+
+/* Set up the snapshot mode (PERM_SNAPSHOT) for a newly opened backup file */
+static int snap_init(void)
+{
+	char *s = getenv("PERM_SNAPSHOT");
+
+	snap_fork = false;
+	snap_res = 0;
+	if (s == NULL || strcmp(s, "none") == 0) return(0);
+	if (strcmp(s, "fork") != 0) {
+		fprintf(stderr, "bopen: unknown PERM_SNAPSHOT mode: %s\n", s);
+		return(-1);
+	}
+	/* a shared mapping would change under the child */
+	if (!map_private) {
+		fprintf(stderr,
+			"bopen: PERM_SNAPSHOT=fork needs a private heap mapping (mopen mode \"p\")\n");
+		return(-1);
+	}
+	snap = scratch_alloc(PAGE_CEILING(sizeof(snap_t)), true);
+	if (snap == NULL) {
+		fprintf(stderr, "bopen: error allocating snapshot status\n");
+		return(-1);
+	}
+	snap_fork = true;
+	return(0);
+}
+
+/* Collect the snapshot child, waiting for it if block is true */
+static int snap_reap(bool block)
+{
+	pid_t pid;
+	int status;
+
+	if (snap_pid == -1) return(snap_res);
+	do {
+		pid = waitpid(snap_pid, &status, block ? 0 : WNOHANG);
+	} while (pid == -1 && errno == EINTR);
+	if (pid == 0) return(1);
+
+	/* the result comes from the shared page in case SIGCHLD is ignored */
+	snap_pid = -1;
+	if (snap->done && snap->res == 0) {
+		if (incr_max) {
+			incr_seq = snap->incr_seq;
+			incr_off = snap->incr_off;
+			incr_heap_sz = snap->incr_heap_sz;
+			incr_base = true;
+		}
+		if (ring_n) {
+			ring_cur = snap->ring_cur;
+			ring_gen = snap->ring_gen;
+			bfd = ring_fd[ring_cur];
+		}
+		snap_res = 0;
+	} else {
+		incr_base = false;
+		snap_res = -1;
+	}
+	return(snap_res);
+}
+
+static void snap_fini(void)
+{
+	snap_reap(true);
+	scratch_free(snap, PAGE_CEILING(sizeof(snap_t))); snap = NULL;
+	snap_fork = false;
+}
+
+static void oflags(const char *mode, int *flags)
+{
+	int access = 0;
+	int creation = 0;
+
+	while (*mode) {
+		switch (*mode++) {
+		case 'r':
+			access = O_RDONLY;
+			creation = 0;
+			break;
+		case 'w':
+			access = O_WRONLY;
+			creation = O_CREAT | O_TRUNC;
+			break;
+		case '+':
+			access = O_RDWR;
+			break;
+		}
+	}
+	*flags = access | creation;
+}
+
+/* Use environment variables for mopen arguments */
+JEMALLOC_ATTR(visibility("default"))
+int perm_open(void)
+{
+	char *s;
+	char *fname;
+	char *mode;
+	size_t size;
+	int res;
+
+	if ((fname = getenv("PERM_FNAME")) == NULL)
+		return(0);
+	mode = (s = getenv("PERM_MODE")) != NULL ? s : "w+";
+	size = size_parse((s = getenv("PERM_SIZE")) != NULL ? s : "1G");
+
+	if ((res = mopen(fname, mode, size))) {
+		if (res == -2) return(0); /* already open OK */
+		return(res);
+	}
+
+	if (atexit((void (*)(void))mflush))
+		return(-1);
+
+	return(0);
+}
 
-	if (atexit((void (*)(void))mflush))
+/* Double the size of the perm block registry */
+static int perm_grow(void)
+{
+	int n = perm_max ? 2 * perm_max : PERM_BLKS_MIN;
+	struct iovec *v = scratch_alloc(n * sizeof(struct iovec), false);
+
+	if (v == NULL) {
+		fprintf(stderr, "perm: error allocating block registry\n");
 		return(-1);
+	}
+	memcpy(v, permv, nperm * sizeof(struct iovec));
+	scratch_free(permv, perm_max * sizeof(struct iovec));
+	permv = v;
+	perm_max = n;
+	return(0);
+}
+
+/*
+ * Add a block to the registry, merging it with the blocks it overlaps or
+ * touches. The globals are saved in the heap in address order.
+ */
+static int perm_insert(void *ptr, size_t size)
+{
+	char *start = ptr, *end = start + size;
+	int i, j;
 
+	if (size == 0) return(0);
+	for (i = 0; i < nperm &&
+	    (char *)permv[i].iov_base + permv[i].iov_len < start; i++)
+		;
+	for (j = i; j < nperm && (char *)permv[j].iov_base <= end; j++) {
+		char *bend = (char *)permv[j].iov_base + permv[j].iov_len;
+		if ((char *)permv[j].iov_base < start) start = permv[j].iov_base;
+		if (bend > end) end = bend;
+		perm_size -= permv[j].iov_len;
+	}
+	if (i == j && nperm == perm_max && perm_grow()) return(-1);
+	memmove(&permv[i+1], &permv[j], (nperm - j) * sizeof(struct iovec));
+	nperm += 1 - (j - i);
+	permv[i].iov_base = start;
+	permv[i].iov_len = end - start;
+	perm_size += end - start;
 	return(0);
 }
 
@@ -189,17 +2453,11 @@ int perm(void *ptr, size_t size)
 	int res = -1;
 
 	malloc_mutex_lock(&perm_mtx);
-	if (mfd != -1) {
+	if (mfd != -1 || map_anon) {
 		fprintf(stderr, "perm: must be called before opening a file\n");
 		goto pm_return;
 	}
-	if (nperm == MAX_IO_BLKS-1) goto pm_return;
-	perm_size += size;
-	permv[nperm].iov_base = ptr;
-	permv[nperm].iov_len = size;
-	nperm++;
-
-	res = 0;
+	res = perm_insert(ptr, size);
 pm_return:
 	malloc_mutex_unlock(&perm_mtx);
 	return(res);
@@ -212,11 +2470,17 @@ int mopen(const char *fname, const char *mode, size_t size)
 	ssize_t res = -1;
 	bool have_init_lock = false;
 	int flags;
+	bool grow, create;
+	size_t maxsize = 0;
+	void *back_base = NULL;
+	int flevel;
+	unsigned finterval;
+	size_t fdirty;
 	bool malloc_init_hard(void);
 
 	malloc_mutex_lock(&perm_mtx);
 
-	if (mfd != -1) {
+	if (mfd != -1 || map_anon) {
 		//fprintf(stderr, "mopen: map file already open\n");
 		malloc_mutex_unlock(&perm_mtx);
 		return(-2);
@@ -251,14 +2515,45 @@ int mopen(const char *fname, const char *mode, size_t size)
 		goto mo_return;
 	}
 
-	oflags(mode, &flags);
-	mfd = open(fname, flags, (mode_t)0666);
-	if (mfd == -1) {
-		perror("mopen: error opening map file");
+	if (flush_env(&flevel, &finterval, &fdirty))
 		goto mo_return;
+	oflags(mode, &flags);
+	map_anon = strchr(mode, 'a') != NULL;
+	map_private = map_anon || strchr(mode, 'p') != NULL;
+	grow = strchr(mode, 'g') != NULL;
+	/*
+	 * An anonymous heap is always new, and only persists through backup().
+	 * To restore one, it is put at the address recorded in the backup file.
+	 */
+	create = (flags & O_CREAT) || map_anon;
+	if (map_anon) {
+		maxsize = size ? size : GROW_MAX;
+		if (!(flags & O_CREAT) && back_header(fname, &back_base, &maxsize))
+			goto mo_return;
+	} else {
+		mfd = open(fname, flags, (mode_t)0666);
+		if (mfd == -1) {
+			perror("mopen: error opening map file");
+			goto mo_return;
+		}
 	}
+	if (huge_init(strchr(mode, 'h') != NULL))
+		goto mo_return;
+	if (flush_check(flevel, "mopen"))
+		goto mo_return;
 
-	if (flags & O_CREAT) {
+	/* a growable map file starts empty and size is the limit of the heap */
+	if (map_anon) {
+		/* nothing to size */
+	} else if (flags & O_CREAT && grow) {
+		maxsize = size ? size : GROW_MAX;
+	} else if (flags & O_CREAT && map_huge) {
+		/* hugetlbfs files can't be written, only sized in whole pages */
+		if (ftruncate(mfd, (size + map_huge - 1) & ~(map_huge - 1)) == -1) {
+			perror("mopen: error extending map file");
+			goto mo_return;
+		}
+	} else if (flags & O_CREAT) {
 		/* fill map file with zeros up to "size" */
 		res = lseek(mfd, size-1, SEEK_SET);
 		if (res == -1) {
@@ -284,13 +2579,16 @@ int mopen(const char *fname, const char *mode, size_t size)
 		goto mo_return;
 	if (ctl_boot())
 		goto mo_return;
+	if (huge_check())
+		goto mo_return;
 
-	if (flags & O_CREAT) {
+	if (create) {
 		/* setup swap_base and version_key */
 		char *s;
 		void *addr;
 		/* use PERM_ADDRESS for the start of the persistent heap */
 		addr = (void *)strtoul((s = getenv("PERM_ADDRESS")) != NULL ? s : "0", NULL, 0);
+		if (!(flags & O_CREAT)) addr = back_base;
 		/* Test for chunk alignment */
 		if (CHUNK_ADDR2OFFSET(addr)) {
 			fprintf(stderr, "mopen: env PERM_ADDRESS must be chuck aligned: 0x%lX\n", chunksize);
@@ -315,6 +2613,8 @@ int mopen(const char *fname, const char *mode, size_t size)
 				plib->version_key, PERM_KEY);
 			goto mo_return;
 		}
+		/* the limit of a growable heap, past the end of its file */
+		maxsize = (char *)swap_max - (char *)swap_base;
 	}
 
 	/*
@@ -323,15 +2623,17 @@ int mopen(const char *fname, const char *mode, size_t size)
 	 * enabled, base_alloc will use chunks from swap for the internal heap.
 	 */
 	malloc_mutex_lock(&ctl_mtx);
-	if (chunk_swap_enable(&mfd, 1, true)) {
+	if (chunk_swap_enable(&mfd, map_anon ? 0 : 1, true, map_private,
+	    maxsize)) {
 		fprintf(stderr, "mopen: error in mapping persistent heap\n");
 		goto mo_return;
 	}
+	heap_advise(swap_base, (char *)swap_max - (char *)swap_base);
 	swap_fds = &mfd;
-	swap_nfds = 1;
+	swap_nfds = map_anon ? 0 : 1;
 	malloc_mutex_unlock(&ctl_mtx);
 
-	if (flags & O_CREAT) {
+	if (create) {
 		/* assume plib is first block of mmap heap */
 		plib_t *ptr = base_alloc(sizeof(plib_t));
 		if (ptr == NULL || ptr != swap_base)
@@ -339,9 +2641,7 @@ int mopen(const char *fname, const char *mode, size_t size)
 		/* copy over static plib to mmap heap and then use the copy */
 		*ptr = *plib;
 		plib = ptr;
-		/* redo some chunk_swap init because of copy */
-		extent_tree_szad_new(&swap_chunks_szad);
-		extent_tree_ad_new(&swap_chunks_ad);
+		swap_map = NULL; /* allocated below */
 		/* allocate space for globals */
 		plib->globals = base_alloc(perm_size);
 		if (plib->globals == NULL)
@@ -354,24 +2654,38 @@ int mopen(const char *fname, const char *mode, size_t size)
 		readvb(plib->globals, plib->gsize, permv, nperm);
 		plib_initialized = true;
 	}
+	/* the chunk map of a new heap */
+	if (create && chunk_swap_map_boot()) {
+		fprintf(stderr, "mopen: error allocating chunk map\n");
+		goto mo_return;
+	}
 
 	/* finish initialization */
 	malloc_mutex_unlock(&init_lock);
 	have_init_lock = false;
 	if (malloc_init_hard())
 		goto mo_return;
-	if (flags & O_CREAT) {
+	if (create) {
 		plib_initialized = true;
 		/* save new heap, mflush() */
-		jemalloc_prefork(); /* acquire all jemalloc mutexes */
+		heap_quiesce();
 		writevb(plib->globals, plib->gsize, permv, nperm); /* save globals */
-		res = msync(swap_base, swap_end-swap_base, MS_SYNC);
-		jemalloc_postfork(); /* release all jemalloc mutexes */
+		res = msync_heap();
+		heap_resume();
 		if (res == -1) {
 			perror("mopen: error syncing map file");
 			goto mo_return;
 		}
-	}
+	} else
+		numa_place(); /* back to the nodes of the last run */
+	/* the map file now holds the heap */
+	flush_mark = flush_now();
+	res = flush_config(flevel, finterval, fdirty, "mopen");
+	if (res == -1)
+		goto mo_return;
+	/* an anonymous heap is rolled back by restore() */
+	if (!create && !map_anon && (res = ptx_recover("mopen")) == -1)
+		goto mo_return;
 
 	res = 0;
 mo_return:
@@ -380,6 +2694,7 @@ mo_return:
 	if (res != 0 && mfd >= 0) {
 		close(mfd); mfd = -1;
 	}
+	if (res != 0) map_anon = false;
 	malloc_mutex_unlock(&perm_mtx);
 	return((int)res);
 }
@@ -388,8 +2703,17 @@ mo_return:
 JEMALLOC_ATTR(visibility("default"))
 int mclose(void)
 {
+	bool busy;
+
+	malloc_mutex_lock(&perm_mtx);
+	busy = ptx_depth != 0;
+	malloc_mutex_unlock(&perm_mtx);
+	if (busy) {
+		fprintf(stderr, "mclose: transaction in progress\n");
+		return(-1);
+	}
 	/* flush if open for writing */
-	if ((O_WRONLY|O_RDWR) & fcntl(mfd, F_GETFL))
+	if (!map_anon && (O_WRONLY|O_RDWR) & fcntl(mfd, F_GETFL))
 		mflush();
 
 	malloc_mutex_lock(&perm_mtx);
@@ -401,39 +2725,742 @@ int mclose(void)
 	 * munmap.
 	 */
 	/* munmap(swap_base, swap_max-swap_base); */
-	close(mfd); mfd = -1;
+	flush_stop();
+	pthread_mutex_lock(&flush_mtx);
+	flush_mark = 0;
+	pthread_mutex_unlock(&flush_mtx);
+	if (mfd != -1) close(mfd);
+	mfd = -1;
+	map_anon = false;
+	malloc_mutex_unlock(&perm_mtx);
+	return(0);
+}
+
+/* Flushes in-core data to files */
+JEMALLOC_ATTR(visibility("default"))
+int mflush(void)
+{
+	ssize_t res = -1;
+	uint64_t start = flush_now();
+
+	malloc_mutex_lock(&perm_mtx);
+	if (mfd == -1 && !map_anon) {
+		fprintf(stderr, "mflush: mmap file not open\n");
+		goto mf_return;
+	}
+	heap_quiesce();
+
+	/* save globals */
+	writevb(plib->globals, plib->gsize, permv, nperm);
+
+	res = ovl_commit();
+	if (res == -1) {
+		perror("mflush: error writing mapped heap to map file");
+		goto mf_return;
+	}
+	res = msync_heap();
+	if (res == -1) {
+		perror("mflush: error syncing map file");
+		/* close(mfd); mfd = -1; */
+		goto mf_return;
+	}
+	pthread_mutex_lock(&flush_mtx);
+	if (start > flush_mark) flush_mark = start;
+	pthread_mutex_unlock(&flush_mtx);
+
+	res = 0;
+mf_return:
+	if (mfd != -1 || map_anon) heap_resume();
+	malloc_mutex_unlock(&perm_mtx);
+	return((int)res);
+}
+
+/*
+ * A range flush writes back a few extents of the heap: the range, the
+ * persistent globals, the heap header, and the allocator metadata that
+ * records the allocations in the range. Extents are collected, page
+ * aligned, and merged, so each page is synced once.
+ */
+#define RANGE_MAX 16
+
+typedef struct {
+	int n;
+	struct iovec v[RANGE_MAX];
+} range_set_t;
+
+/* Sync the extents of a set to the mmap file with one cache flush */
+static int range_sync(range_set_t *rs)
+{
+	int i, j, n = 0;
+
+	if (rs->n == 0) return(0);
+	/* sort by address and merge extents that overlap or touch */
+	for (i = 1; i < rs->n; i++) {
+		struct iovec t = rs->v[i];
+
+		for (j = i; j > 0 && rs->v[j-1].iov_base > t.iov_base; j--)
+			rs->v[j] = rs->v[j-1];
+		rs->v[j] = t;
+	}
+	for (i = 1; i < rs->n; i++) {
+		struct iovec *p = &rs->v[n];
+		char *end = (char *)p->iov_base + p->iov_len;
+
+		if ((char *)rs->v[i].iov_base <= end) {
+			char *e = (char *)rs->v[i].iov_base + rs->v[i].iov_len;
+			if (e > end) p->iov_len = e - (char *)p->iov_base;
+		} else
+			rs->v[++n] = rs->v[i];
+	}
+	n++;
+	rs->n = 0;
+
+	if (map_private) {
+		for (i = 0; i < n; i++) {
+			if (write_private(((char *)rs->v[i].iov_base -
+			    (char *)swap_base) >> PAGE_SHIFT,
+			    rs->v[i].iov_len >> PAGE_SHIFT))
+				return(-1);
+		}
+		return(fdatasync(mfd));
+	}
+#ifdef SYNC_FILE_RANGE_WRITE
+	/*
+	 * Write and wait on all but the last extent, whose msync() then also
+	 * commits the file system and flushes the device cache for them.
+	 */
+	for (i = 0; i < n - 1; i++) {
+		if (sync_file_range(mfd, (char *)rs->v[i].iov_base -
+		    (char *)swap_base, rs->v[i].iov_len,
+		    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		    SYNC_FILE_RANGE_WAIT_AFTER))
+			return(-1);
+	}
+#else
+	for (i = 0; i < n - 1; i++)
+		if (msync(rs->v[i].iov_base, rs->v[i].iov_len, MS_SYNC))
+			return(-1);
+#endif
+	return(msync(rs->v[n-1].iov_base, rs->v[n-1].iov_len, MS_SYNC));
+}
+
+/* Add the pages of [addr, addr+len) within the heap to a set */
+static int range_add(range_set_t *rs, const void *addr, size_t len)
+{
+	char *start = (char *)((uintptr_t)addr & ~PAGE_MASK);
+	char *end = (char *)PAGE_CEILING((uintptr_t)addr + len);
+
+	if (start < (char *)swap_base) start = swap_base;
+	if (end > (char *)swap_end) end = swap_end;
+	if (start >= end) return(0);
+	if (rs->n == RANGE_MAX && range_sync(rs)) return(-1);
+	rs->v[rs->n].iov_base = start;
+	rs->v[rs->n].iov_len = end - start;
+	rs->n++;
+	return(0);
+}
+
+/* Add the metadata of the run holding page pageind of an arena chunk */
+static int range_add_run(range_set_t *rs, arena_chunk_t *chunk, size_t pageind)
+{
+	size_t mapbits = chunk->map[pageind-map_bias].bits;
+	arena_run_t *run;
+
+	/* large runs and free pages are described by the chunk header */
+	if ((mapbits & (CHUNK_MAP_ALLOCATED | CHUNK_MAP_LARGE)) !=
+	    CHUNK_MAP_ALLOCATED)
+		return(0);
+	run = (arena_run_t *)((uintptr_t)chunk +
+	    (uintptr_t)((pageind - (mapbits >> PAGE_SHIFT)) << PAGE_SHIFT));
+	return(range_add(rs, run, arena_bin_info[arena_bin_index(chunk->arena,
+	    run->bin)].reg0_offset));
+}
+
+/*
+ * Add the metadata of the allocations in [ptr, ptr+len): the chunk header,
+ * the run headers outside of the range, and the arena of arena chunks, or
+ * the extent node of huge allocations.
+ */
+static int range_add_meta(range_set_t *rs, const char *ptr, size_t len)
+{
+	char *chunk = CHUNK_ADDR2BASE(ptr);
+	const char *end = ptr + len;
+	extent_node_t *prev_node = NULL;
+	arena_t *prev_arena = NULL;
+
+	for (; chunk < end; chunk += chunksize) {
+		extent_node_t key, *node;
+		arena_chunk_t *ac = (arena_chunk_t *)chunk;
+		const char *hdr_end = chunk + (map_bias << PAGE_SHIFT);
+		const char *first = ptr > hdr_end ? ptr : hdr_end;
+		const char *last = end < chunk + chunksize ? end - 1 :
+		    chunk + chunksize - 1;
+
+		/* the chunks of a huge allocation share one extent node */
+		malloc_mutex_lock(&huge_mtx);
+		key.addr = chunk;
+		node = extent_tree_ad_psearch(&huge, &key);
+		if (node != NULL && chunk >= (char *)node->addr + node->size)
+			node = NULL;
+		malloc_mutex_unlock(&huge_mtx);
+		if (node != NULL) {
+			if (node != prev_node &&
+			    range_add(rs, node, sizeof(extent_node_t)))
+				return(-1);
+			prev_node = node;
+			continue;
+		}
+
+		/* the header of a chunk that starts in the range is in it */
+		if (chunk < ptr && range_add(rs, chunk, map_bias << PAGE_SHIFT))
+			return(-1);
+		if (ac->arena != prev_arena && range_add(rs, ac->arena,
+		    offsetof(arena_t, bins) + sizeof(arena_bin_t) * nbins))
+			return(-1);
+		prev_arena = ac->arena;
+		if (first > last) continue;
+		if (range_add_run(rs, ac, (first - chunk) >> PAGE_SHIFT) ||
+		    range_add_run(rs, ac, (last - chunk) >> PAGE_SHIFT))
+			return(-1);
+	}
+	return(0);
+}
+
+/* Sync [ptr, ptr+len) and the heap state that refers to it */
+static int range_flush(const char *who, void *ptr, size_t len, bool obj)
+{
+	range_set_t rs;
+	int res = -1;
+
+	malloc_mutex_lock(&perm_mtx);
+	if (mfd == -1 && !map_anon) {
+		fprintf(stderr, "%s: mmap file not open\n", who);
+		goto rf_return;
+	}
+	if ((char *)ptr < (char *)swap_base || (char *)ptr >= (char *)swap_end ||
+	    len > (size_t)((char *)swap_end - (char *)ptr)) {
+		fprintf(stderr, "%s: range not in heap\n", who);
+		errno = EINVAL;
+		goto rf_return;
+	}
+	if (obj) len = isalloc(ptr);
+	if (ovl_settle(who)) goto rf_return;
+	heap_flush_caches();
+
+	/* save globals */
+	writevb(plib->globals, plib->gsize, permv, nperm);
+	if (map_anon) {
+		res = 0;
+		goto rf_return;
+	}
+
+	rs.n = 0;
+	if (range_add(&rs, ptr, len) ||
+	    range_add(&rs, plib->globals, plib->gsize) ||
+	    range_add(&rs, plib, sizeof(plib_t)) ||
+	    (len && range_add_meta(&rs, ptr, len)) ||
+	    range_sync(&rs)) {
+		fprintf(stderr, "%s: error syncing map file: %s\n", who,
+			strerror(errno));
+		goto rf_return;
+	}
+	res = 0;
+rf_return:
+	malloc_mutex_unlock(&perm_mtx);
+	return(res);
+}
+
+/* Flushes a range of the heap, and what records its allocations, to the file */
+JEMALLOC_ATTR(visibility("default"))
+int mflush_range(void *ptr, size_t len)
+{
+	return(range_flush("mflush_range", ptr, len, false));
+}
+
+/* Flushes an allocated object, and what records it, to the file */
+JEMALLOC_ATTR(visibility("default"))
+int pflush(void *ptr)
+{
+	return(range_flush("pflush", ptr, 0, true));
+}
+
+/*
+ * Transactions keep an undo log in the heap. Before a range is changed,
+ * ptx_add_range() appends its old contents to the log and syncs the entry,
+ * and ptx_commit() syncs the changed ranges before it marks the log idle, so
+ * a heap that is reopened with the log still active is rolled back to where
+ * the transaction began. Allocations made with ptx_malloc() are logged and
+ * freed on rollback; ptx_free() is deferred to the commit.
+ *
+ * The log is a chain of segments allocated with base_alloc(), whose first
+ * segment is found through plib->ptx_log. Entries carry the generation of
+ * their transaction and a checksum, so the valid entries of a segment end
+ * at the first torn or older one. Persistent globals are logged by their
+ * offset in the heap copy of the globals, which does not move with the
+ * program's data segment.
+ */
+#define PTX_LOG_SIZE ((size_t)1 << 18) /* bytes of entries in a segment */
+
+#define PTX_DATA 1 /* old contents of a heap range */
+#define PTX_GLOBAL 2 /* old contents of a range of the persistent globals */
+#define PTX_ALLOC 3 /* object allocated in the transaction */
+#define PTX_FREE 4 /* object freed when the transaction commits */
+
+typedef struct ptx_seg_s ptx_seg_t;
+struct ptx_seg_s {
+	size_t size; /* bytes of entries that fit after the header */
+	ptx_seg_t *next;
+	uint64_t gen; /* first segment: the last transaction begun */
+	int active; /* first segment: the transaction has not ended */
+};
+
+typedef struct {
+	uint64_t gen; /* transaction of the entry */
+	uintptr_t addr; /* heap address, or offset in the globals */
+	size_t len; /* bytes of old contents following the entry */
+	uint32_t kind;
+	uint32_t prev; /* bytes back to the previous entry of the segment */
+	uint32_t crc; /* CRC32C of the entry (with crc 0) and its contents */
+	uint32_t pad;
+} ptx_ent_t;
+
+#define PTX_SEG_DATA(s) ((char *)(s) + sizeof(ptx_seg_t))
+#define PTX_ENT_SZ(len) (sizeof(ptx_ent_t) + (((len) + 7) & ~(size_t)7))
+
+static ptx_seg_t *ptx_cur; /* segment, offset, and size of the last entry */
+static size_t ptx_off;
+static size_t ptx_last;
+
+/* Sync a set of extents of a file backed heap */
+static int ptx_sync(range_set_t *rs)
+{
+	if (map_anon) {
+		rs->n = 0;
+		return(0);
+	}
+	return(range_sync(rs));
+}
+
+static uint32_t ptx_crc(ptx_ent_t *ent)
+{
+	uint32_t crc, save = ent->crc;
+
+	ent->crc = 0;
+	crc = crc32c(0, ent, sizeof(ptx_ent_t));
+	ent->crc = save;
+	return(crc32c(crc, ent + 1, ent->len));
+}
+
+/* Address of the program's copy of globals offset off, or NULL */
+static char *ptx_global(uintptr_t off)
+{
+	int i;
+
+	for (i = 0; i < nperm; i++) {
+		if (off < permv[i].iov_len) return((char *)permv[i].iov_base + off);
+		off -= permv[i].iov_len;
+	}
+	return(NULL);
+}
+
+/* Append an entry, which is synced with the metadata it depends on */
+static int ptx_append(uint32_t kind, uintptr_t addr, const void *src,
+    size_t len, range_set_t *rs)
+{
+	ptx_seg_t *log = plib->ptx_log;
+	size_t need = PTX_ENT_SZ(len);
+	ptx_ent_t *ent;
+
+	if (ptx_off + need > ptx_cur->size) {
+		/* move on to the next segment, big enough for the entry */
+		if (ptx_cur->next == NULL || ptx_cur->next->size < need) {
+			size_t size = need > PTX_LOG_SIZE ? need : PTX_LOG_SIZE;
+			ptx_seg_t *seg = base_alloc(sizeof(ptx_seg_t) + size);
+
+			if (seg == NULL) {
+				errno = ENOMEM;
+				return(-1);
+			}
+			seg->size = size;
+			seg->next = ptx_cur->next;
+			seg->gen = 0;
+			seg->active = 0;
+			ptx_cur->next = seg;
+			if (range_add(rs, seg, sizeof(ptx_seg_t)) ||
+			    range_add(rs, ptx_cur, sizeof(ptx_seg_t)))
+				return(-1);
+		}
+		ptx_cur = ptx_cur->next;
+		ptx_off = 0;
+		ptx_last = 0;
+	}
+	/* entries are valid in order, so the earlier ones are synced first */
+	if (ptx_sync(rs)) return(-1);
+
+	ent = (ptx_ent_t *)(PTX_SEG_DATA(ptx_cur) + ptx_off);
+	ent->gen = log->gen;
+	ent->addr = addr;
+	ent->len = len;
+	ent->kind = kind;
+	ent->prev = ptx_off ? (uint32_t)ptx_last : 0;
+	ent->pad = 0;
+	if (len) memcpy(ent + 1, src, len);
+	ent->crc = ptx_crc(ent);
+	if (range_add(rs, ent, sizeof(ptx_ent_t) + len) || ptx_sync(rs))
+		return(-1);
+	ptx_last = need;
+	ptx_off += need;
+	return(0);
+}
+
+/* Offset past the valid entries of a segment, and of the last one */
+static size_t ptx_scan(ptx_seg_t *seg, uint64_t gen, size_t *last)
+{
+	size_t off = 0;
+
+	*last = 0;
+	while (off + sizeof(ptx_ent_t) <= seg->size) {
+		ptx_ent_t *ent = (ptx_ent_t *)(PTX_SEG_DATA(seg) + off);
+
+		if (ent->gen != gen ||
+		    ent->len > seg->size - off - sizeof(ptx_ent_t) ||
+		    ent->crc != ptx_crc(ent))
+			break;
+		*last = off;
+		off += PTX_ENT_SZ(ent->len);
+	}
+	return(off);
+}
+
+/*
+ * Undo the changes logged in a segment and the ones after it, newest first,
+ * adding the restored ranges to rs. With frees set, free the objects
+ * allocated in the transaction instead.
+ */
+static int ptx_undo(ptx_seg_t *seg, uint64_t gen, range_set_t *rs, bool frees)
+{
+	size_t off, end;
+
+	if (seg->next && ptx_undo(seg->next, gen, rs, frees)) return(-1);
+	end = ptx_scan(seg, gen, &off);
+	if (end == 0) return(0);
+	for (;;) {
+		ptx_ent_t *ent = (ptx_ent_t *)(PTX_SEG_DATA(seg) + off);
+		char *dst;
+
+		if (frees) {
+			if (ent->kind == PTX_ALLOC)
+				JEMALLOC_P(free)((void *)ent->addr);
+		} else if (ent->kind == PTX_DATA) {
+			memcpy((void *)ent->addr, ent + 1, ent->len);
+			if (range_add(rs, (void *)ent->addr, ent->len)) return(-1);
+		} else if (ent->kind == PTX_GLOBAL) {
+			dst = (char *)plib->globals + ent->addr;
+			memcpy(dst, ent + 1, ent->len);
+			if ((dst = ptx_global(ent->addr)) != NULL)
+				memcpy(dst, ent + 1, ent->len);
+			if (range_add(rs, (char *)plib->globals + ent->addr,
+			    ent->len))
+				return(-1);
+		}
+		if (off == 0) break;
+		off -= ent->prev;
+	}
+	return(0);
+}
+
+/* Mark the log idle, which ends the transaction in the file */
+static int ptx_idle(range_set_t *rs)
+{
+	ptx_seg_t *log = plib->ptx_log;
+
+	log->active = 0;
+	if (range_add(rs, log, sizeof(ptx_seg_t))) return(-1);
+	return(ptx_sync(rs));
+}
+
+/*
+ * Roll back the transaction of the log. The restored ranges are synced
+ * before the log is marked idle, and the objects allocated in the
+ * transaction are freed after it, so a rollback that is cut short is
+ * redone without freeing anything twice (it may leak them instead).
+ */
+static int ptx_rollback(const char *who)
+{
+	ptx_seg_t *log = plib->ptx_log;
+	range_set_t rs;
+
+	rs.n = 0;
+	if (ptx_undo(log, log->gen, &rs, false) || ptx_idle(&rs)) {
+		fprintf(stderr, "%s: error rolling back transaction: %s\n", who,
+			strerror(errno));
+		return(-1);
+	}
+	ptx_undo(log, log->gen, &rs, true);
+	return(0);
+}
+
+/* Roll back a transaction left active in the heap, with perm_mtx held */
+static int ptx_recover(const char *who)
+{
+	ptx_seg_t *log = plib->ptx_log;
+
+	if (log == NULL || !log->active) return(0);
+	if (!map_anon && !((O_WRONLY|O_RDWR) & fcntl(mfd, F_GETFL))) {
+		fprintf(stderr, "%s: heap is read-only, not rolling back "
+			"interrupted transaction\n", who);
+		return(0);
+	}
+	crc32c_boot();
+	if (ovl_settle(who)) return(-1);
+	fprintf(stderr, "%s: rolling back interrupted transaction %llu\n", who,
+		(unsigned long long)log->gen);
+	return(ptx_rollback(who));
+}
+
+/* Check that the caller runs a transaction, with perm_mtx held */
+static int ptx_check(const char *who)
+{
+	if (ptx_depth == 0 || !pthread_equal(ptx_owner, pthread_self())) {
+		fprintf(stderr, "%s: no transaction in progress\n", who);
+		errno = EINVAL;
+		return(-1);
+	}
+	if (mfd == -1 && !map_anon) {
+		fprintf(stderr, "%s: mmap file not open\n", who);
+		errno = EBADF;
+		return(-1);
+	}
+	return(0);
+}
+
+/* End the transaction of the caller */
+static void ptx_end(void)
+{
+	ptx_depth = 0;
+	pthread_mutex_unlock(&ptx_mtx);
+}
+
+/* Begin a transaction, or nest one in the caller's transaction */
+JEMALLOC_ATTR(visibility("default"))
+int ptx_begin(void)
+{
+	ptx_seg_t *log;
+	range_set_t rs;
+
+	if (ptx_depth && pthread_equal(ptx_owner, pthread_self())) {
+		ptx_depth++;
+		return(0);
+	}
+	pthread_mutex_lock(&ptx_mtx); /* one transaction at a time */
+	malloc_mutex_lock(&perm_mtx);
+	if (mfd == -1 && !map_anon) {
+		fprintf(stderr, "ptx_begin: mmap file not open\n");
+		errno = EBADF;
+		goto pb_error;
+	}
+	crc32c_boot();
+	if (ovl_settle("ptx_begin")) goto pb_error;
+	rs.n = 0;
+	if ((log = plib->ptx_log) == NULL) {
+		log = base_alloc(sizeof(ptx_seg_t) + PTX_LOG_SIZE);
+		if (log == NULL) {
+			fprintf(stderr, "ptx_begin: error allocating undo log\n");
+			errno = ENOMEM;
+			goto pb_error;
+		}
+		log->size = PTX_LOG_SIZE;
+		log->next = NULL;
+		log->gen = 0;
+		plib->ptx_log = log;
+		if (range_add(&rs, plib, sizeof(plib_t))) goto pb_sync;
+	}
+	log->gen++;
+	log->active = 1;
+	if (range_add(&rs, log, sizeof(ptx_seg_t)) || ptx_sync(&rs)) goto pb_sync;
+	ptx_cur = log;
+	ptx_off = 0;
+	ptx_last = 0;
+	ptx_owner = pthread_self();
+	ptx_depth = 1;
+	malloc_mutex_unlock(&perm_mtx);
+	return(0);
+pb_sync:
+	perror("ptx_begin: error syncing undo log");
+pb_error:
+	malloc_mutex_unlock(&perm_mtx);
+	pthread_mutex_unlock(&ptx_mtx);
+	return(-1);
+}
+
+/* Log the contents of a heap or global range before it is changed */
+JEMALLOC_ATTR(visibility("default"))
+int ptx_add_range(void *ptr, size_t len)
+{
+	char *start = ptr, *end = start + len;
+	range_set_t rs;
+	uintptr_t off = 0;
+	int i, res = -1;
+
+	malloc_mutex_lock(&perm_mtx);
+	if (ptx_check("ptx_add_range")) goto pa_return;
+	rs.n = 0;
+	if (start >= (char *)swap_base && start < (char *)swap_end &&
+	    len <= (size_t)((char *)swap_end - start)) {
+		res = ptx_append(PTX_DATA, (uintptr_t)start, start, len, &rs);
+		goto pa_check;
+	}
+	/* log each registered block in the range by its offset */
+	for (i = 0; i < nperm && start < end; i++) {
+		char *base = permv[i].iov_base;
+		char *bend = base + permv[i].iov_len;
+
+		if (start >= base && start < bend) {
+			size_t n = (end < bend ? end : bend) - start;
+
+			if (ptx_append(PTX_GLOBAL, off + (start - base), start, n,
+			    &rs))
+				goto pa_check;
+			start += n;
+		}
+		off += permv[i].iov_len;
+	}
+	if (start < end) {
+		fprintf(stderr, "ptx_add_range: range not in heap or globals\n");
+		errno = EINVAL;
+		goto pa_return;
+	}
+	res = 0;
+pa_check:
+	if (res) perror("ptx_add_range: error syncing undo log");
+pa_return:
+	malloc_mutex_unlock(&perm_mtx);
+	return(res);
+}
+
+/* Allocate an object that is freed if the transaction rolls back */
+JEMALLOC_ATTR(visibility("default"))
+void *ptx_malloc(size_t size)
+{
+	void *ptr = JEMALLOC_P(malloc)(size);
+	range_set_t rs;
+
+	if (ptr == NULL) return(NULL);
+	malloc_mutex_lock(&perm_mtx);
+	if (ptx_depth == 0 || !pthread_equal(ptx_owner, pthread_self()))
+		goto pm_return; /* outside of a transaction, like malloc() */
+	if (mfd == -1 && !map_anon) goto pm_return;
+	/* the allocation is in the file before the entry that frees it */
+	rs.n = 0;
+	if (range_add(&rs, plib, sizeof(plib_t)) ||
+	    range_add_meta(&rs, ptr, isalloc(ptr)) ||
+	    ptx_append(PTX_ALLOC, (uintptr_t)ptr, NULL, 0, &rs)) {
+		perror("ptx_malloc: error syncing undo log");
+		malloc_mutex_unlock(&perm_mtx);
+		JEMALLOC_P(free)(ptr);
+		return(NULL);
+	}
+pm_return:
+	malloc_mutex_unlock(&perm_mtx);
+	return(ptr);
+}
+
+/* Free an object when the transaction commits */
+JEMALLOC_ATTR(visibility("default"))
+void ptx_free(void *ptr)
+{
+	range_set_t rs;
+
+	if (ptr == NULL) return;
+	malloc_mutex_lock(&perm_mtx);
+	if (ptx_depth == 0 || !pthread_equal(ptx_owner, pthread_self()) ||
+	    (mfd == -1 && !map_anon)) {
+		malloc_mutex_unlock(&perm_mtx);
+		JEMALLOC_P(free)(ptr);
+		return;
+	}
+	rs.n = 0;
+	if (ptx_append(PTX_FREE, (uintptr_t)ptr, NULL, 0, &rs))
+		perror("ptx_free: error syncing undo log");
 	malloc_mutex_unlock(&perm_mtx);
-	return(0);
 }
 
-/* Flushes in-core data to files */
+/*
+ * Commit the transaction: sync the logged ranges and the objects allocated
+ * in it, then mark the log idle and free the objects of ptx_free().
+ */
 JEMALLOC_ATTR(visibility("default"))
-int mflush(void)
+int ptx_commit(void)
 {
-	ssize_t res = -1;
+	ptx_seg_t *seg, *log;
+	range_set_t rs;
+	int res = -1;
 
 	malloc_mutex_lock(&perm_mtx);
-	if (mfd == -1) {
-		fprintf(stderr, "mflush: mmap file not open\n");
-		goto mf_return;
+	if (ptx_check("ptx_commit")) {
+		malloc_mutex_unlock(&perm_mtx);
+		return(-1);
 	}
-	jemalloc_prefork(); /* acquire all jemalloc mutexes */
-
-	/* save globals */
+	if (--ptx_depth) {
+		malloc_mutex_unlock(&perm_mtx);
+		return(0);
+	}
+	log = plib->ptx_log;
 	writevb(plib->globals, plib->gsize, permv, nperm);
+	rs.n = 0;
+	if (range_add(&rs, plib->globals, plib->gsize)) goto pc_sync;
+	for (seg = log; seg; seg = seg->next) {
+		size_t off, last, end = ptx_scan(seg, log->gen, &last);
 
-	res = msync(swap_base, swap_end-swap_base, MS_SYNC);
-	if (res == -1) {
-		perror("mflush: error syncing map file");
-		/* close(mfd); mfd = -1; */
-		goto mf_return;
-	}
+		for (off = 0; off < end; off += PTX_ENT_SZ(((ptx_ent_t *)
+		    (PTX_SEG_DATA(seg) + off))->len)) {
+			ptx_ent_t *ent = (ptx_ent_t *)(PTX_SEG_DATA(seg) + off);
+			void *p = (void *)ent->addr;
 
+			if ((ent->kind == PTX_DATA && range_add(&rs, p, ent->len)) ||
+			    (ent->kind == PTX_ALLOC && range_add(&rs, p, isalloc(p))))
+				goto pc_sync;
+		}
+	}
+	if (ptx_sync(&rs) || ptx_idle(&rs)) goto pc_sync;
 	res = 0;
-mf_return:
-	if (mfd != -1) jemalloc_postfork(); /* release all jemalloc mutexes */
+	for (seg = log; seg; seg = seg->next) {
+		size_t off, last, end = ptx_scan(seg, log->gen, &last);
+
+		for (off = 0; off < end; off += PTX_ENT_SZ(((ptx_ent_t *)
+		    (PTX_SEG_DATA(seg) + off))->len)) {
+			ptx_ent_t *ent = (ptx_ent_t *)(PTX_SEG_DATA(seg) + off);
+
+			if (ent->kind == PTX_FREE)
+				JEMALLOC_P(free)((void *)ent->addr);
+		}
+	}
+	heap_flush_caches(); /* the objects freed above may be cached */
+	goto pc_return;
+pc_sync:
+	/* the transaction rolls back when the heap is reopened */
+	perror("ptx_commit: error syncing map file");
+pc_return:
+	ptx_end();
 	malloc_mutex_unlock(&perm_mtx);
-	return((int)res);
+	return(res);
+}
+
+/* Roll back the transaction, including the ones it is nested in */
+JEMALLOC_ATTR(visibility("default"))
+int ptx_abort(void)
+{
+	int res;
+
+	malloc_mutex_lock(&perm_mtx);
+	if (ptx_check("ptx_abort")) {
+		malloc_mutex_unlock(&perm_mtx);
+		return(-1);
+	}
+	res = ptx_rollback("ptx_abort");
+	ptx_end();
+	malloc_mutex_unlock(&perm_mtx);
+	return(res);
 }
 
 /* Open backup file */
@@ -444,7 +3471,7 @@ int bopen(const char *fname, const char *mode)
 	int flags;
 
 	malloc_mutex_lock(&perm_mtx);
-	if (mfd == -1) {
+	if (mfd == -1 && !map_anon) {
 		fprintf(stderr, "bopen: must open map file first\n");
 		/* This is because of the dependency on swap_base/swap_end */
 		goto bo_return;
@@ -456,9 +3483,12 @@ int bopen(const char *fname, const char *mode)
 	}
 
 	oflags(mode, &flags);
-	bfd = open(fname, flags, (mode_t)0666);
-	if (bfd == -1) {
-		perror("bopen: error opening backup file");
+	if (ring_init(fname, flags))
+		goto bo_return;
+	if (snap_init() || incr_init() || io_init()) {
+		snap_fini();
+		incr_fini();
+		ring_fini();
 		goto bo_return;
 	}
 
@@ -473,11 +3503,165 @@ JEMALLOC_ATTR(visibility("default"))
 int bclose(void)
 {
 	malloc_mutex_lock(&perm_mtx);
-	close(bfd); bfd = -1;
+	aio_fini();
+	ovl_settle("bclose");
+	snap_fini();
+	incr_fini();
+	io_fini();
+	ring_fini();
 	malloc_mutex_unlock(&perm_mtx);
 	return(0);
 }
 
+/*
+ * Write the heap, with the globals already saved in it, to the backup file.
+ * This is either an increment to the base image already in the file or a
+ * new base image.
+ */
+static int backup_heap(void)
+{
+	ssize_t res;
+	off_t end;
+
+	if (incr_max && incr_base && incr_seq < incr_max) {
+		size_t data_sz;
+		ssize_t nextents = incr_scan(swap_end-swap_base, &data_sz);
+		if (nextents == -1) {
+			perror("backup: error finding changed pages");
+			incr_base = false;
+			return(-1);
+		}
+		/* a base image is cheaper once half of the heap has changed */
+		if (data_sz < (swap_end-swap_base)/2) {
+			res = incr_write(bfd, swap_end-swap_base, nextents, data_sz);
+			if (res == -1) {
+				perror("backup: error writing heap increment");
+				incr_base = false;
+			}
+			return((int)res);
+		}
+	} else if (incr_max) {
+		res = incr_reset(swap_end-swap_base, 0, swap_end-swap_base);
+		if (res == -1) {
+			perror("backup: error clearing changed pages");
+			return(-1);
+		}
+	}
+	/* a partly written base image has no valid increments */
+	incr_base = false;
+	/* a ring writes the base image over its oldest generation */
+	if (ring_n && ring_open()) {
+		perror("backup: error clearing generation record");
+		return(-1);
+	}
+
+	/* write out the in-use heap */
+	io_stats_reset();
+	sum_reset();
+	end = swap_end-swap_base;
+	res = cmp_on ? heap_write_packed(bfd, &end) : heap_write_sparse(bfd);
+	if (res == -1) {
+		perror("backup: error writing heap data");
+		return(-1);
+	}
+	if (!aio_queueing) io_stats_print("backup");
+
+	/* the block checksums, written by aio_submit() after the last stripe */
+	res = aio_queueing ? 0 : sum_write(bfd, swap_end-swap_base, end);
+	if (res == -1) {
+		perror("backup: error writing heap checksums");
+		return(-1);
+	}
+	end += SUM_REC_SZ((swap_end-swap_base) / io_stripe);
+
+	/* truncate a file longer than the image, except a ring generation */
+	res = ring_n ? 0 : ftruncate(bfd, end);
+	if (res == -1) {
+		perror("backup: error truncating backup file");
+		return(-1);
+	}
+
+	/* one sync for all of the stripes, queued after them by backup_async() */
+	res = aio_queueing ? 0 : fsync(bfd);
+	if (res == -1) {
+		perror("backup: error syncing backup file");
+		return(-1);
+	}
+	/* commit the generation once its image is durable */
+	res = aio_queueing || !ring_n ? 0 : ring_commit();
+	if (res == -1) {
+		perror("backup: error committing generation");
+		return(-1);
+	}
+	if (incr_max) {
+		/* start a new chain of increments */
+		incr_seq = 0;
+		incr_off = end;
+		incr_heap_sz = swap_end-swap_base;
+		incr_base = true;
+	}
+	return(0);
+}
+
+/*
+ * Fork a child that writes the backup file while the parent runs on. With
+ * aio, the child writes the heap image through an io_uring.
+ */
+static int snap_start(bool aio)
+{
+	pid_t pid;
+
+	/* save globals */
+	writevb(plib->globals, plib->gsize, permv, nperm);
+
+	/*
+	 * The other threads are stopped at a safepoint, and the pthread_atfork()
+	 * handlers hold every jemalloc mutex while the page tables are copied,
+	 * so the child gets a consistent heap and the pause does not depend on
+	 * the heap size.
+	 */
+	snap->done = false;
+	safepoint_begin();
+#ifdef JEMALLOC_TCACHE
+	tcache_flush_all();
+#endif
+	pid = fork();
+	if (pid != 0) safepoint_end();
+	if (pid == -1) {
+		perror("backup: error forking snapshot");
+		return(-1);
+	}
+	if (pid == 0) {
+		int res;
+
+		/* the I/O threads are not forked */
+		pthread_mutex_init(&io_mtx, NULL);
+		io_nthreads = 1;
+#ifdef PERM_URING
+		aio_queueing = aio && !cmp_on && uring_init() == 0;
+#endif
+		res = backup_heap();
+		aio_queueing = false;
+#ifdef PERM_URING
+		if (res == 0 && aio_nr) {
+			aio_start(bfd);
+			res = aio_reap(true);
+		}
+#endif
+		snap->incr_seq = incr_seq;
+		snap->incr_off = incr_off;
+		snap->incr_heap_sz = incr_heap_sz;
+		snap->ring_cur = ring_cur;
+		snap->ring_gen = ring_gen;
+		snap->res = res;
+		snap->done = true;
+		_exit(res ? 1 : 0);
+	}
+	snap_pid = pid;
+	snap_res = 1;
+	return(0);
+}
+
 /* Backup globals and heap to backup file */
 JEMALLOC_ATTR(visibility("default"))
 int backup(void)
@@ -489,40 +3673,156 @@ int backup(void)
 		fprintf(stderr, "backup: backup file not open\n");
 		goto bu_return;
 	}
-	jemalloc_prefork(); /* acquire all jemalloc mutexes */
+	snap_reap(true); /* one backup at a time */
+	sum_drop(); /* the restored image may be overwritten */
+	if (ovl_settle("backup")) goto bu_return;
+	if (snap_fork) {
+		res = snap_start(false);
+		goto bu_return;
+	}
+	heap_quiesce();
 
 	/* save globals */
 	writevb(plib->globals, plib->gsize, permv, nperm);
 
-	/* write out heap */
-	res = lseek(bfd, 0, SEEK_SET);
-	if (res == -1) {
-		perror("backup: error seeking to heap start");
-		goto bu_return;
+	res = backup_heap();
+	heap_resume();
+bu_return:
+	malloc_mutex_unlock(&perm_mtx);
+	return((int)res);
+}
+
+/*
+ * Start a backup and return while it is written. The image is written by a
+ * forked snapshot (PERM_SNAPSHOT=fork), so the heap may be changed at once.
+ */
+JEMALLOC_ATTR(visibility("default"))
+int backup_async(void)
+{
+	ssize_t res = -1;
+
+	malloc_mutex_lock(&perm_mtx);
+	if (bfd == -1) {
+		fprintf(stderr, "backup_async: backup file not open\n");
+		goto ba_return;
 	}
-	res = lwrite(bfd, swap_base, swap_end-swap_base);
-	if (res != swap_end-swap_base) {
-		perror("backup: error writing heap data");
-		goto bu_return;
+	/* writes from the live heap would race with its changes */
+	if (!snap_fork) {
+		fprintf(stderr,
+			"backup_async: needs a forked snapshot (PERM_SNAPSHOT=fork)\n");
+		goto ba_return;
+	}
+	snap_reap(true); /* one backup at a time */
+	sum_drop(); /* the restored image may be overwritten */
+	if (ovl_settle("backup_async")) goto ba_return;
+	res = snap_start(true);
+ba_return:
+	malloc_mutex_unlock(&perm_mtx);
+	return((int)res);
+}
+
+/* Check on a backup running in the background: 1 running, 0 done, -1 error */
+JEMALLOC_ATTR(visibility("default"))
+int backup_poll(void)
+{
+	int res;
+
+	malloc_mutex_lock(&perm_mtx);
+	res = snap_reap(false);
+	malloc_mutex_unlock(&perm_mtx);
+	return(res);
+}
+
+/* Wait for a backup running in the background: 0 done, -1 error */
+JEMALLOC_ATTR(visibility("default"))
+int backup_wait(void)
+{
+	int res;
+
+	malloc_mutex_lock(&perm_mtx);
+	res = snap_reap(true);
+	malloc_mutex_unlock(&perm_mtx);
+	return(res);
+}
+
+/*
+ * Read the heap, and then the globals, from the backup file, holding an image
+ * of generation gen. swap_end_ref is the end of the heap before the restore.
+ */
+static int restore_heap(uint64_t gen, void *swap_end_ref)
+{
+	ssize_t res = -1;
+	size_t heap_sz, base_sz, nframes;
+	unsigned nincr;
+	off_t base_end, end;
+	bool mapped;
+
+	/* check compatibility */
+	if (check_header(bfd, &base_sz, &base_end, &nframes, &nincr, gen)) {
+		goto rs_return;
+	}
+	/* a growable map file must cover the restored heap */
+	if (chunk_swap_extend(base_sz)) {
+		perror("restore: error extending map file");
+		goto rs_return;
+	}
+	/* the heap is replaced, so the overlay of a previous restore is not kept */
+	if (ovl_drop()) {
+		perror("restore: error remapping heap");
+		goto rs_return;
 	}
+	/*
+	 * a raw image can be mapped if the backup file is readable, and the
+	 * overlay written back to a map file, which hugetlbfs can't do and
+	 * an anonymous heap doesn't have
+	 */
+	mapped = ovl_on && nframes == 0 && map_huge == 0 && !map_anon &&
+		(fcntl(bfd, F_GETFL) & O_ACCMODE) != O_WRONLY;
+	/* verifying a mapped image would read all of it */
+	sum_lazy = sum_rec->nblocks && (sum_verify == VERIFY_LAZY ||
+		(mapped && sum_verify == VERIFY_FULL));
 
-	res = fsync(bfd);
+	/* map the heap, or read in its data extents or compressed frames */
+	io_stats_reset();
+	if (mapped) res = ovl_map(bfd, base_sz);
+	else res = nframes ? heap_read_packed(bfd, nframes) :
+		heap_read_sparse(bfd, base_sz);
 	if (res == -1) {
-		perror("backup: error syncing backup file");
-		goto bu_return;
+		perror("restore: error reading heap data");
+		goto rs_return;
 	}
-
-	/* truncate a file longer than (swap_end-swap_base) */
-	res = ftruncate(bfd, swap_end-swap_base);
+	if (!mapped) io_stats_print("restore");
+	/* check the base image before increments change it */
+	if (sum_verify == VERIFY_FULL && !mapped) {
+		res = heap_verify(bfd, sum_rec->nblocks);
+		if (res == -1) {
+			perror("restore: error verifying heap data");
+			goto rs_return;
+		}
+	}
+	/* apply increments made since the base image */
+	res = incr_read(bfd, base_end, base_sz, nincr, &heap_sz, &end);
 	if (res == -1) {
-		perror("backup: error truncating backup file");
-		goto bu_return;
+		perror("restore: error reading heap increment");
+		goto rs_return;
+	}
+	if (incr_max) {
+		res = incr_reset(heap_sz, nincr, end);
+		if (res == -1) {
+			perror("restore: error clearing changed pages");
+			goto rs_return;
+		}
 	}
 
+	/* restore globals */
+	readvb(plib->globals, plib->gsize, permv, nperm);
+
+	/* release free extents and shrinkage, unless mapped from the image */
+	chunk_swap_reset(swap_end_ref, !mapped);
+
 	res = 0;
-bu_return:
-	if (bfd != -1) jemalloc_postfork(); /* release all jemalloc mutexes */
-	malloc_mutex_unlock(&perm_mtx);
+rs_return:
+	if (res == -1) sum_drop();
 	return((int)res);
 }
 
@@ -531,46 +3831,106 @@ JEMALLOC_ATTR(visibility("default"))
 int restore(void)
 {
 	void *swap_end_ref = swap_end;
-	ssize_t res = -1;
-	size_t heap_sz;
+	int res = -1;
+	unsigned i, n, order[RING_MAX];
+	uint64_t gens[RING_MAX];
 
 	malloc_mutex_lock(&perm_mtx);
 	if (bfd == -1) {
 		fprintf(stderr, "restore: backup file not open\n");
-		goto rs_return;
+		goto rs_unlock;
 	}
-	jemalloc_prefork(); /* acquire all jemalloc mutexes */
-
-	/* check compatibility */
-	if (check_header(bfd, &heap_sz)) {
+	if (ptx_depth) {
+		fprintf(stderr, "restore: transaction in progress\n");
+		goto rs_unlock;
+	}
+	snap_reap(true); /* the backup file may still be written */
+	sum_drop();
+	/* as heap_quiesce(), but the tcaches are dropped, not flushed */
+	safepoint_begin();
+	jemalloc_prefork();
+	if (ring_n == 0) {
+		res = restore_heap(0, swap_end_ref);
 		goto rs_return;
 	}
 
-	/* read in heap */
-	res = lseek(bfd, 0, SEEK_SET);
-	if (res == -1) {
-		perror("restore: error seeking to heap start");
-		goto rs_return;
+	/* the newest generation of the ring that restores */
+	n = ring_scan(order, gens);
+	if (n == 0)
+		fprintf(stderr, "restore: no committed generation in backup ring\n");
+	for (i = 0; i < n; i++) {
+		if (i) fprintf(stderr, "restore: falling back to generation %llu\n",
+			(unsigned long long)gens[i]);
+		bfd = ring_fd[order[i]];
+		if ((res = restore_heap(gens[i], swap_end_ref)) == 0) break;
 	}
-	res = lread(bfd, swap_base, heap_sz);
-	if (res != heap_sz) {
-		perror("restore: error reading heap data");
-		goto rs_return;
+	if (res == 0) {
+		ring_cur = order[i];
+		ring_gen = gens[0];
+		/* increments extend the newest generation only */
+		if (i) incr_base = false;
+	} else
+		bfd = ring_fd[ring_cur];
+rs_return:
+#ifdef JEMALLOC_TCACHE
+	tcache_invalidate_all(); /* objects of the replaced heap */
+#endif
+	jemalloc_postfork();
+	/* the image may come from a run with fewer CPUs */
+	if (arenas_resize() && res == 0) {
+		fprintf(stderr, "restore: error resizing arenas array\n");
+		res = -1;
 	}
+	if (res == 0) numa_place(); /* pages were read in by the I/O threads */
+	safepoint_end();
+	/* a backup taken during a transaction rolls back */
+	if (res == 0) res = ptx_recover("restore");
+rs_unlock:
+	malloc_mutex_unlock(&perm_mtx);
+	return(res);
+}
 
-	/* restore globals */
-	readvb(plib->globals, plib->gsize, permv, nperm);
+/*
+ * Verify the in-use blocks of the heap range [ptr, ptr+size), or of the
+ * whole heap when ptr is NULL, against the image restored by the last
+ * restore() with PERM_VERIFY=lazy. Blocks are checked in the backup file,
+ * once each, so that the heap may have been changed since the restore.
+ */
+JEMALLOC_ATTR(visibility("default"))
+int restore_verify(const void *ptr, size_t size)
+{
+	size_t i, first = 0, last;
+	int res = -1;
 
-	/* zero out shrinkage in mapped heap */
-	if (swap_end_ref > swap_end) {
-		memset(swap_end, 0, swap_end_ref - swap_end);
+	malloc_mutex_lock(&perm_mtx);
+	if (bfd == -1) {
+		fprintf(stderr, "restore_verify: backup file not open\n");
+		goto rv_return;
 	}
-
 	res = 0;
-rs_return:
-	if (bfd != -1) jemalloc_postfork(); /* release all jemalloc mutexes */
+	if (!sum_lazy) goto rv_return;
+	last = sum_rec->nblocks;
+	if (ptr != NULL) {
+		size_t off = (char *)ptr - (char *)swap_base;
+
+		if ((char *)ptr < (char *)swap_base || off >= last * io_stripe)
+			goto rv_return;
+		first = off / io_stripe;
+		if (size < last * io_stripe - off)
+			last = (off + size + io_stripe - 1) / io_stripe;
+	}
+	for (i = first; i < last; i++) {
+		if (sum_tab[i].state == SUM_DATA &&
+		    io_queue(bfd, sum_file, i * io_stripe, io_stripe)) {
+			res = -1;
+			break;
+		}
+	}
+	if (res == 0) res = io_flush();
+	if (res == -1) perror("restore_verify: error verifying heap data");
+rv_return:
 	malloc_mutex_unlock(&perm_mtx);
-	return((int)res);
+	return(res);
 }
 
 #undef swap_base
@@ -580,23 +3940,40 @@ rs_return:
 #undef base_next_addr
 #undef base_past_addr
 
-static int check_header(int fd, size_t *heap_sz)
+static int check_header(int fd, size_t *heap_sz, off_t *base_end,
+    size_t *nframes, unsigned *nincr, uint64_t gen)
 {
 	ssize_t res;
 	plib_t fnd;
+	cmp_hdr_t chdr;
+	sum_hdr_t shdr;
+	incr_hdr_t ihdr;
+	off_t off;
+	int key;
 
-	/* read in plib */
-	res = lseek(fd, 0, SEEK_SET);
-	if (res == -1) {
-		perror("check_header: error seeking to heap header");
-		return(-1);
-	}
-	res = lread(fd, &fnd, sizeof(plib_t));
-	if (res != sizeof(plib_t)) {
+	/* a raw image starts with plib, a compressed one with its own header */
+	res = pread(fd, &key, sizeof(key), 0);
+	if (res != sizeof(key)) {
 		perror("check_header: error reading heap header");
 		return(-1);
 	}
+	if (key == PERM_CKEY) {
+		res = lpread(fd, &chdr, sizeof(cmp_hdr_t), 0);
+		if (res != sizeof(cmp_hdr_t)) {
+			perror("check_header: error reading compressed image header");
+			return(-1);
+		}
+		fnd = chdr.plib;
+	} else {
+		res = lpread(fd, &fnd, sizeof(plib_t), 0);
+		if (res != sizeof(plib_t)) {
+			perror("check_header: error reading heap header");
+			return(-1);
+		}
+	}
 	*heap_sz = fnd.swap_end - fnd.swap_base;
+	*base_end = *heap_sz;
+	*nframes = 0;
 
 	/* check */
 	if (fnd.version_key != plib->version_key) {
@@ -625,16 +4002,17 @@ static int check_header(int fd, size_t *heap_sz)
 		return(-1);
 	}
 
-	if (fnd.base_pages < plib->swap_base || fnd.base_pages > plib->swap_end) {
+	/* the heap being restored may be larger than the one it replaces */
+	if (fnd.base_pages < fnd.swap_base || fnd.base_pages > fnd.swap_end) {
 		fprintf(stderr,
 			"check_header: internal heap base address incorrect, found:%p expect:%p-%p\n",
-			fnd.base_pages, plib->swap_base, plib->swap_end);
+			fnd.base_pages, fnd.swap_base, fnd.swap_end);
 		return(-1);
 	}
-	if (fnd.base_past_addr < plib->swap_base || fnd.base_past_addr > plib->swap_end) {
+	if (fnd.base_past_addr < fnd.swap_base || fnd.base_past_addr > fnd.swap_end) {
 		fprintf(stderr,
 			"check_header: internal heap max address incorrect, found:%p expect:%p-%p\n",
-			fnd.base_past_addr, plib->swap_base, plib->swap_end);
+			fnd.base_past_addr, fnd.swap_base, fnd.swap_end);
 		return(-1);
 	}
 	if (fnd.base_next_addr < fnd.base_pages || fnd.base_next_addr > fnd.base_past_addr) {
@@ -644,16 +4022,120 @@ static int check_header(int fd, size_t *heap_sz)
 		return(-1);
 	}
 
-	if (fnd.globals < plib->swap_base || fnd.globals > plib->swap_end) {
+	if (fnd.globals < fnd.swap_base || fnd.globals > fnd.swap_end) {
 		fprintf(stderr,
 			"check_header: internal globals address incorrect, found:%p expect:%p-%p\n",
-			fnd.globals, plib->swap_base, plib->swap_end);
+			fnd.globals, fnd.swap_base, fnd.swap_end);
 		return(-1);
 	}
 
+	if (key == PERM_CKEY) {
+		if (chdr.version != CMP_VERSION) {
+			fprintf(stderr,
+				"check_header: compressed image version incorrect, found:%u expect:%u\n",
+				chdr.version, CMP_VERSION);
+			return(-1);
+		}
+		if (chdr.frame_sz != chunksize ||
+		    chdr.nframes * chdr.frame_sz != *heap_sz ||
+		    chdr.data_end < PAGE_SIZE + CMP_IDX_SZ(chdr.nframes)) {
+			fprintf(stderr,
+				"check_header: compressed image incorrect, frame size:%zu frames:%zu end:%zu\n",
+				chdr.frame_sz, chdr.nframes, (size_t)chdr.data_end);
+			return(-1);
+		}
+		*base_end = chdr.data_end;
+		*nframes = chdr.nframes;
+	}
+
+	/* load the block checksums, absent from images of older versions */
+	sum_rec->nblocks = 0;
+	res = pread(fd, &shdr, sizeof(sum_hdr_t), *base_end);
+	if (res == sizeof(sum_hdr_t) && shdr.version_key == PERM_SKEY) {
+		size_t n = shdr.nblocks;
+
+		if (shdr.block_sz != chunksize || n * shdr.block_sz != *heap_sz ||
+		    n > sum_max) {
+			fprintf(stderr,
+				"check_header: checksum trailer incorrect, block size:%zu blocks:%zu\n",
+				shdr.block_sz, n);
+			return(-1);
+		}
+		res = lpread(fd, sum_tab, n * sizeof(sum_t), *base_end + sizeof(sum_hdr_t));
+		if (res != n * sizeof(sum_t)) {
+			perror("check_header: error reading checksum trailer");
+			return(-1);
+		}
+		if (sum_verify != VERIFY_NONE && crc32c(0, sum_tab, n * sizeof(sum_t)) !=
+		    shdr.crc) {
+			fprintf(stderr, "check_header: checksum trailer corrupt\n");
+			return(-1);
+		}
+		*sum_rec = shdr;
+		*base_end += SUM_REC_SZ(n);
+	}
+
+	/* count committed increments that follow the base image */
+	off = *base_end;
+	for (*nincr = 0; ; (*nincr)++) {
+		res = pread(fd, &ihdr, sizeof(incr_hdr_t), off);
+		if (res != sizeof(incr_hdr_t) || ihdr.version_key != PERM_IKEY ||
+		    ihdr.seq != *nincr+1 || ihdr.gen != gen)
+			break;
+		if (ihdr.heap_sz > (size_t)(fnd.swap_max-fnd.swap_base) ||
+		    ihdr.heap_sz & chunksize_mask ||
+		    ihdr.nextents > ihdr.heap_sz >> PAGE_SHIFT ||
+		    ihdr.data_sz > ihdr.heap_sz) {
+			fprintf(stderr,
+				"check_header: increment %u incorrect, heap size:%zu extents:%zu data:%zu\n",
+				ihdr.seq, ihdr.heap_sz, ihdr.nextents, ihdr.data_sz);
+			return(-1);
+		}
+		off += INCR_REC_SZ(&ihdr);
+	}
+
 	return(0);
 }
 
+/*
+ * Read the heap header of a backup file, or of the first generation found
+ * of a backup ring, for the address of an anonymous heap to restore.
+ */
+static int back_header(const char *fname, void **base, size_t *max)
+{
+	char path[PATH_MAX];
+	plib_t fnd;
+	cmp_hdr_t chdr;
+	unsigned i;
+	int fd, key;
+
+	for (i = 0; i <= RING_MAX; i++) {
+		if (i && snprintf(path, sizeof(path), "%s.%u", fname, i - 1) >=
+		    sizeof(path))
+			break;
+		fd = open(i ? path : fname, O_RDONLY);
+		if (fd == -1 && i == 0) {
+			perror("mopen: error opening backup file");
+			return(-1);
+		}
+		if (fd == -1) continue;
+		if (pread(fd, &key, sizeof(key), 0) != sizeof(key)) key = 0;
+		if (key == PERM_CKEY &&
+		    lpread(fd, &chdr, sizeof(cmp_hdr_t), 0) == sizeof(cmp_hdr_t))
+			fnd = chdr.plib;
+		else if (key != PERM_KEY ||
+		    lpread(fd, &fnd, sizeof(plib_t), 0) != sizeof(plib_t))
+			key = 0;
+		close(fd);
+		if (key && fnd.version_key == PERM_KEY) {
+			*base = fnd.swap_base;
+			*max = (char *)fnd.swap_max - (char *)fnd.swap_base;
+			return(0);
+		}
+	}
+	fprintf(stderr, "mopen: no heap header found in backup file %s\n", fname);
+	return(-1);
+}
 
 /* NOTES:
  * Globals can be specified at compile and link time with the PERM attribute.
@@ -679,11 +4161,22 @@ static int check_header(int fd, size_t *heap_sz)
    Currently, the nthreads count and the lock for an arena are kept in the
    persistent area which necessitates these fields being reinitialized on
    restore.
+ * The arenas array is sized for the CPUs of the machine that runs the
+   program. On reopen or restore, arenas_resize() grows it if the heap was
+   created with fewer CPUs, and new threads are assigned to the first
+   narenas_auto arenas. Arenas are never removed, since they own objects.
  * Calling a ctl function will call malloc_init_hard() before ctl_init().
+ * Incremental backups (PERM_INCR) rely on soft-dirty bits being cleared
+   only by perma.c. Another user of /proc/self/clear_refs in the same
+   process would hide changed pages from the next increment.
+ * Thread caches (JEMALLOC_TCACHE) are kept outside the heap in anonymous
+   memory. Objects in a cache are free to their thread but allocated in
+   the heap, so the caches are flushed before a flush, range flush,
+   transaction commit, or backup, and are emptied without flushing after a
+   restore.
  * Configurations not supported for various reasons:
      JEMALLOC_IVSALLOC - chunk_boot() calls rtree_new(), base_alloc()
      DYNAMIC_PAGE_SHIFT - may change layout of internal structures
-     JEMALLOC_TCACHE - tcache_boot() calls base_alloc()
      setting of opt_* variables - may change layout of internal structures
  */
 
@@ -693,23 +4186,12 @@ static int check_header(int fd, size_t *heap_sz)
    (tmp file, app name, process id, ...) in perm_init().
  * Change method of accessing heap for backup so that mopen is not needed
    when only doing a backup.
- * The checkpoint mechanism need not be dependent on a memory-mapped file.
-   The pages could be anonymous. At checkpoint time the anonymous pages
-   could be copied to a backup file just as easily as file-backed pages.
-   On restore, anonymous pages could be remapped to the needed address.
  * Track chunks allocated in a separate structure. A backup or flush could
    then iterate through the allocated chunks and not require the virtual-
    address space to be contiguous.
- * See if the mmapped file can grow with the heap instead of fixing the
-   size up front.
  * See if persistent blocks marked with perm() can be memory mapped.
  * Consider, what is the lifetime of a persistent heap? For example, if
    mopen(,"w+", ) (create) is called a second time within an application
    should the old heap be over written with a new one? Should there be an
    mdelete()?
- * Figure out how the number of arenas should be managed. Currently the
-   the max number of arenas is 4x the number of CPUs of the machine that
-   created the persistent heap. Should a fixed number of arenas be used
-   or should the number be reduced if there are fewer CPUs on restore?
-   If arenas are reduced, ctl_stats.arenas would need to be reduced also.
  */
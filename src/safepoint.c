@@ -0,0 +1,261 @@
+#define	JEMALLOC_SAFEPOINT_C_
+#include "jemalloc/internal/jemalloc_internal.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+ * A checkpoint stops the allocator at a safepoint instead of taking its
+ * locks from the outside: allocator calls (imalloc() and friends) count
+ * their nesting depth per thread, and a thread that enters the allocator
+ * while a checkpoint is pending parks until the checkpoint ends. The
+ * checkpointing thread raises safepoint_pending and waits for the depth of
+ * every other thread to drop to 0, after which no thread is in the middle
+ * of changing arena bins, runs, or thread caches.
+ *
+ * An entry stores the depth and then loads the flag, and the checkpointer
+ * stores the flag and then loads the depths, so both need a full barrier in
+ * between. Where membarrier() is available the checkpointer issues it on
+ * behalf of all threads, and an entry only needs a compiler barrier.
+ *
+ * Without TLS there are no per thread records, and checkpoints rely on the
+ * locks taken by jemalloc_prefork() alone.
+ */
+
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED
+#  define	MEMBARRIER_CMD_PRIVATE_EXPEDITED		8
+#  define	MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED	16
+#endif
+
+/* Spins before a waiting checkpointer yields the CPU. */
+#define	SAFEPOINT_SPINS		1000
+
+/******************************************************************************/
+/* Data. */
+
+#ifndef NO_TLS
+__thread safepoint_t	safepoint_tls JEMALLOC_ATTR(tls_model("initial-exec"));
+#endif
+volatile bool		safepoint_pending;
+bool			safepoint_asym;
+
+static bool		safepoint_booted;
+static pthread_key_t	safepoint_tsd;
+/* Protects safepoint_list. */
+static malloc_mutex_t	safepoint_list_mtx;
+static ql_head(safepoint_t) safepoint_list;
+/* Protects safepoint_owner and the stats; parked threads wait on it. */
+static pthread_mutex_t	safepoint_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	safepoint_cv = PTHREAD_COND_INITIALIZER;
+static safepoint_t	*safepoint_owner;
+
+/* Checkpoint start, and when the other threads were stopped (ns). */
+static uint64_t		safepoint_t0, safepoint_t1;
+static uint64_t		safepoint_count;
+static uint64_t		safepoint_wait_last, safepoint_wait_max;
+static uint64_t		safepoint_pause_last, safepoint_pause_max;
+
+/******************************************************************************/
+/* Function prototypes for non-inline static functions. */
+
+static uint64_t	safepoint_now(void);
+static void	safepoint_fence(void);
+static void	safepoint_cleanup(void *arg);
+static void	safepoint_postfork_child(void);
+
+/******************************************************************************/
+
+static uint64_t
+safepoint_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Order the store of safepoint_pending before the loads of the depths. */
+static void
+safepoint_fence(void)
+{
+
+#ifdef __NR_membarrier
+	if (safepoint_asym && syscall(__NR_membarrier,
+	    MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0)
+		return;
+#endif
+	__sync_synchronize();
+}
+
+/* Drop the record of an exiting thread. */
+static void
+safepoint_cleanup(void *arg)
+{
+	safepoint_t *sp = (safepoint_t *)arg;
+
+	malloc_mutex_lock(&safepoint_list_mtx);
+	ql_remove(&safepoint_list, sp, link);
+	malloc_mutex_unlock(&safepoint_list_mtx);
+	sp->registered = false;
+}
+
+/* Only the forking thread exists in the child. */
+static void
+safepoint_postfork_child(void)
+{
+
+	malloc_mutex_init(&safepoint_list_mtx);
+	pthread_mutex_init(&safepoint_mtx, NULL);
+	pthread_cond_init(&safepoint_cv, NULL);
+	ql_new(&safepoint_list);
+	/* There is nothing left to stop, whoever began a checkpoint. */
+	safepoint_owner = NULL;
+	safepoint_pending = false;
+#ifndef NO_TLS
+	if (safepoint_tls.registered) {
+		ql_elm_new(&safepoint_tls, link);
+		ql_tail_insert(&safepoint_list, &safepoint_tls, link);
+	}
+#endif
+}
+
+void
+safepoint_register(safepoint_t *sp)
+{
+
+	/* Checkpoints can't start before, and the record can't be dropped. */
+	if (safepoint_booted == false)
+		return;
+	malloc_mutex_lock(&safepoint_list_mtx);
+	ql_elm_new(sp, link);
+	ql_tail_insert(&safepoint_list, sp, link);
+	malloc_mutex_unlock(&safepoint_list_mtx);
+	sp->registered = true;
+	pthread_setspecific(safepoint_tsd, (void *)sp);
+}
+
+/* Wait outside of the allocator for the pending checkpoint to end. */
+void
+safepoint_park(safepoint_t *sp)
+{
+
+	while (true) {
+		pthread_mutex_lock(&safepoint_mtx);
+		/* The checkpointer may allocate. */
+		if (safepoint_pending == false || safepoint_owner == sp) {
+			pthread_mutex_unlock(&safepoint_mtx);
+			return;
+		}
+		sp->depth = 0;
+		while (safepoint_pending)
+			pthread_cond_wait(&safepoint_cv, &safepoint_mtx);
+		sp->depth = 1;
+		pthread_mutex_unlock(&safepoint_mtx);
+		__sync_synchronize();
+		if (safepoint_pending == false)
+			return;
+	}
+}
+
+/*
+ * Wait until no other thread is in the allocator, and keep them out until
+ * safepoint_end().
+ */
+void
+safepoint_begin(void)
+{
+#ifndef NO_TLS
+	safepoint_t *self = &safepoint_tls, *sp;
+#else
+	safepoint_t *self = NULL;
+#endif
+
+	pthread_mutex_lock(&safepoint_mtx);
+	/* One checkpoint at a time. */
+	while (safepoint_pending)
+		pthread_cond_wait(&safepoint_cv, &safepoint_mtx);
+	safepoint_t0 = safepoint_now();
+	safepoint_owner = self;
+	safepoint_pending = true;
+	pthread_mutex_unlock(&safepoint_mtx);
+
+#ifndef NO_TLS
+	safepoint_fence();
+	malloc_mutex_lock(&safepoint_list_mtx);
+	ql_foreach(sp, &safepoint_list, link) {
+		unsigned spins = 0;
+
+		if (sp == self)
+			continue;
+		while (sp->depth != 0) {
+			if (++spins < SAFEPOINT_SPINS)
+				CPU_SPINWAIT;
+			else
+				sched_yield();
+		}
+	}
+	malloc_mutex_unlock(&safepoint_list_mtx);
+	/* Order the loads of the allocator state after those of the depths. */
+	__sync_synchronize();
+#endif
+	safepoint_t1 = safepoint_now();
+}
+
+/* Let the parked threads back into the allocator. */
+void
+safepoint_end(void)
+{
+	uint64_t t2 = safepoint_now();
+
+	pthread_mutex_lock(&safepoint_mtx);
+	safepoint_count++;
+	safepoint_wait_last = safepoint_t1 - safepoint_t0;
+	if (safepoint_wait_last > safepoint_wait_max)
+		safepoint_wait_max = safepoint_wait_last;
+	safepoint_pause_last = t2 - safepoint_t0;
+	if (safepoint_pause_last > safepoint_pause_max)
+		safepoint_pause_max = safepoint_pause_last;
+	safepoint_owner = NULL;
+	safepoint_pending = false;
+	pthread_cond_broadcast(&safepoint_cv);
+	pthread_mutex_unlock(&safepoint_mtx);
+}
+
+/*
+ * Checkpoints so far, and the last and longest time (ns) to stop the other
+ * threads and that they were stopped for.
+ */
+void
+safepoint_stats(uint64_t *count, uint64_t *wait_last, uint64_t *wait_max,
+    uint64_t *pause_last, uint64_t *pause_max)
+{
+
+	pthread_mutex_lock(&safepoint_mtx);
+	*count = safepoint_count;
+	*wait_last = safepoint_wait_last;
+	*wait_max = safepoint_wait_max;
+	*pause_last = safepoint_pause_last;
+	*pause_max = safepoint_pause_max;
+	pthread_mutex_unlock(&safepoint_mtx);
+}
+
+bool
+safepoint_boot(void)
+{
+
+	if (safepoint_booted)
+		return (false);
+	if (malloc_mutex_init(&safepoint_list_mtx))
+		return (true);
+	ql_new(&safepoint_list);
+	if (pthread_key_create(&safepoint_tsd, safepoint_cleanup) != 0)
+		return (true);
+	if (pthread_atfork(NULL, NULL, safepoint_postfork_child) != 0)
+		return (true);
+#ifdef __NR_membarrier
+	safepoint_asym = syscall(__NR_membarrier,
+	    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#endif
+	safepoint_booted = true;
+	return (false);
+}
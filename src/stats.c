@@ -457,7 +457,8 @@ stats_print(void (*write_cb)(void *, const char *), void *cbopaque,
 		bool bv;
 		unsigned uv;
 		ssize_t ssv;
-		size_t sv, bsz, ssz, sssz, cpsz;
+		size_t sv, bsz, ssz, sssz, cpsz, u64sz;
+		uint64_t u64v;
 
 		bsz = sizeof(bool);
 		ssz = sizeof(size_t);
@@ -513,6 +514,8 @@ stats_print(void (*write_cb)(void *, const char *), void *cbopaque,
 		OPT_WRITE_SIZE_T(lg_cspace_max)
 		OPT_WRITE_SIZE_T(lg_chunk)
 		OPT_WRITE_SIZE_T(narenas)
+		OPT_WRITE_BOOL(percpu_arena)
+		OPT_WRITE_BOOL(numa)
 		OPT_WRITE_SSIZE_T(lg_dirty_mult)
 		OPT_WRITE_BOOL(stats_print)
 		OPT_WRITE_BOOL(junk)
@@ -672,6 +675,66 @@ stats_print(void (*write_cb)(void *, const char *), void *cbopaque,
 		write_cb(cbopaque, " (2^");
 		write_cb(cbopaque, u2s(sv, 10, s));
 		write_cb(cbopaque, ")\n");
+
+		if ((err = JEMALLOC_P(mallctl)("swap.flush.level", &cpv, &cpsz,
+		    NULL, 0)) == 0) {
+			uint64_t lag;
+
+			CTL_GET("swap.flush.interval", &uv, unsigned);
+			CTL_GET("swap.flush.dirty", &sv, size_t);
+			CTL_GET("swap.flush.lag", &lag, uint64_t);
+			write_cb(cbopaque, "Map file flush: ");
+			write_cb(cbopaque, cpv);
+			write_cb(cbopaque, ", interval: ");
+			write_cb(cbopaque, u2s(uv, 10, s));
+			write_cb(cbopaque, " ms, dirty: ");
+			write_cb(cbopaque, u2s(sv, 10, s));
+			write_cb(cbopaque, ", lag: ");
+			write_cb(cbopaque, u2s(lag, 10, s));
+			write_cb(cbopaque, " ms\n");
+		}
+		u64sz = sizeof(uint64_t);
+		if ((err = JEMALLOC_P(mallctl)("swap.safepoint.count", &u64v,
+		    &u64sz, NULL, 0)) == 0 && u64v != 0) {
+			uint64_t wait, pause;
+
+			write_cb(cbopaque, "Safepoints: ");
+			write_cb(cbopaque, u2s(u64v, 10, s));
+			CTL_GET("swap.safepoint.wait_max", &wait, uint64_t);
+			CTL_GET("swap.safepoint.pause_max", &pause, uint64_t);
+			write_cb(cbopaque, ", max wait: ");
+			write_cb(cbopaque, u2s(wait / 1000, 10, s));
+			write_cb(cbopaque, " us, max pause: ");
+			write_cb(cbopaque, u2s(pause / 1000, 10, s));
+			write_cb(cbopaque, " us\n");
+		}
+		CTL_GET("opt.numa", &bv, bool);
+		if (bv) {
+			unsigned i, nnodes, nthreads;
+			size_t pactive, nchunks;
+
+			CTL_GET("arenas.nnodes", &nnodes, unsigned);
+			for (i = 0; i < nnodes; i++) {
+				CTL_I_GET("stats.nodes.0.narenas", &uv, unsigned);
+				CTL_I_GET("stats.nodes.0.nthreads", &nthreads,
+				    unsigned);
+				CTL_I_GET("stats.nodes.0.pactive", &pactive,
+				    size_t);
+				CTL_I_GET("stats.nodes.0.nchunks", &nchunks,
+				    size_t);
+				write_cb(cbopaque, "NUMA node ");
+				write_cb(cbopaque, u2s(i, 10, s));
+				write_cb(cbopaque, ": arenas: ");
+				write_cb(cbopaque, u2s(uv, 10, s));
+				write_cb(cbopaque, ", threads: ");
+				write_cb(cbopaque, u2s(nthreads, 10, s));
+				write_cb(cbopaque, ", active pages: ");
+				write_cb(cbopaque, u2s(pactive, 10, s));
+				write_cb(cbopaque, ", chunks: ");
+				write_cb(cbopaque, u2s(nchunks, 10, s));
+				write_cb(cbopaque, "\n");
+			}
+		}
 	}
 
 #ifdef JEMALLOC_STATS
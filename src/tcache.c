@@ -26,6 +26,14 @@ size_t				nhbins;
 size_t				tcache_maxclass;
 unsigned			tcache_gc_incr;
 
+/*
+ * All extant tcaches. The tcaches and tcache_bin_info are in volatile memory,
+ * not in the persistent heap, whose layout would otherwise depend on the
+ * threads that ran.
+ */
+static malloc_mutex_t		tcaches_mtx;
+static ql_head(tcache_t)	tcaches;
+
 /******************************************************************************/
 /* Function prototypes for non-inline static functions. */
 
@@ -38,7 +46,9 @@ tcache_alloc_small_hard(tcache_t *tcache, tcache_bin_t *tbin, size_t binind)
 {
 	void *ret;
 
-	arena_tcache_fill_small(tcache->arena, tbin, binind
+	/* With per-CPU arenas, refill from the arena of the current CPU. */
+	arena_tcache_fill_small(opt_percpu_arena ? choose_arena() :
+	    tcache->arena, tbin, binind
 #ifdef JEMALLOC_PROF
 	    , tcache->prof_accumbytes
 #endif
@@ -234,24 +244,14 @@ tcache_create(arena_t *arena)
 	size = PTR_CEILING(size);
 	stack_offset = size;
 	size += stack_nelms * sizeof(void *);
+
 	/*
-	 * Round up to the nearest multiple of the cacheline size, in order to
-	 * avoid the possibility of false cacheline sharing.
-	 *
-	 * That this works relies on the same logic as in ipalloc(), but we
-	 * cannot directly call ipalloc() here due to tcache bootstrapping
-	 * issues.
+	 * Map the tcache outside of the persistent heap. Whole pages also avoid
+	 * the possibility of false cacheline sharing.
 	 */
-	size = (size + CACHELINE_MASK) & (-CACHELINE);
-
-	if (size <= small_maxclass)
-		tcache = (tcache_t *)arena_malloc_small(arena, size, true);
-	else if (size <= tcache_maxclass)
-		tcache = (tcache_t *)arena_malloc_large(arena, size, true);
-	else
-		tcache = (tcache_t *)icalloc(size);
-
-	if (tcache == NULL)
+	tcache = (tcache_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (tcache == MAP_FAILED)
 		return (NULL);
 
 #ifdef JEMALLOC_STATS
@@ -271,6 +271,11 @@ tcache_create(arena_t *arena)
 		stack_offset += tcache_bin_info[i].ncached_max * sizeof(void *);
 	}
 
+	malloc_mutex_lock(&tcaches_mtx);
+	ql_elm_new(tcache, all_link);
+	ql_tail_insert(&tcaches, tcache, all_link);
+	malloc_mutex_unlock(&tcaches_mtx);
+
 	TCACHE_SET(tcache);
 
 	return (tcache);
@@ -280,7 +285,7 @@ void
 tcache_destroy(tcache_t *tcache)
 {
 	unsigned i;
-	size_t tcache_size;
+	size_t size;
 
 #ifdef JEMALLOC_STATS
 	/* Unlink from list of extant tcaches. */
@@ -337,30 +342,79 @@ tcache_destroy(tcache_t *tcache)
 	}
 #endif
 
-	tcache_size = arena_salloc(tcache);
-	if (tcache_size <= small_maxclass) {
-		arena_chunk_t *chunk = CHUNK_ADDR2BASE(tcache);
-		arena_t *arena = chunk->arena;
-		size_t pageind = ((uintptr_t)tcache - (uintptr_t)chunk) >>
-		    PAGE_SHIFT;
-		arena_chunk_map_t *mapelm = &chunk->map[pageind-map_bias];
-		arena_run_t *run = (arena_run_t *)((uintptr_t)chunk +
-		    (uintptr_t)((pageind - (mapelm->bits >> PAGE_SHIFT)) <<
-		    PAGE_SHIFT));
-		arena_bin_t *bin = run->bin;
+	malloc_mutex_lock(&tcaches_mtx);
+	ql_remove(&tcaches, tcache, all_link);
+	malloc_mutex_unlock(&tcaches_mtx);
 
-		malloc_mutex_lock(&bin->lock);
-		arena_dalloc_bin(arena, chunk, tcache, mapelm);
-		malloc_mutex_unlock(&bin->lock);
-	} else if (tcache_size <= tcache_maxclass) {
-		arena_chunk_t *chunk = CHUNK_ADDR2BASE(tcache);
-		arena_t *arena = chunk->arena;
+	size = PTR_CEILING(offsetof(tcache_t, tbins) + (sizeof(tcache_bin_t) *
+	    nhbins)) + stack_nelms * sizeof(void *);
+	munmap(tcache, size);
+}
 
-		malloc_mutex_lock(&arena->lock);
-		arena_dalloc_large(arena, chunk, tcache);
-		malloc_mutex_unlock(&arena->lock);
-	} else
-		idalloc(tcache);
+/*
+ * Return the objects of all tcaches to their arenas, so that the persistent
+ * heap does not record cached objects as allocated. The other threads must
+ * be stopped outside of the allocator (see safepoint_begin()).
+ */
+void
+tcache_flush_all(void)
+{
+	tcache_t *tcache;
+	unsigned i;
+
+	if (opt_tcache == false)
+		return;
+	malloc_mutex_lock(&tcaches_mtx);
+	ql_foreach(tcache, &tcaches, all_link) {
+		for (i = 0; i < nbins; i++) {
+			tcache_bin_flush_small(&tcache->tbins[i], i, 0
+#if (defined(JEMALLOC_STATS) || defined(JEMALLOC_PROF))
+			    , tcache
+#endif
+			    );
+		}
+		for (; i < nhbins; i++) {
+			tcache_bin_flush_large(&tcache->tbins[i], i, 0
+#if (defined(JEMALLOC_STATS) || defined(JEMALLOC_PROF))
+			    , tcache
+#endif
+			    );
+		}
+	}
+	malloc_mutex_unlock(&tcaches_mtx);
+}
+
+/*
+ * Drop the contents of all tcaches, after the heap was replaced by another
+ * image, in which the cached objects may be in use. Stopped as above.
+ */
+void
+tcache_invalidate_all(void)
+{
+	tcache_t *tcache;
+	unsigned i;
+
+	if (opt_tcache == false)
+		return;
+	malloc_mutex_lock(&tcaches_mtx);
+#ifdef JEMALLOC_STATS
+	/* The stats lists of the arenas in the image are stale. */
+	for (i = 0; i < narenas; i++) {
+		if (parenas[i] != NULL)
+			ql_new(&parenas[i]->tcache_ql);
+	}
+#endif
+	ql_foreach(tcache, &tcaches, all_link) {
+		for (i = 0; i < nhbins; i++) {
+			tcache->tbins[i].ncached = 0;
+			tcache->tbins[i].low_water = 0;
+		}
+#ifdef JEMALLOC_STATS
+		ql_elm_new(tcache, link);
+		ql_tail_insert(&tcache->arena->tcache_ql, tcache, link);
+#endif
+	}
+	malloc_mutex_unlock(&tcaches_mtx);
 }
 
 static void
@@ -384,7 +438,9 @@ tcache_thread_cleanup(void *arg)
 		TCACHE_SET((uintptr_t)1);
 	} else if (tcache != NULL) {
 		assert(tcache != (void *)(uintptr_t)1);
+		safepoint_enter();
 		tcache_destroy(tcache);
+		safepoint_leave();
 		TCACHE_SET((uintptr_t)1);
 	}
 }
@@ -437,7 +493,7 @@ tcache_boot(void)
 		nhbins = nbins + (tcache_maxclass >> PAGE_SHIFT);
 
 		/* Initialize tcache_bin_info. */
-		tcache_bin_info = (tcache_bin_info_t *)base_alloc(nhbins *
+		tcache_bin_info = (tcache_bin_info_t *)temp_malloc(nhbins *
 		    sizeof(tcache_bin_info_t));
 		if (tcache_bin_info == NULL)
 			return (true);
@@ -466,6 +522,10 @@ tcache_boot(void)
 		} else
 			tcache_gc_incr = 0;
 
+		if (malloc_mutex_init(&tcaches_mtx))
+			return (true);
+		ql_new(&tcaches);
+
 		if (pthread_key_create(&tcache_tsd, tcache_thread_cleanup) !=
 		    0) {
 			malloc_write(
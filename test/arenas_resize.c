@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define NTHREADS 4
+#define BLK_SIZE 100
+
+#define MMAP_FILE "test/arenas.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM char *blk[NTHREADS];
+
+unsigned thread_arena[NTHREADS];
+
+/* Allocate a block, and record the arena that the thread was assigned to */
+void *thread_start(void *arg)
+{
+	unsigned i = (unsigned)(uintptr_t)arg;
+	size_t sz = sizeof(unsigned);
+
+	blk[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+	if (blk[i] != NULL) memset(blk[i], i, BLK_SIZE);
+	if (JEMALLOC_P(mallctl)("thread.arena", &thread_arena[i], &sz, NULL, 0))
+		thread_arena[i] = (unsigned)-1;
+	return(NULL);
+}
+
+/* Start the threads one at a time, and check the arenas that they used */
+int run_threads(unsigned first, unsigned past)
+{
+	pthread_t thd;
+	unsigned i;
+
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_create(&thd, NULL, thread_start, (void *)(uintptr_t)i);
+		pthread_join(thd, NULL);
+		if (blk[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			return(1);
+		}
+		if (thread_arena[i] < first || thread_arena[i] >= past) {
+			fprintf(stderr, "%s(): thread %u assigned arena %u\n",
+				__func__, i, thread_arena[i]);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+int check_narenas(unsigned expect)
+{
+	unsigned n;
+	size_t sz = sizeof(n);
+
+	if (JEMALLOC_P(mallctl)("arenas.narenas", &n, &sz, NULL, 0)) {
+		fprintf(stderr, "%s(): Error in mallctl()\n", __func__);
+		return(1);
+	}
+	if (n != expect) {
+		fprintf(stderr, "%s(): narenas:%u expect:%u\n", __func__, n,
+			expect);
+		return(1);
+	}
+	return(0);
+}
+
+int check_blocks(void)
+{
+	int i, j;
+
+	for (i = 0; i < NTHREADS; i++) {
+		for (j = 0; j < BLK_SIZE; j++) {
+			if (blk[i][j] != (char)i) {
+				fprintf(stderr, "%s(): data corrupted in block(%d)\n",
+					__func__, i);
+				return(1);
+			}
+		}
+	}
+	return(0);
+}
+
+/*
+ * Reopen the heap as on a machine with the number of CPUs set by conf.
+ * The old blocks are freed to the arenas that own them, and new threads
+ * are assigned to arenas [first, past).
+ */
+int reopen(const char *conf, unsigned narenas, unsigned first, unsigned past)
+{
+	int i, ret;
+
+	JEMALLOC_P(malloc_conf) = conf;
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+#endif
+	ret = mopen(MMAP_FILE, "r+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		return(ret);
+	}
+	ret = check_narenas(narenas) || check_blocks();
+	if (ret) return(ret);
+	for (i = 0; i < NTHREADS; i++) JEMALLOC_P(free)(blk[i]);
+	ret = run_threads(first, past) || check_blocks();
+	if (ret) return(ret);
+	fprintf(stderr, "after mopen() with %s;\n", conf);
+	return(mclose());
+}
+
+int run_child(const char *exe, const char *mode)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0) {
+		execl("/proc/self/exe", exe, mode, (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s(): Error reopening in new process\n", __func__);
+		return(1);
+	}
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	/* more CPUs: the arenas array grows */
+	if (argc > 1 && strcmp(argv[1], "grow") == 0)
+		return(reopen("narenas:8", 8, 2, 8));
+	/* fewer CPUs: the arenas array is kept, but only arena 0 is used */
+	if (argc > 1 && strcmp(argv[1], "shrink") == 0)
+		return(reopen("narenas:1", 8, 0, 1));
+
+	fprintf(stderr, "Test begin\n");
+
+	JEMALLOC_P(malloc_conf) = "narenas:2";
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = check_narenas(2) || run_threads(0, 2) || check_blocks();
+	if (ret) goto RETURN;
+	fprintf(stderr, "after mopen() with narenas:2;\n");
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+	ret = run_child(argv[0], "grow") || run_child(argv[0], "shrink");
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 64
+
+#define BACK_FILE "test/copy.back"
+#define MMAP_FILE "test/copy.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+
+/* the environment, which is in the heap, points at this */
+char copy_env[] = "PERM_COPY=kernel";
+/* blocks copied in the kernel are not summed, so sum none of them */
+char verify_env[] = "PERM_VERIFY=none";
+char maps[1 << 16];
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != (unsigned)(i * j)) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], (unsigned)(i * j), &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+/* Find the start of the heap mapping, without allocating */
+char *heap_base(void)
+{
+	int fd = open("/proc/self/maps", O_RDONLY);
+	ssize_t n = fd == -1 ? -1 : read(fd, maps, sizeof(maps) - 1);
+	char *line;
+
+	if (fd != -1) close(fd);
+	if (n <= 0) return(NULL);
+	maps[n] = '\0';
+	line = strstr(maps, MMAP_FILE);
+	if (line == NULL) return(NULL);
+	while (line > maps && line[-1] != '\n') line--;
+	return((char *)strtoul(line, NULL, 16));
+}
+
+/* Check that the map file, and not only the heap, holds the blocks */
+int check_file(void)
+{
+	int i, fd = open(MMAP_FILE, O_RDONLY);
+	char *base = heap_base();
+	unsigned buf[1031];
+	size_t j;
+
+	if (fd == -1 || base == NULL) {
+		fprintf(stderr, "%s(): Error finding map file\n", __func__);
+		if (fd != -1) close(fd);
+		return(-1);
+	}
+	for (i = 0; i < MAX_BLKS; i++) {
+		if (size[i] == 0) continue;
+		/* the first page or so of the block */
+		if (pread(fd, buf, sizeof(buf), (char *)addr[i] - base) !=
+		    sizeof(buf))
+			break;
+		for (j = 0; j < 1031; j++)
+			if (buf[j] != (unsigned)(i * j)) break;
+		if (j < 1031) break;
+	}
+	close(fd);
+	if (i < MAX_BLKS) {
+		fprintf(stderr, "%s(): map file differs in block(%d)\n", __func__, i);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Map the whole backup file. Nothing here may allocate from the heap, which
+ * would make the next image differ.
+ */
+char *read_back(long *len)
+{
+	int fd = open(BACK_FILE, O_RDONLY);
+	char *buf = NULL;
+
+	if (fd == -1) return(NULL);
+	if ((*len = lseek(fd, 0, SEEK_END)) > 0) {
+		buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) buf = NULL;
+	}
+	close(fd);
+	return(buf);
+}
+
+/* Write a backup with the given copy method and restore from it */
+int backup_with(const char *how)
+{
+	int i, ret;
+
+	strcpy(copy_env, how);
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		return(ret);
+	}
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		return(ret);
+	}
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xEE, size[i] * sizeof(unsigned));
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		return(ret);
+	}
+	ret = check_blocks();
+	if (ret) return(ret);
+	ret = check_file();
+	if (ret) return(ret);
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		return(ret);
+	}
+	fprintf(stderr, "after backup() with %s;\n", how);
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+	size_t j;
+	char *kbuf = NULL, *ubuf = NULL;
+	long klen = 0, ulen = 0;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = (i+1) * 1031;
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		for (j = 0; j < size[i]; j++) addr[i][j] = (unsigned)(i * j);
+	}
+	/* free some blocks, so that the image has holes */
+	for (i = 0; i < MAX_BLKS; i += 3) {
+		JEMALLOC_P(free)(addr[i]);
+		addr[i] = NULL;
+		size[i] = 0;
+	}
+	fprintf(stderr, "after malloc();\n");
+
+	putenv(copy_env);
+	putenv(verify_env);
+	if ((ret = backup_with("PERM_COPY=kernel"))) goto RETURN;
+	kbuf = read_back(&klen);
+	unlink(BACK_FILE);
+	if ((ret = backup_with("PERM_COPY=user"))) goto RETURN;
+	ubuf = read_back(&ulen);
+
+	/* both methods write the same image */
+	if (kbuf == NULL || ubuf == NULL || klen != ulen ||
+	    memcmp(kbuf, ubuf, klen) != 0) {
+		fprintf(stderr, "%s(): backup images differ, size:%ld and %ld\n",
+			__func__, klen, ulen);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after compare;\n");
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	if (kbuf != NULL) munmap(kbuf, klen);
+	if (ubuf != NULL) munmap(ubuf, ulen);
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
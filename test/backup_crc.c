@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 32
+#define MARK 0xC0DEC0DEU
+
+#define BACK_FILE "test/crc.back"
+#define MMAP_FILE "test/crc.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+
+unsigned value(int i, size_t j)
+{
+	return(i == MAX_BLKS/2 && j == 0 ? MARK : (unsigned)(i * j % 1000));
+}
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != value(i, j)) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], value(i, j), &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+/* Find the marker in the backup file and flip a bit of it */
+int flip_mark(void)
+{
+	static off_t off = -1;
+	unsigned buf[1024];
+	unsigned char c;
+	ssize_t n;
+	int fd, ret = -1;
+
+	fd = open(BACK_FILE, O_RDWR);
+	if (fd == -1) return(-1);
+	if (off == -1) {
+		off_t pos;
+		for (pos = 0; (n = pread(fd, buf, sizeof(buf), pos)) > 0; pos += n) {
+			ssize_t k;
+			for (k = 0; k < n / (ssize_t)sizeof(unsigned); k++)
+				if (buf[k] == MARK) break;
+			if (k < n / (ssize_t)sizeof(unsigned)) {
+				off = pos + k * sizeof(unsigned);
+				break;
+			}
+		}
+	}
+	if (off != -1 && pread(fd, &c, 1, off) == 1) {
+		c ^= 0x10;
+		if (pwrite(fd, &c, 1, off) == 1) ret = 0;
+	}
+	close(fd);
+	return(ret);
+}
+
+int main(void)
+{
+	int i, ret;
+	size_t j;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = (i+1) * 1031;
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		for (j = 0; j < size[i]; j++) addr[i][j] = value(i, j);
+	}
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:0 - after backup();\n");
+
+	/* a corrupt image is refused by a verified restore */
+	ret = flip_mark();
+	if (ret) {
+		fprintf(stderr, "%s(): Error corrupting backup file\n", __func__);
+		goto RETURN;
+	}
+	if (restore() != -1) {
+		fprintf(stderr, "%s(): restore() missed corruption\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "step:1 - after corrupt restore();\n");
+
+	/* a lazy restore defers the check to restore_verify() */
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+	setenv("PERM_VERIFY", "lazy", 1);
+	ret = bopen(BACK_FILE, "r+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in lazy restore()\n", __func__);
+		goto RETURN;
+	}
+	if (restore_verify(NULL, 0) != -1) {
+		fprintf(stderr, "%s(): restore_verify() missed corruption\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "step:2 - after corrupt restore_verify();\n");
+
+	ret = flip_mark();
+	if (ret) {
+		fprintf(stderr, "%s(): Error repairing backup file\n", __func__);
+		goto RETURN;
+	}
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in lazy restore()\n", __func__);
+		goto RETURN;
+	}
+	ret = restore_verify(addr[0], size[0] * sizeof(unsigned)) ||
+		restore_verify(NULL, 0);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore_verify()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:3 - after restore_verify();\n");
+	ret = check_blocks();
+	if (ret) goto RETURN;
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
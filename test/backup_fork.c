@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 64
+
+#define BACK_FILE "test/fork.back"
+#define MMAP_FILE "test/fork.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM unsigned char *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+PERM int step;
+
+int check_blocks(unsigned char c)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != c) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], c, &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+	perm(&step, sizeof(step));
+#endif
+	/* a snapshot needs a private (copy-on-write) mapping */
+	ret = mopen(MMAP_FILE, "w+p", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	/* after mopen(), since setenv() may allocate */
+	setenv("PERM_SNAPSHOT", "fork", 1);
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = (i+1) * 4099;
+		addr[i] = JEMALLOC_P(malloc)(size[i]);
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		memset(addr[i], 0x5A, size[i]);
+	}
+	step = 1;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	/* keep running while the snapshot is written */
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xA5, size[i]);
+	step = 2;
+	if (backup_poll() == -1 || backup_wait()) {
+		fprintf(stderr, "%s(): Error in background backup\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	if (backup_poll() != 0) {
+		fprintf(stderr, "%s(): backup_poll() after backup_wait()\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after backup_wait();\n", step);
+	ret = check_blocks(0xA5);
+	if (ret) goto RETURN;
+
+	/* the snapshot holds the heap as it was when backup() was called */
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after restore();\n", step);
+	ret = check_blocks(0x5A);
+	if (ret) goto RETURN;
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 64
+#define NCHANGE 4
+
+#define BACK_FILE "test/incr.back"
+#define MMAP_FILE "test/incr.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM unsigned char *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+PERM int step;
+
+off_t file_size(const char *fname)
+{
+	struct stat st;
+
+	if (stat(fname, &st)) return(-1);
+	return(st.st_size);
+}
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		unsigned c = i < NCHANGE ? (i + 1) & 0xFF : i & 0xFF;
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != c) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], c, &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+	off_t base_sz, incr_sz;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+	perm(&step, sizeof(step));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	/* after mopen(), since setenv() may allocate */
+	setenv("PERM_INCR", "8", 1);
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = i < MAX_BLKS/2 ? (i+1) * 7 : (i+1) * 8191;
+		addr[i] = JEMALLOC_P(malloc)(size[i]);
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		memset(addr[i], i & 0xFF, size[i]);
+	}
+	step = 0;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in base backup()\n", __func__);
+		goto RETURN;
+	}
+	base_sz = file_size(BACK_FILE);
+
+	/* change a few blocks and write an increment */
+	for (i = 0; i < NCHANGE; i++)
+		memset(addr[i], (i + 1) & 0xFF, size[i]);
+	step = 1;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in incremental backup()\n", __func__);
+		goto RETURN;
+	}
+	incr_sz = file_size(BACK_FILE) - base_sz;
+	if (incr_sz <= 0 || incr_sz >= base_sz / 2) {
+		fprintf(stderr, "%s(): increment size:%ld base size:%ld\n",
+			__func__, (long)incr_sz, (long)base_sz);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after incremental backup();\n", step);
+
+	/* clobber the heap, then rebuild it from base and increment */
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xEE, size[i]);
+	step = 2;
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after restore();\n", step);
+	ret = check_blocks();
+	if (ret) goto RETURN;
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
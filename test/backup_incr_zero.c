@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 4
+#define BLK_SIZE ((size_t)8 << 20) /* huge, so freed chunks go to the heap */
+
+#define BACK_FILE "test/incr_zero.back"
+#define MMAP_FILE "test/incr_zero.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+PERM unsigned char *addr[MAX_BLKS];
+PERM int step;
+
+/* Block 1 is expected to read as zeros, the others as their index */
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		unsigned c = i == 1 ? 0 : i + 1;
+		for (j = 0; j < BLK_SIZE; j++) {
+			if (addr[i][j] != c) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p\n",
+					__func__, addr[i][j], c, &addr[i][j], i, addr[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+	uintptr_t old; /* address of a freed block */
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(&step, sizeof(step));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	/* after mopen(), since setenv() may allocate */
+	setenv("PERM_INCR", "8", 1);
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		addr[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		memset(addr[i], i + 1, BLK_SIZE);
+	}
+	step = 0;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in base backup()\n", __func__);
+		goto RETURN;
+	}
+
+	/* a freed block is released and reused zeroed */
+	old = (uintptr_t)addr[1];
+	JEMALLOC_P(free)(addr[1]);
+	addr[1] = JEMALLOC_P(calloc)(1, BLK_SIZE);
+	if ((uintptr_t)addr[1] != old) {
+		fprintf(stderr, "%s(): calloc() returned:%p expect:%p\n",
+			__func__, addr[1], (void *)old);
+		ret = 1;
+		goto RETURN;
+	}
+	/* only read, so its pages are not soft-dirty */
+	if ((ret = check_blocks())) goto RETURN;
+	step = 1;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in incremental backup()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after incremental backup();\n", step);
+
+	/* clobber the heap, then rebuild it from base and increment */
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xEE, BLK_SIZE);
+	step = 2;
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after restore();\n", step);
+	ret = check_blocks();
+	if (ret) goto RETURN;
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
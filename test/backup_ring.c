@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 64
+#define NGEN 3
+
+#define BACK_FILE "test/ring.back"
+#define MMAP_FILE "test/ring.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+PERM int step;
+
+unsigned value(int i, size_t j)
+{
+	return((unsigned)((i + step) * j % 1000));
+}
+
+int fill_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++)
+		for (j = 0; j < size[i]; j++) addr[i][j] = value(i, j);
+	return(backup());
+}
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != value(i, j)) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], value(i, j), &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+int restore_check(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xEE, size[i] * sizeof(unsigned));
+	step = -1;
+	if (restore()) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		return(-1);
+	}
+	fprintf(stderr, "step:%d - after restore();\n", step);
+	return(check_blocks());
+}
+
+/* Overwrite part of the second chunk of a generation file */
+int corrupt(const char *fname)
+{
+	char buf[4096];
+	int fd = open(fname, O_WRONLY);
+	int ret;
+
+	if (fd == -1) return(-1);
+	memset(buf, 0xFF, sizeof(buf));
+	ret = pwrite(fd, buf, sizeof(buf), (off_t)1 << 22) == sizeof(buf) ? 0 : -1;
+	close(fd);
+	return(ret);
+}
+
+int main(void)
+{
+	int i, ret;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+	perm(&step, sizeof(step));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	/* after mopen(), since setenv() may allocate */
+	setenv("PERM_RING", "3", 1);
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = (i+1) * 1031;
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+	}
+	/* one more generation than the ring holds */
+	for (step = 1; step <= NGEN + 1; step++) {
+		ret = fill_blocks();
+		if (ret) {
+			fprintf(stderr, "%s(): Error in backup()\n", __func__);
+			goto RETURN;
+		}
+		fprintf(stderr, "step:%d - after backup();\n", step);
+	}
+	ret = restore_check();
+	if (ret) goto RETURN;
+
+	/* the newest generation (4) replaced the first in slot 0 */
+	ret = corrupt(BACK_FILE ".0");
+	if (ret) {
+		fprintf(stderr, "%s(): Error corrupting generation\n", __func__);
+		goto RETURN;
+	}
+	ret = restore_check();
+	if (ret) goto RETURN;
+
+	/* the next generation replaces the corrupt one */
+	step = 5;
+	ret = fill_blocks();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after backup();\n", step);
+	ret = restore_check();
+	if (ret) goto RETURN;
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
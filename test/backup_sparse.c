@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 6
+#define BLK_SIZE ((size_t)8 << 20) /* huge, a whole number of chunks */
+
+#define BACK_FILE "test/sparse.back"
+#define MMAP_FILE "test/sparse.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+PERM unsigned char *addr[MAX_BLKS];
+PERM int step;
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 1; i < MAX_BLKS; i += 2) {
+		for (j = 0; j < BLK_SIZE; j += 4096) {
+			if (addr[i][j] != i) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p\n",
+					__func__, addr[i][j], i, &addr[i][j], i, addr[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+	struct stat st;
+	void *p;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(&step, sizeof(step));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		addr[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		memset(addr[i], i, BLK_SIZE);
+	}
+	/* free every other block, leaving free chunks inside the heap */
+	for (i = 0; i < MAX_BLKS; i += 2) {
+		JEMALLOC_P(free)(addr[i]);
+		addr[i] = NULL;
+	}
+	step = 1;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	/* the free chunks are holes in the backup file */
+	ret = stat(BACK_FILE, &st);
+	if (ret || (off_t)st.st_blocks * 512 >
+	    st.st_size - (off_t)(MAX_BLKS/2 * BLK_SIZE)) {
+		fprintf(stderr, "%s(): backup file size:%ld allocated:%ld\n",
+			__func__, (long)st.st_size, (long)st.st_blocks * 512);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after sparse backup();\n", step);
+
+	for (i = 1; i < MAX_BLKS; i += 2)
+		memset(addr[i], 0xEE, BLK_SIZE);
+	step = 2;
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "step:%d - after restore();\n", step);
+	ret = check_blocks();
+	if (ret) goto RETURN;
+
+	/* the free chunks can be allocated again */
+	p = JEMALLOC_P(malloc)(BLK_SIZE);
+	if (p == NULL) {
+		fprintf(stderr, "%s(): Error in malloc() after restore()\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	memset(p, 0x11, BLK_SIZE);
+	JEMALLOC_P(free)(p);
+	ret = check_blocks();
+	if (ret) goto RETURN;
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define NBLKS 100
+#define CHUNK ((size_t)4 << 20) /* the default chunk size */
+/*
+ * Blocks come in threes of adjacent chunks, since the heap takes a chunk for
+ * itself every three blocks. The middle block of each three below RUN is
+ * freed, and so are blocks RUN and RUN+1, and then RUN+2 in a new process.
+ */
+#define RUN 60
+
+#define MMAP_FILE "test/chunk_map.mmap"
+#define MMAP_SIZE ((size_t)1 << 30) /* limit, not file size */
+
+PERM unsigned char *blk[NBLKS];
+PERM unsigned char *hole, *run;
+
+int check_blocks(void)
+{
+	int i;
+
+	for (i = 0; i < NBLKS; i++) {
+		if (blk[i] == NULL) continue;
+		if (blk[i][0] != (unsigned char)(i + 1) ||
+		    blk[i][CHUNK - 1] != (unsigned char)(i + 1)) {
+			fprintf(stderr, "%s(): data corrupted in block(%d)\n",
+				__func__, i);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/* Allocate n chunks, which should be reused at expect */
+int check_reuse(size_t n, unsigned char *expect)
+{
+	unsigned char *p = JEMALLOC_P(malloc)(n * CHUNK);
+
+	if (p != expect) {
+		fprintf(stderr, "%s(): %zu chunks at %p, expect %p\n", __func__,
+			n, p, expect);
+		return(1);
+	}
+	JEMALLOC_P(free)(p);
+	return(0);
+}
+
+/* The free chunks of the heap are found again in a new process */
+int reopen(void)
+{
+	int i, ret;
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+	perm(&hole, sizeof(hole));
+	perm(&run, sizeof(run));
+#endif
+	ret = mopen(MMAP_FILE, "r+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		return(ret);
+	}
+	ret = check_blocks() || check_reuse(1, hole) || check_reuse(2, run);
+	if (ret) return(ret);
+	/* a free block next to a free run coalesces with it */
+	JEMALLOC_P(free)(blk[RUN + 2]);
+	blk[RUN + 2] = NULL;
+	ret = check_reuse(3, run);
+	if (ret) return(ret);
+	for (i = 0; i < NBLKS; i++) JEMALLOC_P(free)(blk[i]);
+	fprintf(stderr, "after mopen() in new process;\n");
+	return(mclose());
+}
+
+int run_child(const char *exe, const char *mode)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0) {
+		execl("/proc/self/exe", exe, mode, (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s(): Error reopening in new process\n", __func__);
+		return(1);
+	}
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret;
+
+	if (argc > 1 && strcmp(argv[1], "reopen") == 0)
+		return(reopen());
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+	perm(&hole, sizeof(hole));
+	perm(&run, sizeof(run));
+#endif
+	ret = mopen(MMAP_FILE, "w+g", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	for (i = 0; i < NBLKS; i++) {
+		blk[i] = JEMALLOC_P(malloc)(CHUNK);
+		if (blk[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		blk[i][0] = blk[i][CHUNK - 1] = i + 1;
+	}
+	hole = blk[1];
+	run = blk[RUN];
+	if (blk[RUN + 1] != run + CHUNK || blk[RUN + 2] != run + 2 * CHUNK) {
+		fprintf(stderr, "%s(): blocks %d..%d not adjacent\n", __func__,
+			RUN, RUN + 2);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after malloc();\n");
+
+	for (i = 0; i < RUN + 2; i++) {
+		if (i % 3 != 1 && i < RUN) continue;
+		JEMALLOC_P(free)(blk[i]);
+		blk[i] = NULL;
+	}
+	/* first fit: the lowest hole, and the run for more than one chunk */
+	ret = check_reuse(1, hole) || check_reuse(2, run) || check_blocks();
+	if (ret) goto RETURN;
+	fprintf(stderr, "after free();\n");
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+	ret = run_child(argv[0], "reopen");
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
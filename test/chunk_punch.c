@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 4
+#define BLK_SIZE ((size_t)8 << 20) /* huge, so freed chunks go to the heap */
+
+#define BACK_FILE "test/punch.back"
+#define MMAP_FILE "test/punch.mmap"
+#define MMAP_SIZE ((size_t)1 << 30) /* limit, not file size */
+
+PERM unsigned char *addr[MAX_BLKS];
+
+int file_stat(const char *fname, struct stat *st)
+{
+	if (stat(fname, st)) {
+		fprintf(stderr, "%s(): Error in stat(): %s\n", __func__,
+			strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+int check_block(unsigned char *p, int c)
+{
+	size_t j;
+
+	for (j = 0; j < BLK_SIZE; j++) {
+		if (p[j] != c) {
+			fprintf(stderr,
+				"%s(): data corrupted found:%d expect:%d at:%p in block:%p\n",
+				__func__, p[j], c, &p[j], p);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+	uintptr_t old; /* address of a freed block */
+	struct stat full, punched, trimmed;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+#endif
+	ret = mopen(MMAP_FILE, "w+g", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		addr[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		memset(addr[i], i + 1, BLK_SIZE);
+	}
+	ret = mflush();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mflush()\n", __func__);
+		goto RETURN;
+	}
+	if ((ret = file_stat(MMAP_FILE, &full))) goto RETURN;
+
+	/* an interior block is punched out of the file */
+	old = (uintptr_t)addr[1];
+	JEMALLOC_P(free)(addr[1]);
+	addr[1] = NULL;
+	if ((ret = file_stat(MMAP_FILE, &punched))) goto RETURN;
+	if (punched.st_size != full.st_size ||
+	    (off_t)(full.st_blocks - punched.st_blocks) * 512 < (off_t)BLK_SIZE) {
+		fprintf(stderr, "%s(): blocks:%ld->%ld after free()\n",
+			__func__, (long)full.st_blocks, (long)punched.st_blocks);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after free();\n");
+
+	/* and is reused zeroed */
+	addr[1] = JEMALLOC_P(calloc)(1, BLK_SIZE);
+	if ((uintptr_t)addr[1] != old) {
+		fprintf(stderr, "%s(): calloc() returned:%p expect:%p\n",
+			__func__, addr[1], (void *)old);
+		ret = 1;
+		goto RETURN;
+	}
+	if ((ret = check_block(addr[1], 0))) goto RETURN;
+	memset(addr[1], 2, BLK_SIZE);
+
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+
+	/* the last block is truncated off the file */
+	JEMALLOC_P(free)(addr[MAX_BLKS-1]);
+	addr[MAX_BLKS-1] = NULL;
+	if ((ret = file_stat(MMAP_FILE, &trimmed))) goto RETURN;
+	if (full.st_size - trimmed.st_size < (off_t)BLK_SIZE) {
+		fprintf(stderr, "%s(): size:%ld->%ld after free()\n",
+			__func__, (long)full.st_size, (long)trimmed.st_size);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after truncate;\n");
+
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	for (i = 0; i < MAX_BLKS; i++)
+		if ((ret = check_block(addr[i], i + 1))) goto RETURN;
+	fprintf(stderr, "after restore();\n");
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
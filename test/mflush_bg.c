@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 32
+
+#define MMAP_FILE "test/flush.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+
+uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Change the blocks, in all 8 MiB of them, and return when */
+uint64_t touch_blocks(unsigned v)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++)
+		for (j = 0; j < size[i]; j++) addr[i][j] = v + i * j;
+	return(now_ms());
+}
+
+/* Wait up to 5 seconds for a flusher pass to start after a change */
+int wait_flush(uint64_t changed, const char *why)
+{
+	uint64_t lag;
+	size_t sz = sizeof(lag);
+	int ms;
+
+	for (ms = 0; ms < 5000; ms += 10) {
+		usleep(10000);
+		if (JEMALLOC_P(mallctl)("swap.flush.lag", &lag, &sz, NULL, 0)) {
+			fprintf(stderr, "%s(): Error reading swap.flush.lag\n", __func__);
+			return(-1);
+		}
+		if (lag + 1 < now_ms() - changed) {
+			fprintf(stderr, "after %s;\n", why);
+			return(0);
+		}
+	}
+	fprintf(stderr, "%s(): no flush after %s, lag:%llu ms\n", __func__,
+		why, (unsigned long long)lag);
+	return(-1);
+}
+
+int set_flush(const char *level, unsigned interval, size_t dirty)
+{
+	if (JEMALLOC_P(mallctl)("swap.flush.interval", NULL, NULL, &interval,
+	    sizeof(interval)) ||
+	    JEMALLOC_P(mallctl)("swap.flush.dirty", NULL, NULL, &dirty,
+	    sizeof(dirty)) ||
+	    JEMALLOC_P(mallctl)("swap.flush.level", NULL, NULL, &level,
+	    sizeof(level))) {
+		fprintf(stderr, "%s(): Error setting flusher to %s\n", __func__, level);
+		return(-1);
+	}
+	return(0);
+}
+
+int main(void)
+{
+	int i, ret;
+	const char *level;
+	size_t sz = sizeof(level);
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = JEMALLOC_P(mallctl)("swap.flush.level", &level, &sz, NULL, 0);
+	if (ret || strcmp(level, "none") != 0) {
+		fprintf(stderr, "%s(): flusher not off after mopen()\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = 65536;
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+	}
+	fprintf(stderr, "after malloc();\n");
+
+	/* the interval is too long, so only the dirty bytes start a pass */
+	if ((ret = set_flush("sync", 60000, (size_t)1 << 20))) goto RETURN;
+	if ((ret = wait_flush(touch_blocks(1), "dirty sync flush"))) goto RETURN;
+	if ((ret = set_flush("async", 50, 0))) goto RETURN;
+	if ((ret = wait_flush(touch_blocks(2), "interval async flush")))
+		goto RETURN;
+
+	level = "bogus";
+	if (JEMALLOC_P(mallctl)("swap.flush.level", NULL, NULL, &level,
+	    sizeof(level)) != EINVAL) {
+		fprintf(stderr, "%s(): unknown level accepted\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	if ((ret = set_flush("none", 1000, 0))) goto RETURN;
+	fprintf(stderr, "after flusher off;\n");
+
+	ret = mflush();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mflush()\n", __func__);
+		goto RETURN;
+	}
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
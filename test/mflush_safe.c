@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+
+#define NTHREADS 4
+#define NBLKS 64
+#define NFLUSH 20
+
+#define MMAP_FILE "test/safe.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+static volatile int stop;
+
+/* Allocate, fill, check and free blocks until stopped */
+void *thread_start(void *arg)
+{
+	unsigned id = (unsigned)(uintptr_t)arg;
+	unsigned seed = id + 1, *p[NBLKS];
+	size_t n[NBLKS];
+	uintptr_t errors = 0;
+	int i;
+	size_t j;
+
+	memset(p, 0, sizeof(p));
+	while (!stop) {
+		for (i = 0; i < NBLKS; i++) {
+			seed = seed * 1103515245 + 12345;
+			/* small and large size classes */
+			n[i] = 1 + (seed >> 8) % ((i & 7) ? 64 : 4096);
+			p[i] = JEMALLOC_P(malloc)(n[i] * sizeof(unsigned));
+			if (p[i] == NULL) {
+				errors++;
+				continue;
+			}
+			for (j = 0; j < n[i]; j++) p[i][j] = id ^ (i + j);
+		}
+		for (i = 0; i < NBLKS; i++) {
+			if (p[i] == NULL) continue;
+			for (j = 0; j < n[i]; j++)
+				if (p[i][j] != (id ^ (i + j))) errors++;
+			JEMALLOC_P(free)(p[i]);
+		}
+	}
+	return((void *)errors);
+}
+
+int main(void)
+{
+	pthread_t thds[NTHREADS];
+	uint64_t count;
+	size_t sz = sizeof(count);
+	void *res;
+	uintptr_t errors = 0;
+	int i, ret;
+
+	fprintf(stderr, "Test begin\n");
+
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	for (i = 0; i < NTHREADS; i++) {
+		if (pthread_create(&thds[i], NULL, thread_start,
+		    (void *)(uintptr_t)i) != 0) {
+			fprintf(stderr, "%s(): Error in pthread_create()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+	}
+	fprintf(stderr, "after pthread_create();\n");
+
+	/* every mflush() stops the allocating threads at a safepoint */
+	for (i = 0; i < NFLUSH && ret == 0; i++) {
+		usleep(5000);
+		ret = mflush();
+	}
+	stop = 1;
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_join(thds[i], &res);
+		errors += (uintptr_t)res;
+	}
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mflush()\n", __func__);
+		goto RETURN;
+	}
+	if (errors) {
+		fprintf(stderr, "%s(): %lu bad blocks\n", __func__,
+			(unsigned long)errors);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after mflush() with threads;\n");
+
+	ret = JEMALLOC_P(mallctl)("swap.safepoint.count", &count, &sz, NULL, 0);
+	if (ret || count < NFLUSH) {
+		fprintf(stderr, "%s(): %llu safepoints for %d flushes\n", __func__,
+			(unsigned long long)count, NFLUSH);
+		ret = 1;
+		goto RETURN;
+	}
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
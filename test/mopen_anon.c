@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 64
+
+#define BACK_FILE "test/anon.back"
+#define MMAP_SIZE ((size_t)1 << 28) /* limit of the anonymous heap */
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != (unsigned)(i * j)) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], (unsigned)(i * j), &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+/* Is the mapping holding ptr backed by a file? */
+int file_mapped(void *ptr)
+{
+	char line[512];
+	FILE *fp = fopen("/proc/self/maps", "r");
+	int found = -1;
+
+	if (fp == NULL) return(-1);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		void *start, *end;
+		unsigned long inode;
+
+		if (sscanf(line, "%p-%p %*s %*s %*s %lu", &start, &end, &inode) == 3 &&
+		    (char *)ptr >= (char *)start && (char *)ptr < (char *)end) {
+			found = inode != 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return(found);
+}
+
+/* A new process puts the heap back at its recorded address */
+int restore_new(void)
+{
+	int ret;
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(BACK_FILE, "r+a", 0);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		return(ret);
+	}
+	ret = bopen(BACK_FILE, "r+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		return(ret);
+	}
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		return(ret);
+	}
+	ret = check_blocks();
+	if (ret) return(ret);
+	fprintf(stderr, "after restore() in new process;\n");
+	bclose();
+	mclose();
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret, status;
+	size_t j;
+	pid_t pid;
+
+	if (argc > 1 && strcmp(argv[1], "restore") == 0) return(restore_new());
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(NULL, "w+a", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = (i+1) * 1031;
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		for (j = 0; j < size[i]; j++) addr[i][j] = (unsigned)(i * j);
+	}
+	if (file_mapped(addr[0]) != 0) {
+		fprintf(stderr, "%s(): heap is not anonymous\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after malloc();\n");
+
+	ret = mflush();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mflush()\n", __func__);
+		goto RETURN;
+	}
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xEE, size[i] * sizeof(unsigned));
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	ret = check_blocks();
+	if (ret) goto RETURN;
+	fprintf(stderr, "after restore();\n");
+
+	pid = fork();
+	if (pid == 0) {
+		execl("/proc/self/exe", argv[0], "restore", (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s(): Error restoring in new process\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
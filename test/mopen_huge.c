@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 16
+
+#define BACK_FILE "test/huge.back"
+#define MMAP_FILE "test/huge.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != (unsigned)(i * j)) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u at:%p in block(%d):%p size:%zu\n",
+					__func__, addr[i][j], (unsigned)(i * j), &addr[i][j], i, addr[i], size[i]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+/* Is the mapping holding ptr advised to use huge pages? */
+int huge_advised(void *ptr)
+{
+	char line[512];
+	FILE *fp = fopen("/proc/self/smaps", "r");
+	int in = 0, found = 0;
+
+	if (fp == NULL) return(-1);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		void *start, *end;
+
+		if (sscanf(line, "%p-%p ", &start, &end) == 2) {
+			in = (char *)ptr >= (char *)start && (char *)ptr < (char *)end;
+			continue;
+		}
+		if (in && strncmp(line, "VmFlags:", 8) == 0) {
+			found = strstr(line, " hg") != NULL;
+			break;
+		}
+	}
+	fclose(fp);
+	return(found);
+}
+
+int main(void)
+{
+	int i, ret;
+	size_t j;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(MMAP_FILE, "w+h", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	setenv("PERM_RESTORE", "map", 1);
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = (i+1) * 4099;
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		for (j = 0; j < size[i]; j++) addr[i][j] = (unsigned)(i * j);
+	}
+	if (huge_advised(addr[0]) != 1) {
+		fprintf(stderr, "%s(): heap not advised for huge pages\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after malloc();\n");
+
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	for (i = 0; i < MAX_BLKS; i++)
+		memset(addr[i], 0xEE, size[i] * sizeof(unsigned));
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	/* the advice is kept when the heap is mapped from the backup file */
+	if (huge_advised(addr[0]) != 1) {
+		fprintf(stderr, "%s(): restored heap not advised for huge pages\n",
+			__func__);
+		ret = 1;
+		goto RETURN;
+	}
+	ret = check_blocks();
+	if (ret) goto RETURN;
+	fprintf(stderr, "after restore();\n");
+
+	ret = mflush();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mflush()\n", __func__);
+		goto RETURN;
+	}
+	/* and when it is mapped from the map file again */
+	if (huge_advised(addr[0]) != 1) {
+		fprintf(stderr, "%s(): remapped heap not advised for huge pages\n",
+			__func__);
+		ret = 1;
+		goto RETURN;
+	}
+	ret = check_blocks();
+	if (ret) goto RETURN;
+	fprintf(stderr, "after mflush();\n");
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
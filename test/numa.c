@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define NBLKS 3
+
+#define MMAP_FILE "test/numa.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM char *blk[NBLKS];
+
+/* a small, a large and a huge block */
+size_t blk_size[NBLKS] = {100, 100000, (size_t)1 << 23};
+
+/* Check that NUMA is on, and that node 0 holds heap chunks */
+int check_nodes(void)
+{
+	unsigned nnodes;
+	size_t nchunks, sz;
+	uint64_t epoch = 1;
+	bool numa;
+
+	sz = sizeof(numa);
+	if (JEMALLOC_P(mallctl)("opt.numa", &numa, &sz, NULL, 0) || !numa) {
+		fprintf(stderr, "%s(): opt.numa not set\n", __func__);
+		return(1);
+	}
+	sz = sizeof(nnodes);
+	if (JEMALLOC_P(mallctl)("arenas.nnodes", &nnodes, &sz, NULL, 0) ||
+	    nnodes == 0) {
+		fprintf(stderr, "%s(): Error in arenas.nnodes\n", __func__);
+		return(1);
+	}
+	sz = sizeof(epoch);
+	JEMALLOC_P(mallctl)("epoch", &epoch, &sz, &epoch, sz);
+	sz = sizeof(nchunks);
+	if (JEMALLOC_P(mallctl)("stats.nodes.0.nchunks", &nchunks, &sz, NULL,
+	    0) || nchunks == 0) {
+		fprintf(stderr, "%s(): no chunks on node 0\n", __func__);
+		return(1);
+	}
+	return(0);
+}
+
+int check_blocks(void)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < NBLKS; i++) {
+		for (j = 0; j < blk_size[i]; j++) {
+			if (blk[i][j] != (char)(i + 1)) {
+				fprintf(stderr, "%s(): data corrupted in block(%d)\n",
+					__func__, i);
+				return(1);
+			}
+		}
+	}
+	return(0);
+}
+
+/* Reopen the heap, whose chunks are placed back on their nodes */
+int reopen(void)
+{
+	int i, ret;
+
+	JEMALLOC_P(malloc_conf) = "numa:true";
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+#endif
+	ret = mopen(MMAP_FILE, "r+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		return(ret);
+	}
+	ret = check_nodes() || check_blocks();
+	if (ret) return(ret);
+	for (i = 0; i < NBLKS; i++) JEMALLOC_P(free)(blk[i]);
+	fprintf(stderr, "after mopen() in new process;\n");
+	return(mclose());
+}
+
+int run_child(const char *exe, const char *mode)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0) {
+		execl("/proc/self/exe", exe, mode, (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s(): Error reopening in new process\n", __func__);
+		return(1);
+	}
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret;
+
+	if (argc > 1 && strcmp(argv[1], "reopen") == 0)
+		return(reopen());
+
+	fprintf(stderr, "Test begin\n");
+
+	JEMALLOC_P(malloc_conf) = "numa:true";
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	for (i = 0; i < NBLKS; i++) {
+		blk[i] = JEMALLOC_P(malloc)(blk_size[i]);
+		if (blk[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		memset(blk[i], i + 1, blk_size[i]);
+	}
+	ret = check_nodes();
+	if (ret) goto RETURN;
+	fprintf(stderr, "after malloc();\n");
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+	ret = run_child(argv[0], "reopen");
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define NARENAS 4
+#define MAX_BLKS 64
+
+#define MMAP_FILE "test/percpu.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM void *blk[MAX_BLKS];
+
+/* Free the blocks in a thread that may run on another CPU */
+void *thread_free(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < MAX_BLKS; i++) JEMALLOC_P(free)(blk[i]);
+	return(NULL);
+}
+
+int main(void)
+{
+	pthread_t thd;
+	cpu_set_t set;
+	unsigned arena;
+	size_t sz = sizeof(arena);
+	int i, cpu, ret;
+	bool percpu;
+
+	fprintf(stderr, "Test begin\n");
+
+	JEMALLOC_P(malloc_conf) = "percpu_arena:true,narenas:4";
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(blk, sizeof(blk));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	sz = sizeof(percpu);
+	ret = JEMALLOC_P(mallctl)("opt.percpu_arena", &percpu, &sz, NULL, 0);
+	if (ret || percpu == false) {
+		fprintf(stderr, "%s(): opt.percpu_arena not set\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+
+	/* keep the thread on one CPU, whose arena it then uses */
+	cpu = sched_getcpu();
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		perror("sched_setaffinity");
+		ret = 1;
+		goto RETURN;
+	}
+	for (i = 0; i < MAX_BLKS; i++) {
+		blk[i] = JEMALLOC_P(malloc)(100 + i * 300);
+		if (blk[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+	}
+	sz = sizeof(arena);
+	ret = JEMALLOC_P(mallctl)("thread.arena", &arena, &sz, NULL, 0);
+	if (ret || arena != (unsigned)cpu % NARENAS) {
+		fprintf(stderr, "%s(): arena:%u on cpu:%d\n", __func__, arena, cpu);
+		ret = 1;
+		goto RETURN;
+	}
+	fprintf(stderr, "after malloc();\n");
+
+	pthread_create(&thd, NULL, thread_free, NULL);
+	pthread_join(thd, NULL);
+	for (i = 0; i < MAX_BLKS; i++) {
+		blk[i] = JEMALLOC_P(malloc)(100 + i * 300);
+		if (blk[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		JEMALLOC_P(free)(blk[i]);
+	}
+	fprintf(stderr, "after free() in another thread;\n");
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
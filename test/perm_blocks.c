@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define NGLOB 200
+
+#define BACK_FILE "test/blocks.back"
+#define MMAP_FILE "test/blocks.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM long glob[2 * NGLOB];
+PERM long *block;
+
+int main(void)
+{
+	int i, ret;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	/* more separate blocks than the registry used to hold, out of order */
+	for (i = NGLOB - 1; i >= 0; i--)
+		perm(&glob[2 * i], sizeof(long));
+	/* overlaps the first two blocks and the gap between them */
+	perm(&glob[0], 3 * sizeof(long));
+	perm(&block, sizeof(block));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	block = JEMALLOC_P(malloc)(NGLOB * sizeof(long));
+	if (block == NULL) {
+		fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	for (i = 0; i < 2 * NGLOB; i++) glob[i] = (long)i * i;
+	for (i = 0; i < NGLOB; i++) block[i] = -i;
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "after backup();\n");
+
+	for (i = 0; i < 2 * NGLOB; i++) glob[i] = -1;
+	for (i = 0; i < NGLOB; i++) block[i] = 1;
+	block = NULL;
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "after restore();\n");
+
+	for (i = 0; i < 2 * NGLOB; i++) {
+		if ((i % 2 == 0 || i == 1) && glob[i] != (long)i * i) {
+			fprintf(stderr, "%s(): glob[%d] found:%ld expect:%ld\n",
+				__func__, i, glob[i], (long)i * i);
+			ret = 1;
+			goto RETURN;
+		}
+	}
+	if (block == NULL) {
+		fprintf(stderr, "%s(): block == NULL\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+	for (i = 0; i < NGLOB; i++) {
+		if (block[i] != -i) {
+			fprintf(stderr, "%s(): block[%d] found:%ld expect:%d\n",
+				__func__, i, block[i], -i);
+			ret = 1;
+			goto RETURN;
+		}
+	}
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define MAX_BLKS 6
+
+#define MMAP_FILE "test/pflush.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+PERM unsigned *addr[MAX_BLKS];
+PERM size_t size[MAX_BLKS];
+
+/* small, large, and huge objects */
+const size_t sizes[MAX_BLKS] = {7, 100, 1031, 16384, 300000, 1100000};
+
+int check_blocks(unsigned v)
+{
+	int i;
+	size_t j;
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) {
+			if (addr[i][j] != v + (unsigned)(i * j)) {
+				fprintf(stderr,
+					"%s(): data corrupted found:%u expect:%u in block(%d) at:%zu\n",
+					__func__, addr[i][j], v + (unsigned)(i * j), i, j);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+/*
+ * A new process maps the file, which only pflush() and mflush_range()
+ * wrote to, and finds the objects and their allocations.
+ */
+int reopen_new(void)
+{
+	unsigned *p[MAX_BLKS];
+	int i, k, ret;
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	ret = mopen(MMAP_FILE, "r+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		return(ret);
+	}
+	ret = check_blocks(1);
+	if (ret) return(ret);
+
+	/* the allocations were recorded, so new ones do not overlap them */
+	for (i = 0; i < MAX_BLKS; i++) {
+		p[i] = JEMALLOC_P(malloc)(sizes[i] * sizeof(unsigned));
+		if (p[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			return(1);
+		}
+		for (k = 0; k < MAX_BLKS; k++) {
+			if (p[i] < addr[k] + size[k] && addr[k] < p[i] + sizes[i]) {
+				fprintf(stderr, "%s(): new block(%d) overlaps block(%d)\n",
+					__func__, i, k);
+				return(1);
+			}
+		}
+	}
+	for (i = 0; i < MAX_BLKS; i++) {
+		JEMALLOC_P(free)(p[i]);
+		JEMALLOC_P(free)(addr[i]);
+	}
+	fprintf(stderr, "after mopen() in new process;\n");
+	mclose();
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret, status;
+	size_t j;
+	pid_t pid;
+	unsigned local;
+
+	if (argc > 1 && strcmp(argv[1], "reopen") == 0) return(reopen_new());
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(addr, sizeof(addr));
+	perm(size, sizeof(size));
+#endif
+	/* with a private mapping, the file only changes when written */
+	ret = mopen(MMAP_FILE, "w+p", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		size[i] = sizes[i];
+		addr[i] = JEMALLOC_P(malloc)(size[i] * sizeof(unsigned));
+		if (addr[i] == NULL) {
+			fprintf(stderr, "%s(): Error in malloc()\n", __func__);
+			ret = 1;
+			goto RETURN;
+		}
+		for (j = 0; j < size[i]; j++) addr[i][j] = (unsigned)(i * j);
+		ret = pflush(addr[i]);
+		if (ret) {
+			fprintf(stderr, "%s(): Error in pflush()\n", __func__);
+			goto RETURN;
+		}
+	}
+	fprintf(stderr, "after pflush();\n");
+
+	for (i = 0; i < MAX_BLKS; i++) {
+		for (j = 0; j < size[i]; j++) addr[i][j]++;
+		ret = mflush_range(addr[i], size[i] * sizeof(unsigned));
+		if (ret) {
+			fprintf(stderr, "%s(): Error in mflush_range()\n", __func__);
+			goto RETURN;
+		}
+	}
+	fprintf(stderr, "after mflush_range();\n");
+
+	if (pflush(&local) != -1 || errno != EINVAL) {
+		fprintf(stderr, "%s(): pflush() outside of the heap\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		execl("/proc/self/exe", argv[0], "reopen", (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s(): Error reopening in new process\n", __func__);
+		ret = 1;
+		goto RETURN;
+	}
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
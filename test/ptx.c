@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define REC_LEN 1031
+
+#define MMAP_FILE "test/ptx.mmap"
+#define MMAP_SIZE ((size_t)1 << 27)
+
+PERM unsigned *rec;
+PERM unsigned count;
+PERM unsigned *last; /* not logged */
+
+void set_rec(unsigned v)
+{
+	int i;
+
+	for (i = 0; i < REC_LEN; i++) rec[i] = v + i;
+}
+
+int check_rec(unsigned v, unsigned n, const char *why)
+{
+	int i;
+
+	if (count != n) {
+		fprintf(stderr, "%s: count:%u expect:%u\n", why, count, n);
+		return(-1);
+	}
+	for (i = 0; i < REC_LEN; i++) {
+		if (rec[i] != v + i) {
+			fprintf(stderr, "%s: rec[%d]:%u expect:%u\n", why, i, rec[i],
+				v + i);
+			return(-1);
+		}
+	}
+	fprintf(stderr, "%s;\n", why);
+	return(0);
+}
+
+int open_heap(const char *mode)
+{
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(&rec, sizeof(rec));
+	perm(&count, sizeof(count));
+	perm(&last, sizeof(last));
+#endif
+	if (mopen(MMAP_FILE, mode, MMAP_SIZE)) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		return(-1);
+	}
+	return(0);
+}
+
+/* Change the heap in a transaction and exit before it commits */
+int crash_new(void)
+{
+	if (open_heap("r+")) return(1);
+	if (ptx_begin() || ptx_add_range(rec, REC_LEN * sizeof(unsigned)) ||
+	    ptx_add_range(&count, sizeof(count)))
+		return(1);
+	set_rec(300);
+	count = 3;
+	last = ptx_malloc(64);
+	ptx_free(rec);
+	/* the changed globals reach the heap */
+	if (last == NULL || mflush()) return(1);
+	_exit(0);
+}
+
+/* Reopening the heap rolls the transaction back */
+int recover_new(void)
+{
+	unsigned *p;
+
+	if (open_heap("r+")) return(1);
+	if (check_rec(100, 1, "after rollback in new process")) return(1);
+	p = JEMALLOC_P(malloc)(64);
+	if (p != last) {
+		fprintf(stderr, "%s(): object of rolled back transaction not freed\n",
+			__func__);
+		return(1);
+	}
+	JEMALLOC_P(free)(p);
+	mclose();
+	return(0);
+}
+
+int run(char *prog, const char *arg)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execl("/proc/self/exe", prog, arg, (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s(): Error in %s process\n", __func__, arg);
+		return(-1);
+	}
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned *p;
+	int ret;
+
+	if (argc > 1 && strcmp(argv[1], "crash") == 0) return(crash_new());
+	if (argc > 1 && strcmp(argv[1], "recover") == 0) return(recover_new());
+
+	fprintf(stderr, "Test begin\n");
+
+	ret = open_heap("w+");
+	if (ret) goto RETURN;
+
+	ret = -1;
+	if (ptx_begin() || ptx_add_range(&rec, sizeof(rec)) ||
+	    ptx_add_range(&count, sizeof(count)))
+		goto RETURN;
+	rec = ptx_malloc(REC_LEN * sizeof(unsigned));
+	if (rec == NULL) goto RETURN;
+	set_rec(100);
+	count = 1;
+	if (ptx_commit() || check_rec(100, 1, "after ptx_commit()")) goto RETURN;
+
+	if (ptx_begin() || ptx_add_range(rec, REC_LEN * sizeof(unsigned)) ||
+	    ptx_add_range(&count, sizeof(count)))
+		goto RETURN;
+	set_rec(200);
+	count = 2;
+	p = ptx_malloc(64);
+	ptx_free(rec);
+	if (p == NULL || ptx_abort() || check_rec(100, 1, "after ptx_abort()"))
+		goto RETURN;
+	if (JEMALLOC_P(malloc)(64) != p) {
+		fprintf(stderr, "%s(): object of aborted transaction not freed\n",
+			__func__);
+		goto RETURN;
+	}
+
+	/* a nested transaction is rolled back with the outer one */
+	if (ptx_begin() || ptx_begin() ||
+	    ptx_add_range(&count, sizeof(count)))
+		goto RETURN;
+	count = 5;
+	if (ptx_commit() || ptx_abort() || check_rec(100, 1, "after nested abort"))
+		goto RETURN;
+	if (ptx_commit() != -1 || errno != EINVAL) {
+		fprintf(stderr, "%s(): commit without transaction\n", __func__);
+		goto RETURN;
+	}
+
+	if (mclose() || run(argv[0], "crash") || run(argv[0], "recover"))
+		goto RETURN;
+	ret = 0;
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}
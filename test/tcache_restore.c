@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2013, Lawrence Livermore National Security, LLC. 
+ * Produced at the Lawrence Livermore National Laboratory. Written by
+ * G. Scott Lloyd, lloyd23@llnl.gov. LLNL-CODE-613632. All rights reserved.
+ * 
+ * This file is part of PERM. For details, see
+ * http://computation.llnl.gov/casc/perm/ 
+ * 
+ * Please also read COPYING.LLNL  Our Notice and GNU Lesser General Public 
+ * License. 
+ * 
+ * This program is free software; you can redistribute it and/or modify it 
+ * under the terms of the GNU General Public License (as published by the 
+ * Free Software Foundation) version 2.1 dated February 1999. 
+ * 
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and 
+ * conditions of the GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU Lesser General Public License 
+ * along with this program; if not, write to the Free Software Foundation, 
+ * Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define	JEMALLOC_MANGLE
+#include "jemalloc_test.h"
+#ifndef USE_PERM
+#undef PERM
+#define PERM
+#endif
+
+#define NTHREADS 4
+#define NBLKS 256
+#define BLK_SIZE 64
+
+#define BACK_FILE "test/tcache.back"
+#define MMAP_FILE "test/tcache.mmap"
+#define MMAP_SIZE ((size_t)1 << 26)
+
+PERM char *live[NBLKS];
+
+/* Fill the thread cache with freed objects before the backup */
+void *churn(void *arg)
+{
+	void *p[NBLKS];
+	int i;
+
+	(void)arg;
+	for (i = 0; i < NBLKS; i++) p[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+	for (i = 0; i < NBLKS; i++) JEMALLOC_P(free)(p[i]);
+	return(NULL);
+}
+
+int main(void)
+{
+	pthread_t thd[NTHREADS];
+	char *p[NBLKS];
+	int i, j, ret;
+
+	fprintf(stderr, "Test begin\n");
+
+#ifdef USE_PERM
+	perm(PERM_START, PERM_SIZE);
+#else
+	perm(live, sizeof(live));
+#endif
+	ret = mopen(MMAP_FILE, "w+", MMAP_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mopen()\n", __func__);
+		goto RETURN;
+	}
+	ret = bopen(BACK_FILE, "w+");
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bopen()\n", __func__);
+		goto RETURN;
+	}
+
+	for (i = 0; i < NTHREADS; i++)
+		pthread_create(&thd[i], NULL, churn, NULL);
+	for (i = 0; i < NTHREADS; i++)
+		pthread_join(thd[i], NULL);
+	for (i = 0; i < NBLKS; i++) {
+		live[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+		memset(live[i], i, BLK_SIZE);
+	}
+	ret = backup();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in backup()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "after backup();\n");
+
+	/* cached here, but allocated again in the restored heap */
+	for (i = 0; i < NBLKS; i++) JEMALLOC_P(free)(live[i]);
+	ret = restore();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in restore()\n", __func__);
+		goto RETURN;
+	}
+	fprintf(stderr, "after restore();\n");
+
+	for (i = 0; i < NBLKS; i++) {
+		p[i] = JEMALLOC_P(malloc)(BLK_SIZE);
+		memset(p[i], 0xEE, BLK_SIZE);
+	}
+	for (i = 0; i < NBLKS; i++) {
+		for (j = 0; j < BLK_SIZE; j++) {
+			if (live[i][j] != (char)i) {
+				fprintf(stderr,
+					"%s(): block(%d):%p reallocated after restore\n",
+					__func__, i, live[i]);
+				ret = 1;
+				goto RETURN;
+			}
+		}
+	}
+	for (i = 0; i < NBLKS; i++) JEMALLOC_P(free)(p[i]);
+	fprintf(stderr, "after malloc();\n");
+
+	ret = mclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in mclose()\n", __func__);
+		goto RETURN;
+	}
+	ret = bclose();
+	if (ret) {
+		fprintf(stderr, "%s(): Error in bclose()\n", __func__);
+		goto RETURN;
+	}
+
+RETURN:
+	fprintf(stderr, "Test end\n");
+	return (ret);
+}